@@ -36,7 +36,7 @@ int main(int argc, char **argv)
     TIMER_START();
     auto bldr = ts::Builder<lsm::key_t>(g_min_key, g_max_key, 100);
     for (size_t i=0; i<mem_isam->get_record_count(); i++) {
-        bldr.AddKey(mem_isam->get_record_at(i)->key);
+        bldr.AddKey(mem_isam->get_key_at(i));
     }
     auto cht = bldr.Finalize();
     TIMER_STOP();
@@ -12,11 +12,23 @@ namespace lsm {
 
 class Alias {
 public:
-    Alias(const std::vector<double>& weights)
-    : m_alias(weights.size()), m_cutoff(weights.size()) {
+    Alias(const std::vector<double>& weights) {
+        build(weights);
+    }
+
+    /*
+     * Rebuild the structure over a new set of weights, reusing the existing
+     * allocations where possible.
+     */
+    void build(const std::vector<double>& weights) {
         size_t n = weights.size();
-        auto overfull = std::vector<size_t>();
-        auto underfull = std::vector<size_t>();
+        m_alias.assign(n, 0);
+        m_cutoff.assign(n, 0);
+
+        auto &overfull = m_overfull;
+        auto &underfull = m_underfull;
+        overfull.clear();
+        underfull.clear();
         overfull.reserve(n);
         underfull.reserve(n);
 
@@ -59,6 +71,10 @@ public:
 private:
     std::vector<size_t> m_alias;
     std::vector<double> m_cutoff;
+
+    // Scratch space for build()
+    std::vector<size_t> m_overfull;
+    std::vector<size_t> m_underfull;
 };
 
 }
\ No newline at end of file
@@ -55,6 +55,36 @@ public:
     size_t get_memory_utilization() {
         return this->m_bitarray.mem_size();
     }
+
+    size_t get_bit_count() {
+        return m_n_bits;
+    }
+
+    size_t get_hash_count() {
+        return m_n_salts;
+    }
+
+    const uint16_t *get_salts() {
+        return salt;
+    }
+
+    const char *get_bits() {
+        return m_bitarray.data();
+    }
+
+    /*
+     * Replace the filter with one saved from get_salts and get_bits, with k
+     * hash functions over n_bits bits.
+     */
+    void load(const uint16_t *salts, size_t k, const char *bits, size_t n_bits) {
+        if (salt) free(salt);
+        salt = (uint16_t*) aligned_alloc(CACHELINE_SIZE, CACHELINEALIGN(k * sizeof(uint16_t)));
+        memcpy(salt, salts, k * sizeof(uint16_t));
+
+        m_n_salts = k;
+        m_n_bits = n_bits;
+        m_bitarray.load(bits, n_bits);
+    }
 private: 
     size_t m_n_salts;
     size_t m_n_bits;
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+
+#include "util/record.h"
+
+namespace lsm {
+
+struct queue_record {
+    const record_t* data;
+    size_t version;
+};
+
+/*
+ * A tournament tree for merging the sorted streams of up to size inputs,
+ * identified by their versions (0 to size - 1). Each internal node holds
+ * the loser of the match played there, and so replacing the record of the
+ * winning input replays only the matches along its path to the root, at
+ * one comparison per level, without looking at any siblings.
+ *
+ * Records are ordered by key and value, and then by version, so that for
+ * equal records the one from the lower version wins. The key of the current
+ * record of each input is cached alongside it, so most matches are decided
+ * without following the record pointers.
+ */
+class LoserTree {
+public:
+    LoserTree(size_t size)
+    : m_leaf_cnt(1), m_capacity(size), m_size(0), m_dirty(false) {
+        while (m_leaf_cnt < size) m_leaf_cnt <<= 1;
+
+        m_keys.resize(m_leaf_cnt, UINT64_MAX);
+        m_records.resize(m_leaf_cnt, nullptr);
+        m_nodes.resize(m_leaf_cnt, 0);
+    }
+
+    ~LoserTree() = default;
+
+    /*
+     * Returns the number of inputs that have a current record.
+     */
+    size_t size() const {
+        return m_size;
+    }
+
+    /*
+     * Set the current record of an input that has none, as when starting
+     * the merge.
+     */
+    void push(const record_t* record, size_t version=0) {
+        assert(version < m_capacity && !m_records[version]);
+        this->set(version, record);
+        m_dirty = true;
+    }
+
+    /*
+     * Remove the current record of the winning input.
+     */
+    void pop() {
+        this->replace(this->peek().version, nullptr);
+    }
+
+    /*
+     * Replace the current record of an input with the next one, or with
+     * nullptr if the input is exhausted. Replacing the record of the winner
+     * replays its path. Any other input, as when canceling a record against
+     * the tombstone following it, requires the tree to be rebuilt.
+     */
+    void replace(size_t version, const record_t* record) {
+        assert(version < m_capacity && m_records[version]);
+        if (m_dirty || version != m_nodes[0]) {
+            this->set(version, record);
+            m_dirty = true;
+            return;
+        }
+
+        this->set(version, record);
+
+        size_t cur = version;
+        for (size_t pos = (m_leaf_cnt + version) / 2; pos > 0; pos /= 2) {
+            if (this->less(m_nodes[pos], cur)) {
+                std::swap(m_nodes[pos], cur);
+            }
+        }
+
+        m_nodes[0] = cur;
+    }
+
+    /*
+     * Returns the smallest current record, and its input.
+     */
+    queue_record peek() {
+        assert(m_size > 0);
+        if (m_dirty) this->build();
+
+        return {m_records[m_nodes[0]], m_nodes[0]};
+    }
+
+    /*
+     * Returns the second smallest current record, and its input, or a
+     * null record if fewer than two inputs have one. This is the best of
+     * the inputs that lost to the winner along its path, and so is found
+     * without replaying any matches.
+     */
+    queue_record peek_next() {
+        if (m_size < 2) return {nullptr, 0};
+        if (m_dirty) this->build();
+
+        size_t best = m_nodes[(m_leaf_cnt + m_nodes[0]) / 2];
+        for (size_t pos = (m_leaf_cnt + m_nodes[0]) / 4; pos > 0; pos /= 2) {
+            if (this->less(m_nodes[pos], best)) {
+                best = m_nodes[pos];
+            }
+        }
+
+        return {m_records[best], best};
+    }
+
+private:
+    // The current record of each input, nullptr once it is exhausted, and
+    // its key, or UINT64_MAX if it is exhausted. The leaves are padded out
+    // to a power of two with exhausted inputs.
+    std::vector<key_t> m_keys;
+    std::vector<const record_t*> m_records;
+
+    // The loser of the match at each internal node, in heap order starting
+    // from 1, with the overall winner in m_nodes[0].
+    std::vector<size_t> m_nodes;
+
+    size_t m_leaf_cnt;
+    size_t m_capacity;
+    size_t m_size;
+
+    // True if the records have changed since the tree was last built.
+    bool m_dirty;
+
+    void set(size_t version, const record_t* record) {
+        m_size += (record != nullptr) - (m_records[version] != nullptr);
+        m_records[version] = record;
+        m_keys[version] = (record) ? record->key : UINT64_MAX;
+    }
+
+    /*
+     * Play every match from the leaves up.
+     */
+    void build() {
+        std::vector<size_t> winners(2 * m_leaf_cnt);
+        for (size_t i=0; i<m_leaf_cnt; i++) {
+            winners[m_leaf_cnt + i] = i;
+        }
+
+        for (size_t pos = m_leaf_cnt - 1; pos > 0; pos--) {
+            size_t left = winners[2 * pos];
+            size_t right = winners[2 * pos + 1];
+            bool left_wins = this->less(left, right);
+
+            winners[pos] = (left_wins) ? left : right;
+            m_nodes[pos] = (left_wins) ? right : left;
+        }
+
+        m_nodes[0] = winners[1];
+        m_dirty = false;
+    }
+
+    /*
+     * Returns true if the current record of input a orders before that of
+     * input b. Exhausted inputs order after all others.
+     */
+    inline bool less(size_t a, size_t b) const {
+        if (m_keys[a] != m_keys[b]) return m_keys[a] < m_keys[b];
+
+        // Exhausted inputs have the largest key, and so may only tie with
+        // each other, or with a record of that key.
+        if (!m_records[a] || !m_records[b]) {
+            return !m_records[b] && (m_records[a] || a < b);
+        }
+
+        if (m_records[a]->value != m_records[b]->value) return m_records[a]->value < m_records[b]->value;
+        return a < b;
+    }
+};
+
+}
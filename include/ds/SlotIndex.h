@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <new>
+
+#include "util/base.h"
+
+namespace lsm {
+
+/*
+ * A fixed-capacity, insert-only, open-addressing hash index from the hash
+ * of a record to its slot within some record buffer. Only the slot is
+ * stored, along with the upper bits of the hash to screen out most
+ * collisions, so lookups must confirm each candidate against the buffer
+ * itself via the provided match function.
+ *
+ * Inserts and lookups are lock-free, and may be performed concurrently.
+ * An entry becomes visible to lookups once its insert returns, and so a
+ * record should be fully written before it is indexed. Entries are only
+ * removed by clear(), which must not run concurrently with either.
+ */
+class SlotIndex {
+public:
+    /*
+     * Create an index that can hold up to capacity entries. The table is
+     * kept at most half full, so that probe sequences stay short.
+     */
+    SlotIndex(size_t capacity) {
+        m_size = 16;
+        while (m_size < 2 * capacity) m_size <<= 1;
+        m_mask = m_size - 1;
+
+        m_table = (std::atomic<uint64_t> *) std::aligned_alloc(CACHELINE_SIZE, CACHELINEALIGN(m_size * sizeof(uint64_t)));
+        for (size_t i=0; i<m_size; i++) {
+            new (&m_table[i]) std::atomic<uint64_t>(0);
+        }
+    }
+
+    ~SlotIndex() {
+        free(m_table);
+    }
+
+    /*
+     * Add an entry for the record in the specified slot.
+     */
+    void insert(uint64_t hash, uint32_t slot) {
+        uint64_t entry = make_entry(hash, slot);
+        for (size_t i=hash & m_mask; ; i=(i + 1) & m_mask) {
+            uint64_t expected = 0;
+            if (m_table[i].load(std::memory_order_relaxed) == 0 &&
+                m_table[i].compare_exchange_strong(expected, entry, std::memory_order_release)) {
+                return;
+            }
+        }
+    }
+
+    /*
+     * Returns the first slot indexed under hash for which match(slot)
+     * returns true, or -1 if there is none.
+     */
+    template <typename Match>
+    int64_t find(uint64_t hash, Match match) const {
+        uint32_t tag = hash >> 32;
+        for (size_t i=hash & m_mask; ; i=(i + 1) & m_mask) {
+            uint64_t entry = m_table[i].load(std::memory_order_acquire);
+            if (entry == 0) return -1;
+
+            if ((entry >> 32) == tag && match((uint32_t) entry - 1)) {
+                return (uint32_t) entry - 1;
+            }
+        }
+    }
+
+    void clear() {
+        for (size_t i=0; i<m_size; i++) {
+            m_table[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    size_t get_memory_utilization() {
+        return m_size * sizeof(uint64_t);
+    }
+
+private:
+    // Entries hold the upper 32 bits of the hash, and the slot plus one,
+    // so that an empty entry is 0.
+    static uint64_t make_entry(uint64_t hash, uint32_t slot) {
+        return (hash & 0xFFFFFFFF00000000ull) | (uint64_t) (slot + 1);
+    }
+
+    std::atomic<uint64_t> *m_table;
+    size_t m_size;
+    size_t m_mask;
+};
+
+}
@@ -297,7 +297,8 @@ class Builder {
 
   void ComputeCHTStatistics(std::vector<Statistics>& statistics) {
     // Compute the necessary amount of bits we need.
-    const unsigned lg = ComputeLog(max_key_ - min_key_, true);
+    // (Must match the number of bits used by the CHT builder.)
+    const unsigned lg = ComputeLog(max_key_ - min_key_) + 1;
     const unsigned alreadyCommon = (sizeof(KeyType) << 3) - lg;
 
     // Compute the longest common prefix.
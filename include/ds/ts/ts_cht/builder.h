@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <functional>
 #include <limits>
 
 #include "cht.h"
@@ -40,10 +42,12 @@ class Builder {
     // Set the parameters.
     num_bins_ = num_bins;
     max_error_ = max_error;
+    leaf_error_ = 0;
     log_num_bins_ = ComputeLog(static_cast<uint64_t>(num_bins_));
 
-    // Compute the logarithm in base 2 of the range.
-    auto lg = ComputeLog(max_key_ - min_key_, true);
+    // Compute the number of bits needed for the range. This is one more
+    // than the rounded-up logarithm when the range is a power of two.
+    auto lg = ComputeLog(max_key_ - min_key_) + 1;
 
     // And also the initial shift for the first node of the tree.
     assert(lg >= log_num_bins_);
@@ -60,7 +64,8 @@ class Builder {
 
     // And return the adaptive CHT.
     return CompactHistTree<KeyType>(single_layer, min_key_, max_key_, curr_num_keys_,
-                                    num_bins_, log_num_bins_, max_error_,
+                                    num_bins_, log_num_bins_,
+                                    std::max(max_error_, leaf_error_),
                                     shift_, std::move(table_));
   }
 
@@ -157,12 +162,16 @@ class Builder {
         // Should we split further?
         if (tree_[node].second[bin].second - tree_[node].second[bin].first >
             max_error_) {
-          // Corner-case: is #keys > range? Then create a leaf (this can only
-          // happen for datasets with duplicates).
+          // Corner-case: is #keys > range, or are there too few bits left in
+          // the bin for a child node? Then create a leaf (this can only happen
+          // for datasets with duplicates), and widen the error bound to cover
+          // it, as lookups search no further than the error from a leaf.
           auto size =
               tree_[node].second[bin].second - tree_[node].second[bin].first;
-          if (size > (1ull << (shift_ - level * log_num_bins_))) {
+          if ((shift_ < (level + 1) * log_num_bins_) ||
+              (size > (1ull << (shift_ - level * log_num_bins_)))) {
             tree_[node].second[bin].first |= Leaf;
+            leaf_error_ = std::max<size_t>(leaf_error_, size);
             continue;
           }
 
@@ -353,6 +362,11 @@ class Builder {
   size_t num_bins_;
   size_t log_num_bins_;
   size_t max_error_;
+
+  // The size of the largest leaf forced to hold more than `max_error_`
+  // keys, which widens the error of the finished CHT. Bins are still
+  // split against `max_error_`.
+  size_t leaf_error_;
   
   size_t curr_num_keys_;
   KeyType prev_key_;
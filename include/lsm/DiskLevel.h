@@ -2,6 +2,9 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <atomic>
+#include <unistd.h>
 
 #include "util/types.h"
 #include "util/bf_config.h"
@@ -17,10 +20,8 @@ public:
 
     DiskLevel(ssize_t level_no, size_t run_cap, std::string root_directory, std::string meta_fname, gsl_rng *rng) 
     : m_level_no(level_no), m_run_cap(run_cap), m_run_cnt(0)
-    , m_runs(new ISAMTree*[run_cap]{nullptr})
-    , m_bfs(new BloomFilter*[run_cap]{nullptr})
-    , m_pfiles(new PagedFile*[run_cap]{nullptr})
-    , m_owns(new bool[run_cap]{true})
+    , m_runs(run_cap, nullptr)
+    , m_bfs(run_cap, nullptr)
     , m_directory(root_directory)
     , m_version(0)
     , m_retain(false) {
@@ -42,9 +43,9 @@ public:
 
         while (fscanf(meta_f, "%s %d %s %ld %d %ld %ld %d\n", typebuff, &owns, fnamebuff, &version, &last_leaf, &reccnt, &tscnt, &root_node) != EOF && m_run_cnt < m_run_cap) {
             assert(strcmp(typebuff, "disk") == 0);
-            m_bfs[m_run_cnt] = new BloomFilter(BF_FPR, tscnt, BF_HASH_FUNCS, rng);
-            m_pfiles[m_run_cnt] = PagedFile::create(fnamebuff, false);
-            m_runs[m_run_cnt] = new ISAMTree(m_pfiles[m_run_cnt], reccnt, tscnt, last_leaf, root_node, m_bfs[m_run_cnt], rng);
+            m_bfs[m_run_cnt] = std::make_shared<BloomFilter>(BF_FPR, tscnt, BF_HASH_FUNCS, rng);
+            auto pfile = PagedFile::create(fnamebuff, false);
+            m_runs[m_run_cnt] = make_run(new ISAMTree(pfile, reccnt, tscnt, last_leaf, root_node, m_bfs[m_run_cnt].get(), rng));
             m_version = version;
             m_run_cnt++;
         }
@@ -53,48 +54,37 @@ public:
 
     DiskLevel(ssize_t level_no, size_t run_cap, std::string root_directory, size_t version=0)
     : m_level_no(level_no), m_run_cap(run_cap), m_run_cnt(0)
-    , m_runs(new ISAMTree*[run_cap]{nullptr})
-    , m_bfs(new BloomFilter*[run_cap]{nullptr})
-    , m_pfiles(new PagedFile*[run_cap]{nullptr})
-    , m_owns(new bool[run_cap]{true})
+    , m_runs(run_cap, nullptr)
+    , m_bfs(run_cap, nullptr)
     , m_directory(root_directory)
     , m_version(version)
     , m_retain(false) {}
 
-    ~DiskLevel() {
-        for (size_t i = 0; i < m_run_cap; ++i) {
-            if (m_owns[i]) {
-                if (m_runs[i]) delete m_runs[i];
-                if (m_bfs[i]) delete m_bfs[i];
-                if (m_pfiles[i]) delete m_pfiles[i];
-            }
-        }
+    // Create a copy of a level, sharing its runs. Runs are immutable once
+    // built, so the copy can have new runs appended to it without
+    // affecting any readers of the original level.
+    DiskLevel(const DiskLevel& level) = default;
 
-        delete[] m_runs;
-        delete[] m_bfs;
-        delete[] m_pfiles;
-        delete[] m_owns;
-    }
+    ~DiskLevel() {}
 
     static DiskLevel *merge_levels(DiskLevel *base_level, MemoryLevel *new_level, const gsl_rng *rng) {
         assert(base_level->m_level_no > new_level->m_level_no);
         auto res = new DiskLevel(base_level->m_level_no, 1, base_level->m_directory, base_level->m_version + 1);
         res->m_run_cnt = 1;
 
-        res->m_bfs[0] = new BloomFilter(BF_FPR,
+        res->m_bfs[0] = std::make_shared<BloomFilter>(BF_FPR,
                             new_level->get_tombstone_count() + base_level->get_tombstone_count(),
                             BF_HASH_FUNCS, rng);
 
-        ISAMTree *run1 = base_level->m_runs[0];
-        InMemRun *run2 = new_level->m_structure->m_runs[0];
+        ISAMTree *run1 = base_level->m_runs[0].get();
+        InMemRun *run2 = new_level->m_runs[0].get();
         assert(run2);
 
-        res->m_pfiles[0] = PagedFile::create(base_level->get_fname(0));
-        res->m_owns[0] = true;
-        assert(res->m_pfiles[0]);
+        auto pfile = PagedFile::create(base_level->get_fname(0));
+        assert(pfile);
         
-        res->m_runs[0] = (run1) ? new ISAMTree(res->m_pfiles[0], rng, res->m_bfs[0], &run2, 1, &run1, 1)
-                                : new ISAMTree(res->m_pfiles[0], rng, res->m_bfs[0], &run2, 1, nullptr, 0);
+        res->m_runs[0] = make_run((run1) ? new ISAMTree(pfile, rng, res->m_bfs[0].get(), &run2, 1, &run1, 1)
+                                         : new ISAMTree(pfile, rng, res->m_bfs[0].get(), &run2, 1, nullptr, 0));
         
         return res;
     }
@@ -109,31 +99,28 @@ public:
         // level into it without rebuilding the level
         if (base_level->get_run_count() == 0) {
             res->m_bfs[0] = new_level->m_bfs[0];
-            res->m_pfiles[0] = new_level->m_pfiles[0];
-            res->m_pfiles[0]->rename_file(base_level->get_fname(0));
             res->m_runs[0] = new_level->m_runs[0];
-            res->m_owns[0] = true;
+            res->m_runs[0]->get_pfile()->rename_file(base_level->get_fname(0));
             res->m_run_cnt = 1;
-            new_level->release_ownership(0);
             return res;
         }
 
-        res->m_bfs[0] = new BloomFilter(BF_FPR,
+        res->m_bfs[0] = std::make_shared<BloomFilter>(BF_FPR,
                             new_level->get_tombstone_count() + base_level->get_tombstone_count(),
                             BF_HASH_FUNCS, rng);
 
-        res->m_pfiles[0] = PagedFile::create(base_level->get_fname(0), true);
-        assert(res->m_pfiles[0]);
+        auto pfile = PagedFile::create(base_level->get_fname(0), true);
+        assert(pfile);
 
         res->m_run_cnt = 1;
 
         ISAMTree *runs[2] = {
-                             base_level->m_runs[0],
-                             new_level->m_runs[0]
+                             base_level->m_runs[0].get(),
+                             new_level->m_runs[0].get()
                             };
 
-        res->m_runs[0] = (runs[0]) ? new ISAMTree(res->m_pfiles[0], rng, res->m_bfs[0], nullptr, 0, runs, 2) 
-                                   : new ISAMTree(res->m_pfiles[0], rng, res->m_bfs[0], nullptr, 0, &runs[1], 1);
+        res->m_runs[0] = make_run((runs[0]) ? new ISAMTree(pfile, rng, res->m_bfs[0].get(), nullptr, 0, runs, 2) 
+                                            : new ISAMTree(pfile, rng, res->m_bfs[0].get(), nullptr, 0, &runs[1], 1));
 
         return res;
     }
@@ -147,31 +134,29 @@ public:
         // running the merge process
         if (level->get_run_count() == 1) {
             m_bfs[m_run_cnt] = level->m_bfs[0];
-            m_pfiles[m_run_cnt] = level->m_pfiles[0];
-            m_pfiles[m_run_cnt]->rename_file(this->get_fname(m_run_cnt));
             m_runs[m_run_cnt] = level->m_runs[0];
-            level->release_ownership(0);
+            m_runs[m_run_cnt]->get_pfile()->rename_file(this->get_fname(m_run_cnt));
         } else {
-            m_bfs[m_run_cnt] = new BloomFilter(BF_FPR, level->get_tombstone_count(), BF_HASH_FUNCS, rng);
+            m_bfs[m_run_cnt] = std::make_shared<BloomFilter>(BF_FPR, level->get_tombstone_count(), BF_HASH_FUNCS, rng);
 
-            m_pfiles[m_run_cnt] = PagedFile::create(this->get_fname(m_run_cnt), true);
-            assert(m_pfiles[m_run_cnt]);
+            auto pfile = PagedFile::create(this->get_fname(m_run_cnt), true);
+            assert(pfile);
 
-            m_runs[m_run_cnt] = new ISAMTree(m_pfiles[m_run_cnt], rng, m_bfs[m_run_cnt], nullptr, 0, level->m_runs, level->m_run_cnt);
+            auto runs = level->get_runs();
+            m_runs[m_run_cnt] = make_run(new ISAMTree(pfile, rng, m_bfs[m_run_cnt].get(), nullptr, 0, runs.data(), level->m_run_cnt));
         }
-        m_owns[m_run_cnt] = true;
         ++m_run_cnt;
     }
 
     void append_merged_runs(MemoryLevel *level, const gsl_rng *rng) {
         assert(m_run_cnt < m_run_cap);
-        m_bfs[m_run_cnt] = new BloomFilter(BF_FPR, level->get_tombstone_count(), BF_HASH_FUNCS, rng);
+        m_bfs[m_run_cnt] = std::make_shared<BloomFilter>(BF_FPR, level->get_tombstone_count(), BF_HASH_FUNCS, rng);
 
-        m_pfiles[m_run_cnt] = PagedFile::create(this->get_fname(m_run_cnt), true);
-        assert(m_pfiles[m_run_cnt]);
+        auto pfile = PagedFile::create(this->get_fname(m_run_cnt), true);
+        assert(pfile);
 
-        m_runs[m_run_cnt] = new ISAMTree(m_pfiles[m_run_cnt], rng, m_bfs[m_run_cnt], level->m_structure->m_runs, level->m_run_cnt, nullptr, 0);
-        m_owns[m_run_cnt] = true;
+        auto runs = level->get_runs();
+        m_runs[m_run_cnt] = make_run(new ISAMTree(pfile, rng, m_bfs[m_run_cnt].get(), runs.data(), level->m_run_cnt, nullptr, 0));
         ++m_run_cnt;
     }
 
@@ -188,14 +173,12 @@ public:
 
             auto high_pos = m_runs[i]->get_upper_bound(high, buffer);
 
-            // If high is larger than the largest key in the run,
-            // technically no "upper bound" on that key exists.
-            // Instead, the last data page should be used as the
-            // high_pos.
-            if (high_pos == INVALID_PNUM) {
-                high_pos = m_runs[i]->get_last_leaf_pnum();
+            // If every key in the run is larger than high, or the sample
+            // range falls entirely between two adjacent pages, then there
+            // are likewise no elements within it.
+            if (high_pos == INVALID_PNUM || high_pos < low_pos) {
+                continue;
             }
-            assert(high_pos >= low_pos);
             dst.emplace_back(SampleRange{RunId{m_level_no, i}, low_pos, high_pos});
             rec_cnts.emplace_back((high_pos - low_pos + 1) * (PAGE_SIZE/sizeof(record_t)));
         }
@@ -225,7 +208,17 @@ public:
     }
     
     ISAMTree* get_run(size_t idx) {
-        return m_runs[idx];
+        return m_runs[idx].get();
+    }
+
+    // Returns the runs within this level as an array of raw pointers,
+    // for use by the merge constructor of ISAMTree.
+    std::vector<ISAMTree*> get_runs() {
+        std::vector<ISAMTree*> runs(m_run_cnt);
+        for (size_t i = 0; i < m_run_cnt; ++i) {
+            runs[i] = m_runs[i].get();
+        }
+        return runs;
     }
 
     size_t get_run_count() {
@@ -278,7 +271,7 @@ public:
         assert(meta_f);
         for (size_t i=0; i<m_run_cap; i++) {
             if (m_runs[i]) {
-                fprintf(meta_f, "disk %d %s %ld %d %ld %ld %d\n", m_owns[i], m_runs[i]->get_pfile()->get_fname().c_str(), m_version, m_runs[i]->get_last_leaf_pnum(), m_runs[i]->get_record_count(), m_runs[i]->get_tombstone_count(), m_runs[i]->get_root_pnum());
+                fprintf(meta_f, "disk %d %s %ld %d %ld %ld %d\n", true, m_runs[i]->get_pfile()->get_fname().c_str(), m_version, m_runs[i]->get_last_leaf_pnum(), m_runs[i]->get_record_count(), m_runs[i]->get_tombstone_count(), m_runs[i]->get_root_pnum());
                 m_runs[i]->retain();
             }
         }
@@ -289,27 +282,39 @@ private:
     ssize_t m_level_no;
     size_t m_run_cap;
     size_t m_run_cnt;
-    size_t m_version;
-    ISAMTree** m_runs;
-    BloomFilter** m_bfs;
-    PagedFile** m_pfiles;
+
+    // Runs and their tombstone filters are shared between copies of a
+    // level, and are freed once the last level referencing them is. A
+    // run owns its PagedFile.
+    std::vector<std::shared_ptr<ISAMTree>> m_runs;
+    std::vector<std::shared_ptr<BloomFilter>> m_bfs;
     std::string m_directory;
-    bool *m_owns;
+    size_t m_version;
     bool m_retain;
 
+    // Runs outlive the level that created them, so a new run can be
+    // written while an older run that was created under the same level
+    // and run index is still being read. Every file name is made unique
+    // with a sequence number to prevent the two from colliding.
+    static inline std::atomic<size_t> fname_seq{0};
 
     std::string get_fname(size_t idx) {
-        return m_directory + "/level" + std::to_string(m_level_no)
-            + "_run" + std::to_string(idx) + "-" + std::to_string(m_version + 1) + ".dat";
+        std::string fname;
+        do {
+            fname = m_directory + "/level" + std::to_string(m_level_no)
+                  + "_run" + std::to_string(idx) + "-" + std::to_string(m_version + 1)
+                  + "." + std::to_string(fname_seq.fetch_add(1)) + ".dat";
+        } while (access(fname.c_str(), F_OK) == 0);
+
+        return fname;
     }
 
-    void release_ownership(size_t idx) {
-        assert(idx < m_run_cnt);
-        m_owns[idx] = false;
-        m_run_cnt--;
-        m_bfs[idx] = nullptr;
-        m_runs[idx] = nullptr;
-        m_pfiles[idx] = nullptr;
+    static std::shared_ptr<ISAMTree> make_run(ISAMTree *tree) {
+        return std::shared_ptr<ISAMTree>(tree, [](ISAMTree *tree) {
+            auto pfile = tree->get_pfile();
+            delete tree;
+            delete pfile;
+        });
     }
 };
 
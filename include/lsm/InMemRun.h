@@ -3,66 +3,398 @@
 #include <vector>
 #include <cassert>
 #include <queue>
+#include <unordered_map>
 #include <memory>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <new>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "lsm/MemTable.h"
-#include "ds/PriorityQueue.h"
+#include "ds/LoserTree.h"
 #include "util/Cursor.h"
 #include "util/timer.h"
+#include "util/numa.h"
+#include "util/BufferPool.h"
+#include "util/simd.h"
+#include "util/simd_merge.h"
+#include "ds/ts/builder.h"
 
 namespace lsm {
 
 constexpr size_t inmem_isam_node_size = 256;
 
+// True to search runs using a learned index (a TrieSpline over their keys)
+// by default, rather than a tree of InMemISAMNodes.
+constexpr bool INMEM_RUN_LEARNED_INDEX = false;
+
+// The maximum error, in records, of the position estimates of a run's
+// learned index. Each search then scans a window of about twice this.
+constexpr size_t INMEM_RUN_TS_MAX_ERROR = 16;
+
+// Runs with fewer distinct keys than this are searched using the tree even
+// when a learned index is requested, as a spline over so few points is no
+// faster than the tree, and their keys span too few bits to index well.
+constexpr size_t INMEM_RUN_TS_MIN_DISTINCT_KEYS = 64;
+
+/*
+ * The ways in which the records of a run can be stored: as an array of
+ * record_t (ROW), or as separate arrays of keys and values along with
+ * bitmaps of the tombstone and delete flags (COLUMNAR), which may also have
+ * their keys compressed (COMPRESSED). Keys are compressed in blocks of
+ * inmem_isam_key_leaf_fanout, each stored as the differences from its first
+ * key, in the fewest whole bytes (1, 2, 4 or 8) that hold the largest, so
+ * that any one of them can still be read in constant time.
+ */
+enum class RecordLayout {
+    ROW,
+    COLUMNAR,
+    COMPRESSED
+};
+
+// The layout of runs by default.
+constexpr RecordLayout INMEM_RUN_LAYOUT = RecordLayout::ROW;
+
+// The number of records of a columnar run reassembled at a time when it is
+// read in order, as by a merge.
+constexpr size_t INMEM_RUN_READ_CHUNK = 256;
+
+/*
+ * The file format written by InMemRun::persist_to_file. The arrays of the
+ * run are written exactly as they are held in memory, each as a section
+ * starting at a multiple of PAGE_SIZE, followed by the tombstone filter,
+ * so that a run can be loaded by mapping the file and pointing into it.
+ * The learned index is not saved, and is rebuilt on loading.
+ */
+constexpr uint64_t INMEM_RUN_FILE_MAGIC = 0x4e55524d454d4e49; // "INMEMRUN"
+constexpr uint32_t INMEM_RUN_FILE_VERSION = 1;
+
+enum InMemRunSection {
+    INMEM_RUN_DATA,
+    INMEM_RUN_KEYS,
+    INMEM_RUN_KEY_OFFSETS,
+    INMEM_RUN_PACKED_KEYS,
+    INMEM_RUN_VALUES,
+    INMEM_RUN_TOMBSTONE_BITS,
+    INMEM_RUN_DELETE_BITS,
+    INMEM_RUN_NODES,
+    INMEM_RUN_FILTER_SALTS,
+    INMEM_RUN_FILTER_BITS,
+    INMEM_RUN_SECTION_CNT
+};
+
+struct InMemRunFileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t layout;
+    uint64_t reccnt;
+    uint64_t tombstone_cnt;
+    uint64_t deleted_cnt;
+    uint64_t key_block_cnt;
+    uint64_t packed_key_cnt;
+    uint64_t internal_node_cnt;
+    uint64_t root;
+    uint64_t filter_hash_cnt;
+    uint64_t filter_bit_cnt;
+
+    // The byte offset and length of each section, which are both 0 for
+    // those that the run does not have.
+    uint64_t section_offset[INMEM_RUN_SECTION_CNT];
+    uint64_t section_size[INMEM_RUN_SECTION_CNT];
+};
+
 constexpr size_t inmem_isam_fanout = inmem_isam_node_size / (sizeof(key_t) + sizeof(char*));
 constexpr size_t inmem_isam_leaf_fanout = inmem_isam_node_size / sizeof(record_t);
+constexpr size_t inmem_isam_key_leaf_fanout = inmem_isam_node_size / sizeof(key_t);
 constexpr size_t inmem_isam_node_keyskip = sizeof(key_t) * inmem_isam_fanout;
 
+/*
+ * The header of a block of the compressed keys of a run, which is followed
+ * directly by its packed deltas, so that a search of the block touches a
+ * single contiguous range of memory. The i'th key of the block is base
+ * plus the i'th of width bytes, or the maximum delta for slots past the end
+ * of the run.
+ */
+struct InMemKeyBlock {
+    key_t base;
+    uint32_t idx;
+    uint32_t width;
+
+    template <typename T>
+    const T *deltas() const {
+        return reinterpret_cast<const T*>(this + 1);
+    }
+
+    key_t get_key(size_t i) const {
+        switch (width) {
+            case 1: return base + deltas<uint8_t>()[i];
+            case 2: return base + deltas<uint16_t>()[i];
+            case 4: return base + deltas<uint32_t>()[i];
+            default: return base + deltas<uint64_t>()[i];
+        }
+    }
+};
+
+/*
+ * Returns the number of the inmem_isam_key_leaf_fanout deltas which are
+ * below delta, or at most delta if Upper. Like inmem_isam_count, this is a
+ * fixed-length loop which the compiler vectorizes.
+ */
+template <typename T, bool Upper>
+inline size_t inmem_isam_count_deltas(const T *deltas, uint64_t delta) {
+    if (delta > std::numeric_limits<T>::max()) return inmem_isam_key_leaf_fanout;
+
+    T d = delta;
+    size_t cnt = 0;
+    for (size_t i=0; i<inmem_isam_key_leaf_fanout; i++) {
+        cnt += (Upper) ? deltas[i] <= d : deltas[i] < d;
+    }
+
+    return cnt;
+}
+
+/*
+ * The children of internal nodes are offsets rather than pointers, so that
+ * the nodes can be written out and mapped back in at any address. A child
+ * is either the index of another internal node, or, with INMEM_ISAM_LEAF_BIT
+ * set, the byte offset of a leaf from the start of the run's leaf storage.
+ */
+constexpr uint64_t INMEM_ISAM_LEAF_BIT = 1ull << 63;
+
 struct InMemISAMNode {
     key_t keys[inmem_isam_fanout];
-    char* child[inmem_isam_fanout];
+    uint64_t child[inmem_isam_fanout];
 };
 
 static_assert(sizeof(InMemISAMNode) == inmem_isam_node_size, "node size does not match");
+static_assert(inmem_isam_key_leaf_fanout == 2 * inmem_isam_fanout, "key leaves are searched as two nodes' worth of keys");
+
+/*
+ * Internal nodes are padded so that they can be searched without branches:
+ * every key slot past the last child that the node's own search compares
+ * against holds INMEM_ISAM_KEY_SENTINEL, and every child slot past the last
+ * child repeats it. The child to descend into is then just the number of
+ * keys below the search key (or no greater than it, for an upper bound),
+ * capped to the final slot.
+ */
+constexpr key_t INMEM_ISAM_KEY_SENTINEL = std::numeric_limits<key_t>::max();
+
+/*
+ * Count the keys of a node that are less than key, or no greater than key
+ * if Upper. Each of these is equivalent, and inmem_isam_count selects the
+ * widest one that the CPU supports.
+ */
+template <bool Upper>
+inline size_t inmem_isam_count_scalar(const key_t *keys, key_t key) {
+    size_t cnt = 0;
+    for (size_t i=0; i<inmem_isam_fanout; i++) {
+        cnt += (Upper) ? (keys[i] <= key) : (keys[i] < key);
+    }
+    return cnt;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+static_assert(inmem_isam_fanout % 8 == 0 && sizeof(key_t) == 8, "SIMD node search requires whole vectors of 64-bit keys");
+
+template <bool Upper>
+__attribute__((target("avx2")))
+inline size_t inmem_isam_count_avx2(const key_t *keys, key_t key) {
+    // AVX2 only has a signed 64-bit comparison, so flip the sign bits.
+    const __m256i bias = _mm256_set1_epi64x(0x8000000000000000ll);
+    const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x(key), bias);
+
+    size_t cnt = 0;
+    for (size_t i=0; i<inmem_isam_fanout; i+=4) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (keys + i)), bias);
+        if (Upper) {
+            // keys[i] <= key is !(keys[i] > key)
+            cnt += 4 - __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, k))));
+        } else {
+            cnt += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, v))));
+        }
+    }
+
+    return cnt;
+}
+
+template <bool Upper>
+__attribute__((target("avx512f")))
+inline size_t inmem_isam_count_avx512(const key_t *keys, key_t key) {
+    const __m512i k = _mm512_set1_epi64(key);
+
+    size_t cnt = 0;
+    for (size_t i=0; i<inmem_isam_fanout; i+=8) {
+        __m512i v = _mm512_loadu_si512((const void *) (keys + i));
+        __mmask8 mask = (Upper) ? _mm512_cmple_epu64_mask(v, k) : _mm512_cmplt_epu64_mask(v, k);
+        cnt += __builtin_popcount(mask);
+    }
+
+    return cnt;
+}
+#endif
+
+template <bool Upper>
+inline size_t inmem_isam_count(const key_t *keys, key_t key) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    switch (simd_level()) {
+        case SIMDLevel::AVX512:
+            return inmem_isam_count_avx512<Upper>(keys, key);
+        case SIMDLevel::AVX2:
+            return inmem_isam_count_avx2<Upper>(keys, key);
+        default:
+            break;
+    }
+#endif
+    return inmem_isam_count_scalar<Upper>(keys, key);
+}
 
 thread_local size_t mrun_cancelations = 0;
 
+class InMemRun;
+
+/*
+ * Reads a range of the records of a run in order, a chunk at a time, so
+ * that they can be merged through a Cursor. The records of a run with the
+ * row layout are read in place, as a single chunk, while those of a
+ * columnar run are reassembled into a buffer, INMEM_RUN_READ_CHUNK at a
+ * time.
+ */
+class InMemRunReader {
+public:
+    InMemRunReader(const InMemRun *run, size_t start, size_t cnt);
+
+    /*
+     * Advance to the next chunk of records, returning false if there are
+     * none left.
+     */
+    bool next();
+
+    const record_t *get_item() const {
+        return m_item;
+    }
+
+    size_t get_item_count() const {
+        return m_item_cnt;
+    }
+
+private:
+    const InMemRun *m_run;
+    size_t m_next;
+    size_t m_end;
+    const record_t *m_item;
+    size_t m_item_cnt;
+    std::vector<record_t> m_buffer;
+};
+
+/*
+ * As advance_cursor over a PagedFileIterator, but refilling the cursor from
+ * the next chunk of a run reader once it reaches its end.
+ */
+inline bool advance_cursor(Cursor &cur, InMemRunReader *reader) {
+    cur.ptr++;
+    cur.cur_rec_idx++;
+
+    if (cur.cur_rec_idx >= cur.rec_cnt) return false;
+
+    if (cur.ptr >= cur.end) {
+        if (reader && reader->next()) {
+            cur.ptr = reader->get_item();
+            cur.end = cur.ptr + reader->get_item_count();
+            return true;
+        }
+
+        return false;
+    }
+    return true;
+}
+
+/*
+ * A sorted, in-memory, run of records. Range bounds are found using either
+ * a static tree of InMemISAMNodes, or, if learned_index is set, a TrieSpline
+ * over the keys followed by a short local search.
+ *
+ * The records are stored in the specified RecordLayout. Searches of a
+ * columnar run touch only its keys, and so the leaves of its tree are the
+ * key array itself, at inmem_isam_key_leaf_fanout keys apiece, or, if the
+ * keys are compressed, their blocks.
+ */
 class InMemRun {
 public:
-    InMemRun(std::string data_fname, size_t record_cnt, size_t tombstone_cnt, BloomFilter *bf, bool tagging)
-    : m_reccnt(record_cnt), m_tombstone_cnt(tombstone_cnt), m_deleted_cnt(0), m_tagging(tagging) {
+    /*
+     * Load a run saved by persist_to_file, in the layout it was saved in.
+     * The file is mapped privately, and the run points into the mapping,
+     * so that it can be searched without reading the file in first. Its
+     * pages are read on first access, and any changes to them (records
+     * being marked as deleted) are not written back. The tombstone filter
+     * saved with the run, if any, is loaded into bf.
+     */
+    InMemRun(std::string data_fname, BloomFilter *bf, bool tagging, bool learned_index=INMEM_RUN_LEARNED_INDEX)
+    : m_isam_nodes(nullptr), m_tagging(tagging), m_learned_index(learned_index) {
+        int fd = open(data_fname.c_str(), O_RDONLY);
+        assert(fd >= 0);
 
-        // read the stored data file the file
-        size_t alloc_size = (record_cnt * sizeof(record_t)) + (CACHELINE_SIZE - (record_cnt * sizeof(record_t)) % CACHELINE_SIZE);
-        assert(alloc_size % CACHELINE_SIZE == 0);
-        m_data = (record_t*)std::aligned_alloc(CACHELINE_SIZE, alloc_size);
+        struct stat st;
+        fstat(fd, &st);
+        m_mapping_size = st.st_size;
+        m_mapping = (char*) mmap(nullptr, m_mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        assert(m_mapping != MAP_FAILED);
+        close(fd);
 
-        FILE *file = fopen(data_fname.c_str(), "rb");
-        assert(file);
-        auto res = fread(m_data, sizeof(record_t), m_reccnt, file);
-        assert (res == m_reccnt);
-        fclose(file);
+        auto header = reinterpret_cast<const InMemRunFileHeader*>(m_mapping);
+        assert(header->magic == INMEM_RUN_FILE_MAGIC && header->version == INMEM_RUN_FILE_VERSION);
 
-        // We can't really persist the internal structure, as it uses
-        // pointers, which are invalidated by the move. So we'll just
-        // rebuild it.
-        this->build_internal_levels();
+        m_layout = (RecordLayout) header->layout;
+        m_reccnt = header->reccnt;
+        m_tombstone_cnt = header->tombstone_cnt;
+        m_deleted_cnt = header->deleted_cnt;
+        m_key_block_cnt = header->key_block_cnt;
+        m_packed_key_cnt = header->packed_key_cnt;
+        m_internal_node_cnt = header->internal_node_cnt;
+        m_root = header->root;
 
-        // rebuild the bloom filter
-        for (size_t i=0; i<m_reccnt; i++) {
-            auto rec = this->get_record_at(i);
-            if (rec->is_tombstone()) {
-                bf->insert(rec->key);
-            }
+        auto section = [&](InMemRunSection sec) {
+            return (header->section_size[sec] > 0) ? (void*) (m_mapping + header->section_offset[sec]) : nullptr;
+        };
+
+        m_data = (record_t*) section(INMEM_RUN_DATA);
+        m_keys = (key_t*) section(INMEM_RUN_KEYS);
+        m_key_offsets = (uint32_t*) section(INMEM_RUN_KEY_OFFSETS);
+        m_packed_keys = (uint64_t*) section(INMEM_RUN_PACKED_KEYS);
+        m_values = (value_t*) section(INMEM_RUN_VALUES);
+        m_tombstone_bits = (uint64_t*) section(INMEM_RUN_TOMBSTONE_BITS);
+        m_delete_bits = (std::atomic<uint64_t>*) section(INMEM_RUN_DELETE_BITS);
+        m_isam_nodes = (InMemISAMNode*) section(INMEM_RUN_NODES);
+
+        if (bf && header->filter_hash_cnt > 0) {
+            bf->load((const uint16_t*) section(INMEM_RUN_FILTER_SALTS), header->filter_hash_cnt,
+                     (const char*) section(INMEM_RUN_FILTER_BITS), header->filter_bit_cnt);
+        }
+
+        // The run may have been saved with a learned index rather than a
+        // tree, or the other way around, in which case the one wanted here
+        // is built instead.
+        if (m_reccnt > 0 && (m_learned_index || !m_isam_nodes)) {
+            m_isam_nodes = nullptr;
+            this->build_search_index();
         }
     }
 
-    InMemRun(MemTable* mem_table, BloomFilter* bf, bool tagging)
-    :m_reccnt(0), m_tombstone_cnt(0), m_isam_nodes(nullptr), m_deleted_cnt(0), m_tagging(tagging) {
+    InMemRun(MemTable* mem_table, BloomFilter* bf, bool tagging, bool learned_index=INMEM_RUN_LEARNED_INDEX, RecordLayout layout=INMEM_RUN_LAYOUT,
+             std::shared_ptr<BufferPool> pool=nullptr)
+    :m_reccnt(0), m_tombstone_cnt(0), m_isam_nodes(nullptr), m_deleted_cnt(0), m_tagging(tagging), m_learned_index(learned_index), m_layout(layout),
+     m_pool(std::move(pool)) {
 
-        size_t alloc_size = (mem_table->get_record_count() * sizeof(record_t)) + (CACHELINE_SIZE - (mem_table->get_record_count() * sizeof(record_t)) % CACHELINE_SIZE);
-        assert(alloc_size % CACHELINE_SIZE == 0);
-        m_data = (record_t*)std::aligned_alloc(CACHELINE_SIZE, alloc_size);
+        this->alloc_records(mem_table->get_record_count());
 
         TIMER_INIT();
 
@@ -83,7 +415,7 @@ public:
                     base += 2;
                     mrun_cancelations++;
                     continue;
-                } 
+                }
             } else if (base->get_delete_status()) {
                 base += 1;
                 continue;
@@ -91,7 +423,7 @@ public:
 
             //Masking off the ts.
             base->header &= 1;
-            m_data[m_reccnt++] = *base;
+            this->append_record(*base);
             if (bf && base->is_tombstone()) {
                 ++m_tombstone_cnt;
                 bf->insert(base->key);
@@ -104,7 +436,7 @@ public:
 
         TIMER_START();
         if (m_reccnt > 0) {
-            build_internal_levels();
+            build_index();
         }
         TIMER_STOP();
         auto level_time = TIMER_RESULT();
@@ -112,72 +444,126 @@ public:
         //fprintf(stdout, "%ld %ld %ld\n", sort_time, copy_time, level_time);
     }
 
-    InMemRun(InMemRun** runs, size_t len, BloomFilter* bf, bool tagging)
-    :m_reccnt(0), m_tombstone_cnt(0), m_deleted_cnt(0), m_isam_nodes(nullptr), m_tagging(tagging) {
+    InMemRun(InMemRun** runs, size_t len, BloomFilter* bf, bool tagging, bool learned_index=INMEM_RUN_LEARNED_INDEX, RecordLayout layout=INMEM_RUN_LAYOUT,
+             std::shared_ptr<BufferPool> pool=nullptr)
+    :m_reccnt(0), m_tombstone_cnt(0), m_deleted_cnt(0), m_isam_nodes(nullptr), m_tagging(tagging), m_learned_index(learned_index), m_layout(layout),
+     m_pool(std::move(pool)) {
+        // Runs with disjoint key ranges, such as those of time-ordered keys,
+        // cannot cancel one another out, and are simply concatenated.
+        auto order = InMemRun::disjoint_order(runs, len);
+        if (!order.empty()) {
+            this->concat_runs(runs, order, bf);
+            if (m_reccnt > 0) {
+                build_index();
+            }
+
+            return;
+        }
+
+        // A leveling merge is always of exactly two runs, which are merged
+        // by the two-way kernel rather than through the tree.
+        std::vector<InMemRun*> inputs;
+        for (size_t i = 0; i < len; ++i) {
+            if (runs[i] && runs[i]->get_record_count() > 0) {
+                inputs.push_back(runs[i]);
+            }
+        }
+
+        if (inputs.size() == 2) {
+            this->merge_pair(inputs[0], inputs[1], bf);
+            if (m_reccnt > 0) {
+                build_index();
+            }
+
+            return;
+        }
+
         std::vector<Cursor> cursors;
         cursors.reserve(len);
+        std::vector<InMemRunReader *> readers(len, nullptr);
 
-        PriorityQueue pq(len);
+        LoserTree lt(len);
 
         size_t attemp_reccnt = 0;
-        
+        size_t attemp_tombstone_cnt = 0;
+
         for (size_t i = 0; i < len; ++i) {
             if (runs[i]) {
-                auto base = runs[i]->sorted_output();
-                cursors.emplace_back(Cursor{base, base + runs[i]->get_record_count(), 0, runs[i]->get_record_count()});
                 attemp_reccnt += runs[i]->get_record_count();
-                pq.push(cursors[i].ptr, i);
-            } else {
-                cursors.emplace_back(Cursor{nullptr, nullptr, 0, 0});
+                attemp_tombstone_cnt += runs[i]->get_tombstone_count();
+                readers[i] = new InMemRunReader(runs[i], 0, runs[i]->get_record_count());
+                if (readers[i]->next()) {
+                    auto base = readers[i]->get_item();
+                    cursors.emplace_back(Cursor{base, base + readers[i]->get_item_count(), 0, runs[i]->get_record_count()});
+                    lt.push(cursors[i].ptr, i);
+                    continue;
+                }
             }
+
+            cursors.emplace_back(Cursor{nullptr, nullptr, 0, 0});
         }
 
-        size_t alloc_size = (attemp_reccnt * sizeof(record_t)) + (CACHELINE_SIZE - (attemp_reccnt * sizeof(record_t)) % CACHELINE_SIZE);
-        assert(alloc_size % CACHELINE_SIZE == 0);
-        m_data = (record_t*)std::aligned_alloc(CACHELINE_SIZE, alloc_size);
+        this->alloc_records(attemp_reccnt);
 
         size_t offset = 0;
-        
-        while (pq.size()) {
-            auto now = pq.peek();
-            auto next = pq.size() > 1 ? pq.peek(1) : queue_record{nullptr, 0};
+
+        while (lt.size()) {
+            // Records can only be canceled if there are tombstones to cancel
+            // them, and otherwise there is no need to find the next record.
+            auto now = lt.peek();
+            auto next = (attemp_tombstone_cnt > 0) ? lt.peek_next() : queue_record{nullptr, 0};
             if (!m_tagging && !now.data->is_tombstone() && next.data != nullptr &&
                 now.data->match(next.data) && next.data->is_tombstone()) {
-                
-                pq.pop(); pq.pop();
+
                 auto& cursor1 = cursors[now.version];
                 auto& cursor2 = cursors[next.version];
-                if (advance_cursor(cursor1)) pq.push(cursor1.ptr, now.version);
-                if (advance_cursor(cursor2)) pq.push(cursor2.ptr, next.version);
+                lt.replace(now.version, advance_cursor(cursor1, readers[now.version]) ? cursor1.ptr : nullptr);
+                lt.replace(next.version, advance_cursor(cursor2, readers[next.version]) ? cursor2.ptr : nullptr);
             } else {
                 auto& cursor = cursors[now.version];
                 if (!m_tagging || !cursor.ptr->get_delete_status()) {
-                    m_data[m_reccnt++] = *cursor.ptr;
+                    this->append_record(*cursor.ptr);
                     if (cursor.ptr->is_tombstone()) {
                         ++m_tombstone_cnt;
                         bf->insert(cursor.ptr->key);
                     }
                 }
-                pq.pop();
-                
-                if (advance_cursor(cursor)) pq.push(cursor.ptr, now.version);
+
+                lt.replace(now.version, advance_cursor(cursor, readers[now.version]) ? cursor.ptr : nullptr);
             }
         }
 
+        for (auto reader : readers) {
+            delete reader;
+        }
+
         if (m_reccnt > 0) {
-            build_internal_levels();
+            build_index();
         }
     }
 
     ~InMemRun() {
-        if (m_data) free(m_data);
-        if (m_isam_nodes) free(m_isam_nodes);
+        this->release(m_data);
+        this->release(m_keys);
+        this->release(m_key_offsets);
+        this->release(m_packed_keys);
+        this->release(m_values);
+        this->release(m_tombstone_bits);
+        this->release(m_delete_bits);
+        this->release(m_isam_nodes);
+        if (m_ts) delete m_ts;
+        if (m_mapping) munmap(m_mapping, m_mapping_size);
     }
 
+    /*
+     * Returns the records of the run, for a run with the row layout. The
+     * records of a columnar run are not stored contiguously, and must be
+     * read through an InMemRunReader instead, so nullptr is returned.
+     */
     record_t* sorted_output() const {
         return m_data;
     }
-    
+
     size_t get_record_count() const {
         return m_reccnt;
     }
@@ -186,16 +572,28 @@ public:
         return m_tombstone_cnt;
     }
 
+    RecordLayout get_layout() const {
+        return m_layout;
+    }
+
+    bool is_columnar() const {
+        return m_layout != RecordLayout::ROW;
+    }
+
     bool delete_record(const key_t& key, const value_t& val) {
         size_t idx = get_lower_bound(key);
         if (idx >= m_reccnt) {
             return false;
         }
 
-        while (idx < m_reccnt && m_data[idx].lt(key, val)) ++idx;
+        while (idx < m_reccnt && this->get_record(idx).lt(key, val)) ++idx;
 
-        if (m_data[idx].match(key, val, false)) {
-            m_data[idx].set_delete_status();
+        if (idx < m_reccnt && this->get_record(idx).match(key, val, false)) {
+            if (this->is_columnar()) {
+                m_delete_bits[idx / 64].fetch_or(1ull << (idx % 64), std::memory_order_relaxed);
+            } else {
+                m_data[idx].set_delete_status();
+            }
             m_deleted_cnt++;
             return true;
         }
@@ -203,48 +601,127 @@ public:
         return false;
     }
 
+    /*
+     * Returns a pointer to the record at idx, or nullptr if there is none.
+     * Only runs with the row layout store whole records, and so this may
+     * not be used with a columnar run. get_record works with either.
+     */
     const record_t* get_record_at(size_t idx) const {
+        assert(!this->is_columnar());
         return (idx < m_reccnt) ? m_data + idx : nullptr;
     }
 
-    size_t get_lower_bound(const key_t& key) const {
-        const InMemISAMNode* now = m_root;
-        while (!is_leaf(reinterpret_cast<const char*>(now))) {
-            const InMemISAMNode* next = nullptr;
-            for (size_t i = 0; i < inmem_isam_fanout - 1; ++i) {
-                if (now->child[i + 1] == nullptr || key <= now->keys[i]) {
-                    next = reinterpret_cast<InMemISAMNode*>(now->child[i]);
-                    break;
-                }
-            }
+    /*
+     * Returns a copy of the record at idx, which must be less than the
+     * record count, reassembling it if the run is columnar.
+     */
+    record_t get_record(size_t idx) const {
+        if (!this->is_columnar()) {
+            return m_data[idx];
+        }
+
+        record_t rec{};
+        rec.key = this->get_key_at(idx);
+        rec.value = m_values[idx];
+        rec.header = ((m_tombstone_bits[idx / 64] >> (idx % 64)) & 1)
+                   | (((m_delete_bits[idx / 64].load(std::memory_order_relaxed) >> (idx % 64)) & 1) << 1);
+        return rec;
+    }
 
-            now = next ? next : reinterpret_cast<const InMemISAMNode*>(now->child[inmem_isam_fanout - 1]);
+    /*
+     * Copy cnt records from start into dst, reassembling them if the run is
+     * columnar.
+     */
+    void get_records(size_t start, size_t cnt, record_t *dst) const {
+        if (!this->is_columnar()) {
+            memcpy(dst, m_data + start, cnt * sizeof(record_t));
+            return;
         }
 
-        const record_t* pos = reinterpret_cast<const record_t*>(now);
-        while (pos < m_data + m_reccnt && pos->key < key) pos++;
+        for (size_t i=0; i<cnt; i++) {
+            dst[i] = this->get_record(start + i);
+        }
+    }
+
+    key_t get_key_at(size_t idx) const {
+        switch (m_layout) {
+            case RecordLayout::ROW:
+                return m_data[idx].key;
+            case RecordLayout::COLUMNAR:
+                return m_keys[idx];
+            default:
+                return this->key_block(idx / inmem_isam_key_leaf_fanout)->get_key(idx % inmem_isam_key_leaf_fanout);
+        }
+    }
 
-        return pos - m_data;
+    size_t get_lower_bound(const key_t& key) const {
+        if (m_ts) return ts_search<false>(key);
+
+        uint64_t now = m_root;
+        while (!(now & INMEM_ISAM_LEAF_BIT)) {
+            now = child_for<false>(m_isam_nodes + now, key);
+        }
+
+        return leaf_search<false>(this->leaf_at(now), key);
     }
 
     size_t get_upper_bound(const key_t& key) const {
-        const InMemISAMNode* now = m_root;
-        while (!is_leaf(reinterpret_cast<const char*>(now))) {
-            const InMemISAMNode* next = nullptr;
-            for (size_t i = 0; i < inmem_isam_fanout - 1; ++i) {
-                if (now->child[i + 1] == nullptr || key < now->keys[i]) {
-                    next = reinterpret_cast<InMemISAMNode*>(now->child[i]);
-                    break;
+        if (m_ts) return ts_search<true>(key);
+
+        uint64_t now = m_root;
+        while (!(now & INMEM_ISAM_LEAF_BIT)) {
+            now = child_for<true>(m_isam_nodes + now, key);
+        }
+
+        return leaf_search<true>(this->leaf_at(now), key);
+    }
+
+    /*
+     * Returns {get_lower_bound(low), get_upper_bound(high)}, sharing the
+     * part of the descent for which both searches follow the same path.
+     */
+    std::pair<size_t, size_t> get_bounds(const key_t& low, const key_t& high) const {
+        if (m_ts) return {ts_search<false>(low), ts_search<true>(high)};
+
+        uint64_t now = m_root;
+        while (!(now & INMEM_ISAM_LEAF_BIT)) {
+            auto lo_next = child_for<false>(m_isam_nodes + now, low);
+            auto hi_next = child_for<true>(m_isam_nodes + now, high);
+            if (lo_next != hi_next) {
+                while (!(lo_next & INMEM_ISAM_LEAF_BIT)) {
+                    lo_next = child_for<false>(m_isam_nodes + lo_next, low);
+                    hi_next = child_for<true>(m_isam_nodes + hi_next, high);
                 }
+
+                return {leaf_search<false>(this->leaf_at(lo_next), low),
+                        leaf_search<true>(this->leaf_at(hi_next), high)};
             }
 
-            now = next ? next : reinterpret_cast<const InMemISAMNode*>(now->child[inmem_isam_fanout - 1]);
+            now = lo_next;
         }
 
-        const record_t* pos = reinterpret_cast<const record_t*>(now);
-        while (pos < m_data + m_reccnt && pos->key <= key) pos++;
+        auto leaf = this->leaf_at(now);
+        return {leaf_search<false>(leaf, low), leaf_search<true>(leaf, high)};
+    }
+
+    /*
+     * Equivalent to get_lower_bound(key), but found by galloping forward
+     * from hint rather than descending the tree. hint must be no larger than
+     * the result, which is the case for the lower bound of any smaller key.
+     * This is cheaper than a full descent when the result is known to be
+     * close to hint, as with a batch of searches in sorted key order.
+     */
+    size_t get_lower_bound_from(const key_t& key, size_t hint) const {
+        return gallop(hint, [&](const key_t& k) { return k < key; });
+    }
 
-        return pos - m_data;
+    /*
+     * Equivalent to get_upper_bound(key), but found by galloping forward
+     * from hint, which must be no larger than the result (such as the lower
+     * bound of any key no larger than key).
+     */
+    size_t get_upper_bound_from(const key_t& key, size_t hint) const {
+        return gallop(hint, [&](const key_t& k) { return k <= key; });
     }
 
     bool check_tombstone(const key_t& key, const value_t& val) const {
@@ -253,26 +730,234 @@ public:
             return false;
         }
 
-        record_t* ptr = m_data + idx;
+        while (idx < m_reccnt && this->get_record(idx).lt(key, val)) idx++;
+        return idx < m_reccnt && this->get_record(idx).match(key, val, true);
+    }
 
-        while (ptr < m_data + m_reccnt && ptr->lt(key, val)) ptr++;
-        return ptr->match(key, val, true);
+    /*
+     * Returns the NUMA node that the run's memory is placed on, or
+     * NUMA_NO_NODE if it is not placed on any one node.
+     */
+    int get_numa_node() const {
+        return m_numa_node;
     }
 
     size_t get_memory_utilization() {
+        if (m_ts) return m_ts->GetSize();
         return m_internal_node_cnt * inmem_isam_node_size;
     }
 
-    void persist_to_file(std::string data_fname) {
+    bool has_learned_index() const {
+        return m_ts != nullptr;
+    }
+
+    /*
+     * Write the run to a file, along with its tombstone filter bf, if
+     * provided, in the format described by InMemRunFileHeader, from which
+     * it can be loaded again without being rebuilt.
+     */
+    void persist_to_file(std::string data_fname, BloomFilter *bf=nullptr) {
+        InMemRunFileHeader header = {};
+        header.magic = INMEM_RUN_FILE_MAGIC;
+        header.version = INMEM_RUN_FILE_VERSION;
+        header.layout = (uint32_t) m_layout;
+        header.reccnt = m_reccnt;
+        header.tombstone_cnt = m_tombstone_cnt;
+        header.deleted_cnt = m_deleted_cnt;
+        header.key_block_cnt = m_key_block_cnt;
+        header.packed_key_cnt = m_packed_key_cnt;
+        header.internal_node_cnt = m_internal_node_cnt;
+        header.root = m_root;
+
+        size_t bitmap_size = sizeof(uint64_t) * (m_reccnt / 64 + 1);
+        const void *sections[INMEM_RUN_SECTION_CNT] = {};
+        auto add_section = [&](InMemRunSection sec, const void *ptr, size_t size) {
+            if (!ptr || size == 0) return;
+            sections[sec] = ptr;
+            header.section_size[sec] = size;
+        };
+
+        if (!this->is_columnar()) {
+            add_section(INMEM_RUN_DATA, m_data, m_reccnt * sizeof(record_t));
+        } else {
+            add_section(INMEM_RUN_KEYS, m_keys, TYPEALIGN(inmem_isam_key_leaf_fanout, m_reccnt) * sizeof(key_t));
+            add_section(INMEM_RUN_KEY_OFFSETS, m_key_offsets, m_key_block_cnt * sizeof(uint32_t));
+            add_section(INMEM_RUN_PACKED_KEYS, m_packed_keys, m_packed_key_cnt * sizeof(uint64_t));
+            add_section(INMEM_RUN_VALUES, m_values, m_reccnt * sizeof(value_t));
+            add_section(INMEM_RUN_TOMBSTONE_BITS, m_tombstone_bits, bitmap_size);
+            add_section(INMEM_RUN_DELETE_BITS, m_delete_bits, bitmap_size);
+        }
+        add_section(INMEM_RUN_NODES, m_isam_nodes, m_internal_node_cnt * inmem_isam_node_size);
+
+        if (bf) {
+            header.filter_hash_cnt = bf->get_hash_count();
+            header.filter_bit_cnt = bf->get_bit_count();
+            add_section(INMEM_RUN_FILTER_SALTS, bf->get_salts(), bf->get_hash_count() * sizeof(uint16_t));
+            add_section(INMEM_RUN_FILTER_BITS, bf->get_bits(), (bf->get_bit_count() + 7) / 8);
+        }
+
+        size_t offset = TYPEALIGN(PAGE_SIZE, sizeof(InMemRunFileHeader));
+        for (size_t i=0; i<INMEM_RUN_SECTION_CNT; i++) {
+            if (!sections[i]) continue;
+            header.section_offset[i] = offset;
+            offset = TYPEALIGN(PAGE_SIZE, offset + header.section_size[i]);
+        }
+
         FILE *file = fopen(data_fname.c_str(), "wb");
         assert(file);
-        fwrite(m_data, sizeof(record_t), m_reccnt, file);
+        fwrite(&header, sizeof(header), 1, file);
+        for (size_t i=0; i<INMEM_RUN_SECTION_CNT; i++) {
+            if (!sections[i]) continue;
+            fseek(file, header.section_offset[i], SEEK_SET);
+            fwrite(sections[i], 1, header.section_size[i], file);
+        }
         fclose(file);
     }
-    
+
+    /*
+     * Returns the number of bytes used to store the records of the run.
+     */
+    size_t get_data_size() const {
+        size_t bitmaps = 2 * sizeof(uint64_t) * (m_reccnt / 64 + 1);
+        switch (m_layout) {
+            case RecordLayout::ROW:
+                return m_reccnt * sizeof(record_t);
+            case RecordLayout::COLUMNAR:
+                return m_reccnt * (sizeof(key_t) + sizeof(value_t)) + bitmaps;
+            default:
+                return m_key_block_cnt * sizeof(uint32_t) + m_packed_key_cnt * sizeof(uint64_t)
+                     + m_reccnt * sizeof(value_t) + bitmaps;
+        }
+    }
+
 private:
+    /*
+     * Put the keys of the run into their final layout, and build the
+     * structure used to search it.
+     */
+    void build_index() {
+        if (m_layout == RecordLayout::COLUMNAR) {
+            // Pad out the final leaf, so that it can be searched in full.
+            std::fill(m_keys + m_reccnt, m_keys + TYPEALIGN(inmem_isam_key_leaf_fanout, m_reccnt), INMEM_ISAM_KEY_SENTINEL);
+        } else if (m_layout == RecordLayout::COMPRESSED) {
+            this->compress_keys();
+        }
+
+        this->build_search_index();
+    }
+
+    /*
+     * Build the learned index or tree over the keys of the run, once they
+     * are in their final layout. The TrieSpline requires the smallest and
+     * largest keys up front, so it is built from the finished run rather
+     * than as the records are copied in. Runs of few distinct keys, which
+     * includes any of a single key that the TrieSpline cannot be built
+     * over, use the tree instead.
+     */
+    void build_search_index() {
+        if (m_learned_index && this->has_distinct_keys(INMEM_RUN_TS_MIN_DISTINCT_KEYS)) {
+            auto bldr = ts::Builder<key_t>(this->get_key_at(0), this->get_key_at(m_reccnt - 1), INMEM_RUN_TS_MAX_ERROR);
+            for (size_t i=0; i<m_reccnt; i++) {
+                bldr.AddKey(this->get_key_at(i));
+            }
+
+            m_ts = new ts::TrieSpline<key_t>(bldr.Finalize());
+            m_internal_node_cnt = 0;
+            return;
+        }
+
+        this->build_internal_levels();
+    }
+
+    /*
+     * Determine whether the run has at least cnt distinct keys, stopping
+     * as soon as it has found them.
+     */
+    bool has_distinct_keys(size_t cnt) const {
+        if (m_reccnt == 0) return cnt == 0;
+
+        size_t distinct = 1;
+        key_t prev = this->get_key_at(0);
+        for (size_t i=1; i<m_reccnt && distinct < cnt; i++) {
+            key_t key = this->get_key_at(i);
+            distinct += (key != prev);
+            prev = key;
+        }
+
+        return distinct >= cnt;
+    }
+
+    /*
+     * Replace the key array of the run with its compressed blocks, once all
+     * of the records have been added.
+     */
+    void compress_keys() {
+        constexpr size_t B = inmem_isam_key_leaf_fanout;
+        constexpr size_t header_words = sizeof(InMemKeyBlock) / sizeof(uint64_t);
+        m_key_block_cnt = m_reccnt / B + (m_reccnt % B != 0);
+
+        size_t offsets_size = std::max(CACHELINEALIGN(m_key_block_cnt * sizeof(uint32_t)), CACHELINE_SIZE);
+        m_key_offsets = (uint32_t*)this->alloc(offsets_size);
+
+        // Space is kept for a whole block of deltas even in the last one,
+        // so that searches can count every slot.
+        std::vector<uint32_t> widths(m_key_block_cnt);
+        m_packed_key_cnt = 0;
+        for (size_t i=0; i<m_key_block_cnt; i++) {
+            size_t cnt = std::min(B, m_reccnt - i * B);
+            key_t max_delta = m_keys[i * B + cnt - 1] - m_keys[i * B];
+            widths[i] = (max_delta <= UINT8_MAX) ? 1 : (max_delta <= UINT16_MAX) ? 2 : (max_delta <= UINT32_MAX) ? 4 : 8;
+
+            m_key_offsets[i] = m_packed_key_cnt;
+            m_packed_key_cnt += header_words + (B * widths[i]) / sizeof(uint64_t);
+        }
+
+        assert(m_packed_key_cnt <= UINT32_MAX);
+        size_t packed_size = std::max(CACHELINEALIGN(m_packed_key_cnt * sizeof(uint64_t)), CACHELINE_SIZE);
+        m_packed_keys = (uint64_t*)this->alloc(packed_size);
+
+        for (size_t i=0; i<m_key_block_cnt; i++) {
+            auto blk = new (m_packed_keys + m_key_offsets[i]) InMemKeyBlock{m_keys[i * B], (uint32_t) i, widths[i]};
+            auto deltas = reinterpret_cast<char*>(blk + 1);
+            for (size_t j=0; j<B; j++) {
+                // Slots past the end of the run hold the maximum delta, so
+                // that the block stays sorted. The low bytes of each delta
+                // are copied, assuming a little-endian machine.
+                uint64_t delta = (i * B + j < m_reccnt) ? m_keys[i * B + j] - blk->base : UINT64_MAX;
+                memcpy(deltas + j * blk->width, &delta, blk->width);
+            }
+        }
+
+        this->release(m_keys);
+        m_keys = nullptr;
+    }
+
+    const InMemKeyBlock *key_block(size_t blk) const {
+        return reinterpret_cast<const InMemKeyBlock*>(m_packed_keys + m_key_offsets[blk]);
+    }
+
+    /*
+     * Find the lower bound of key, or the upper bound if Upper, using the
+     * learned index. The estimate's window is searched first. The bound of
+     * a key with many duplicates may lie outside of it, in which case the
+     * search continues in the appropriate direction.
+     */
+    template <bool Upper>
+    size_t ts_search(const key_t& key) const {
+        auto pred = [&](const key_t& k) { return (Upper) ? k <= key : k < key; };
+        auto bound = m_ts->GetSearchBound(key);
+
+        if (bound.begin > 0 && !pred(this->get_key_at(bound.begin - 1))) {
+            return this->partition_point(0, bound.begin, pred);
+        }
+
+        size_t idx = this->partition_point(bound.begin, bound.end, pred);
+        return (idx == bound.end) ? gallop(idx, pred) : idx;
+    }
+
     void build_internal_levels() {
-        size_t n_leaf_nodes = m_reccnt / inmem_isam_leaf_fanout + (m_reccnt % inmem_isam_leaf_fanout != 0);
+        size_t leaf_fanout = this->leaf_fanout();
+        size_t n_leaf_nodes = m_reccnt / leaf_fanout + (m_reccnt % leaf_fanout != 0);
         size_t level_node_cnt = n_leaf_nodes;
         size_t node_cnt = 0;
         do {
@@ -283,26 +968,26 @@ private:
         size_t alloc_size = (node_cnt * inmem_isam_node_size) + (CACHELINE_SIZE - (node_cnt * inmem_isam_node_size) % CACHELINE_SIZE);
         assert(alloc_size % CACHELINE_SIZE == 0);
 
-        m_isam_nodes = (InMemISAMNode*)std::aligned_alloc(CACHELINE_SIZE, alloc_size);
+        m_isam_nodes = (InMemISAMNode*)this->alloc(alloc_size);
         m_internal_node_cnt = node_cnt;
         memset(m_isam_nodes, 0, node_cnt * inmem_isam_node_size);
 
         InMemISAMNode* current_node = m_isam_nodes;
+        std::vector<size_t> child_cnts(node_cnt, 0);
 
-        const record_t* leaf_base = m_data;
-        const record_t* leaf_stop = m_data + m_reccnt;
-        while (leaf_base < leaf_stop) {
+        size_t leaf_start = 0;
+        while (leaf_start < m_reccnt) {
             size_t fanout = 0;
             for (size_t i = 0; i < inmem_isam_fanout; ++i) {
-                auto rec_ptr = leaf_base + inmem_isam_leaf_fanout * i;
-                if (rec_ptr >= leaf_stop) break;
-                const record_t* sep_key = std::min(rec_ptr + inmem_isam_leaf_fanout - 1, leaf_stop - 1);
-                current_node->keys[i] = sep_key->key;
-                current_node->child[i] = (char*)rec_ptr;
+                size_t rec_idx = leaf_start + leaf_fanout * i;
+                if (rec_idx >= m_reccnt) break;
+                current_node->keys[i] = this->get_key_at(std::min(rec_idx + leaf_fanout - 1, m_reccnt - 1));
+                current_node->child[i] = (this->leaf_ptr(rec_idx) - this->leaf_base()) | INMEM_ISAM_LEAF_BIT;
                 ++fanout;
             }
+            child_cnts[current_node - m_isam_nodes] = fanout;
             current_node++;
-            leaf_base += fanout * inmem_isam_leaf_fanout;
+            leaf_start += fanout * leaf_fanout;
         }
 
         auto level_start = m_isam_nodes;
@@ -317,7 +1002,8 @@ private:
                     ++child_cnt;
                     if (node_ptr >= level_stop) break;
                     current_node->keys[i] = node_ptr->keys[inmem_isam_fanout - 1];
-                    current_node->child[i] = (char*)node_ptr;
+                    current_node->child[i] = node_ptr - m_isam_nodes;
+                    child_cnts[current_node - m_isam_nodes]++;
                 }
                 now += child_cnt;
                 current_node++;
@@ -326,24 +1012,544 @@ private:
             level_stop = current_node;
             current_level_node_cnt = level_stop - level_start;
         }
-        
+
         assert(current_level_node_cnt == 1);
-        m_root = level_start;
+        m_root = level_start - m_isam_nodes;
+
+        // Every separator key has now been copied into the parent level, so
+        // the nodes can be padded for searching.
+        for (size_t i=0; i<m_internal_node_cnt; i++) {
+            auto node = m_isam_nodes + i;
+
+            size_t child_cnt = child_cnts[i];
+            for (size_t j=child_cnt - 1; j<inmem_isam_fanout; j++) {
+                node->keys[j] = INMEM_ISAM_KEY_SENTINEL;
+                node->child[j] = node->child[child_cnt - 1];
+            }
+        }
+    }
+
+    /*
+     * Returns the child of an internal node in which to continue the search
+     * for the lower bound of key, or the upper bound if Upper.
+     */
+    template <bool Upper>
+    static uint64_t child_for(const InMemISAMNode* node, const key_t& key) {
+        size_t idx = std::min(inmem_isam_count<Upper>(node->keys, key), inmem_isam_fanout - 1);
+        return node->child[idx];
+    }
+
+    /*
+     * Returns the index of the lower bound of key, or the upper bound if
+     * Upper, given the leaf that the tree descent ended in. The result is
+     * always within the leaf, or just past the end of the run.
+     */
+    template <bool Upper>
+    size_t leaf_search(const char* leaf, const key_t& key) const {
+        if (m_layout == RecordLayout::COMPRESSED) {
+            // The keys of the block are searched as their offsets from its
+            // base.
+            auto blk = reinterpret_cast<const InMemKeyBlock*>(leaf);
+            size_t start = blk->idx * inmem_isam_key_leaf_fanout;
+            if ((Upper) ? key < blk->base : key <= blk->base) {
+                return start;
+            }
+
+            // Every slot of the block is counted, including those past the
+            // end of the run, which can only be counted if all of the keys
+            // of the block are as well.
+            uint64_t delta = key - blk->base;
+            size_t lo;
+            switch (blk->width) {
+                case 1: lo = inmem_isam_count_deltas<uint8_t, Upper>(blk->deltas<uint8_t>(), delta); break;
+                case 2: lo = inmem_isam_count_deltas<uint16_t, Upper>(blk->deltas<uint16_t>(), delta); break;
+                case 4: lo = inmem_isam_count_deltas<uint32_t, Upper>(blk->deltas<uint32_t>(), delta); break;
+                default: lo = inmem_isam_count_deltas<uint64_t, Upper>(blk->deltas<uint64_t>(), delta); break;
+            }
+
+            return std::min(start + lo, m_reccnt);
+        }
+
+        if (m_layout == RecordLayout::COLUMNAR) {
+            // The leaf is a whole node of keys, padded with sentinels at the
+            // end of the run, which only an upper bound of the sentinel
+            // itself counts.
+            auto keys = reinterpret_cast<const key_t*>(leaf);
+            size_t idx = (keys - m_keys) + inmem_isam_count<Upper>(keys, key) + inmem_isam_count<Upper>(keys + inmem_isam_fanout, key);
+            return std::min(idx, m_reccnt);
+        }
+
+        auto recs = reinterpret_cast<const record_t*>(leaf);
+        size_t cnt = std::min<size_t>(inmem_isam_leaf_fanout, m_data + m_reccnt - recs);
+
+        size_t idx = 0;
+        for (size_t i=0; i<cnt; i++) {
+            idx += (Upper) ? (recs[i].key <= key) : (recs[i].key < key);
+        }
+
+        return (recs - m_data) + idx;
+    }
+
+    /*
+     * Returns the index of the first record in [lo, hi) whose key does not
+     * satisfy pred, where pred holds for the keys of some prefix of the
+     * range, and not thereafter.
+     */
+    template <typename Pred>
+    size_t partition_point(size_t lo, size_t hi, Pred pred) const {
+        if (m_layout == RecordLayout::COLUMNAR) {
+            return std::partition_point(m_keys + lo, m_keys + hi, pred) - m_keys;
+        }
+
+        if (m_layout == RecordLayout::COMPRESSED) {
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (pred(this->get_key_at(mid))) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            return lo;
+        }
+
+        return std::partition_point(m_data + lo, m_data + hi, [&](const record_t& rec) { return pred(rec.key); }) - m_data;
+    }
+
+    /*
+     * Returns the index of the first record at or after start whose key
+     * does not satisfy pred, where pred holds for the keys of some prefix of
+     * the run and not thereafter. Probes at exponentially increasing
+     * distances from start, and then binary searches the final interval.
+     */
+    template <typename Pred>
+    size_t gallop(size_t start, Pred pred) const {
+        if (start >= m_reccnt || !pred(this->get_key_at(start))) {
+            return start;
+        }
+
+        size_t lo = start;
+        size_t step = 1;
+        size_t hi = start + 1;
+        while (hi < m_reccnt && pred(this->get_key_at(hi))) {
+            lo = hi;
+            step *= 2;
+            hi = lo + step;
+        }
+
+        hi = std::min(hi, m_reccnt);
+        return this->partition_point(lo + 1, hi, pred);
+    }
+
+    /*
+     * Allocate space for up to cap records, in the run's layout. The key
+     * array of a columnar run is padded out to a whole number of leaves.
+     * Compressed keys are also gathered here until the run is complete.
+     */
+    void alloc_records(size_t cap) {
+        if (!this->is_columnar()) {
+            size_t alloc_size = (cap * sizeof(record_t)) + (CACHELINE_SIZE - (cap * sizeof(record_t)) % CACHELINE_SIZE);
+            assert(alloc_size % CACHELINE_SIZE == 0);
+            m_data = (record_t*)this->alloc_data(alloc_size);
+            return;
+        }
+
+        size_t key_cap = std::max(TYPEALIGN(inmem_isam_key_leaf_fanout, cap), inmem_isam_key_leaf_fanout);
+        size_t bitmap_size = CACHELINEALIGN(sizeof(uint64_t) * (cap / 64 + 1));
+
+        m_keys = (key_t*)this->alloc_data(key_cap * sizeof(key_t));
+        m_values = (value_t*)this->alloc(std::max(CACHELINEALIGN(cap * sizeof(value_t)), CACHELINE_SIZE));
+
+        m_tombstone_bits = (uint64_t*)this->alloc(bitmap_size);
+        memset(m_tombstone_bits, 0, bitmap_size);
+
+        m_delete_bits = (std::atomic<uint64_t>*)this->alloc(bitmap_size);
+        for (size_t i=0; i<bitmap_size / sizeof(uint64_t); i++) {
+            new (&m_delete_bits[i]) std::atomic<uint64_t>(0);
+        }
+    }
+
+    /*
+     * Returns the indexes of the non-empty runs in increasing order of their
+     * keys, if each run's keys are all strictly less than those of the next,
+     * or an empty vector otherwise.
+     */
+    static std::vector<size_t> disjoint_order(InMemRun** runs, size_t len) {
+        std::vector<size_t> order;
+        for (size_t i=0; i<len; i++) {
+            if (runs[i] && runs[i]->get_record_count() > 0) {
+                order.push_back(i);
+            }
+        }
+
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return runs[a]->get_key_at(0) < runs[b]->get_key_at(0);
+        });
+
+        for (size_t i=1; i<order.size(); i++) {
+            auto prev = runs[order[i - 1]];
+            if (prev->get_key_at(prev->get_record_count() - 1) >= runs[order[i]]->get_key_at(0)) {
+                return {};
+            }
+        }
+
+        return order;
+    }
+
+    /*
+     * Build the run from runs with disjoint key ranges, taken in the
+     * specified order, by copying their records a chunk at a time. Only the
+     * chunks of runs that have tombstones, or records to be dropped as
+     * deleted, are examined record by record.
+     */
+    void concat_runs(InMemRun** runs, const std::vector<size_t>& order, BloomFilter* bf) {
+        size_t reccnt = 0;
+        for (auto i : order) {
+            reccnt += runs[i]->get_record_count();
+        }
+
+        this->alloc_records(reccnt);
+
+        for (auto i : order) {
+            auto run = runs[i];
+            bool skip_deleted = m_tagging && run->m_deleted_cnt > 0;
+            bool has_tombstones = run->get_tombstone_count() > 0;
+
+            InMemRunReader reader(run, 0, run->get_record_count());
+            while (reader.next()) {
+                auto recs = reader.get_item();
+                size_t cnt = reader.get_item_count();
+
+                if (!skip_deleted && !has_tombstones) {
+                    this->append_records(recs, cnt);
+                    continue;
+                }
+
+                for (size_t j=0; j<cnt; j++) {
+                    if (skip_deleted && recs[j].get_delete_status()) continue;
+
+                    this->append_record(recs[j]);
+                    if (recs[j].is_tombstone()) {
+                        ++m_tombstone_cnt;
+                        if (bf) bf->insert(recs[j].key);
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Build the run from two runs with overlapping key ranges, a taking
+     * precedence over b for equal records as in the general merge. Their
+     * keys are first merged on their own, by merge_keys, into the order of
+     * the positions of their records, which are then read in that order
+     * in a second pass that puts records with equal keys in order of their
+     * values and cancels out records and tombstones, as the general merge
+     * would.
+     */
+    void merge_pair(const InMemRun* a, const InMemRun* b, BloomFilter* bf) {
+        size_t na = a->get_record_count();
+        size_t nb = b->get_record_count();
+        size_t n = na + nb;
+
+        this->alloc_records(n);
+
+        auto order = (uint64_t*) huge_alloc(n * sizeof(uint64_t));
+
+        // Set in the positions of records that have been canceled out by
+        // an earlier one.
+        constexpr uint64_t canceled = 1ull << 62;
+        // Compressed keys must first be decoded, and the space for this is
+        // only faulted in if they are.
+        auto key_buf = (key_t*) huge_alloc(n * sizeof(key_t));
+        size_t a_stride, b_stride;
+        auto a_keys = a->get_keys(key_buf, a_stride);
+        auto b_keys = b->get_keys(key_buf + na, b_stride);
+        merge_keys(a_keys, na, a_stride, b_keys, nb, b_stride, order);
+        huge_free(key_buf);
+
+        // The input is chosen by indexing rather than branching, as the
+        // inputs of a merge are often interleaved record by record.
+        const InMemRun* inputs[] = {a, b};
+        auto get = [&](uint64_t pos) {
+            return inputs[pos >> 63]->get_record(pos & ~(MERGE_FROM_B | canceled));
+        };
+
+        auto get_key = [&](uint64_t pos) {
+            return inputs[pos >> 63]->get_key_at(pos & ~(MERGE_FROM_B | canceled));
+        };
+
+        // Records can only be canceled by the tombstones of the other input.
+        bool cancel[] = {!m_tagging && b->get_tombstone_count() > 0, !m_tagging && a->get_tombstone_count() > 0};
+
+        size_t group_end = 0;
+        size_t heads[2] = {0, 0};
+        for (size_t i=0; i<n; i++) {
+            if (order[i] & canceled) continue;
+            auto rec = get(order[i]);
+
+            // Order each run of equal keys by value, and then with the
+            // records of a first, each input's in their original order.
+            if (i >= group_end) {
+                group_end = i + 1;
+                while (group_end < n && get_key(order[group_end]) == rec.key) group_end++;
+
+                if (group_end - i > 1) {
+                    std::sort(order + i, order + group_end, [&](uint64_t x, uint64_t y) {
+                        auto vx = get(x).value;
+                        auto vy = get(y).value;
+                        return vx < vy || (vx == vy && x < y);
+                    });
+                    rec = get(order[i]);
+                }
+
+                heads[0] = heads[1] = i;
+            }
+
+            // As in the general merge, a record is canceled by the current
+            // record of the other input, if that is its tombstone. This is
+            // the first one of that input after it that is not canceled.
+            if (cancel[order[i] >> 63] && !rec.is_tombstone()) {
+                uint64_t other = ~order[i] & MERGE_FROM_B;
+                size_t &j = heads[other != 0];
+                while (j < group_end && (j <= i || (order[j] & (canceled | MERGE_FROM_B)) != other)) j++;
+
+                if (j < group_end) {
+                    auto next = get(order[j]);
+                    if (rec.match(&next) && next.is_tombstone()) {
+                        order[j] |= canceled;
+                        continue;
+                    }
+                }
+            }
+
+            if (m_tagging && rec.get_delete_status()) continue;
+
+            this->append_record(rec);
+            if (rec.is_tombstone()) {
+                ++m_tombstone_cnt;
+                if (bf) bf->insert(rec.key);
+            }
+        }
+
+        huge_free(order);
+    }
+
+    /*
+     * Returns the keys of the run, every stride keys apart. These are read
+     * in place from the records or key array of the run, unless they are
+     * compressed, in which case they are decoded into buf, which must have
+     * room for all of them.
+     */
+    const key_t* get_keys(key_t* buf, size_t& stride) const {
+        static_assert(sizeof(record_t) % sizeof(key_t) == 0, "keys of records are read as a strided array");
+
+        stride = 1;
+        switch (m_layout) {
+            case RecordLayout::ROW:
+                stride = sizeof(record_t) / sizeof(key_t);
+                return &m_data[0].key;
+            case RecordLayout::COLUMNAR:
+                return m_keys;
+            default:
+                for (size_t i=0; i<m_reccnt; i++) {
+                    buf[i] = this->get_key_at(i);
+                }
+                return buf;
+        }
+    }
+
+    /*
+     * Add cnt records, in order, to the end of the run.
+     */
+    void append_records(const record_t* recs, size_t cnt) {
+        if (!this->is_columnar()) {
+            memcpy(m_data + m_reccnt, recs, cnt * sizeof(record_t));
+            m_reccnt += cnt;
+            return;
+        }
+
+        for (size_t i=0; i<cnt; i++) {
+            this->append_record(recs[i]);
+        }
+    }
+
+    /*
+     * Add a record to the end of the run. Space for it must already have
+     * been allocated by alloc_records.
+     */
+    void append_record(const record_t& rec) {
+        if (!this->is_columnar()) {
+            m_data[m_reccnt++] = rec;
+            return;
+        }
+
+        m_keys[m_reccnt] = rec.key;
+        m_values[m_reccnt] = rec.value;
+
+        uint64_t bit = 1ull << (m_reccnt % 64);
+        if (rec.is_tombstone()) {
+            m_tombstone_bits[m_reccnt / 64] |= bit;
+        }
+
+        if (rec.get_delete_status()) {
+            m_delete_bits[m_reccnt / 64].fetch_or(bit, std::memory_order_relaxed);
+        }
+
+        m_reccnt++;
+    }
+
+    /*
+     * Allocate the record array of the run, first choosing the node on
+     * which the run is to be placed, if LSM_NUMA_AWARE.
+     */
+    void *alloc_data(size_t size) {
+        if (LSM_NUMA_AWARE) {
+            m_numa_node = (size >= NUMA_INTERLEAVE_MIN_SIZE) ? NUMA_NO_NODE : numa_next_node();
+        }
+
+        return this->alloc(size);
     }
 
-    bool is_leaf(const char* ptr) const {
-        return ptr >= (const char*)m_data && ptr < (const char*)(m_data + m_reccnt);
+    /*
+     * Allocate memory for the run, placed on the run's node if
+     * LSM_NUMA_AWARE, in which case the run's buffer pool is bypassed, as
+     * its buffers may be on any node. Otherwise large arrays are backed by
+     * huge pages, and drawn from the run's buffer pool, if it has one.
+     */
+    void *alloc(size_t size) {
+        if (LSM_NUMA_AWARE) {
+            void *ptr = numa_alloc(size, m_numa_node);
+            if (ptr) m_numa_buffers[ptr] = size;
+            return ptr;
+        }
+
+        return (m_pool) ? m_pool->alloc(size) : huge_alloc(size);
+    }
+
+    size_t leaf_fanout() const {
+        return (this->is_columnar()) ? inmem_isam_key_leaf_fanout : inmem_isam_leaf_fanout;
+    }
+
+    /*
+     * Returns a pointer to the leaf of the tree beginning with the record at
+     * idx: into the key array of a columnar run, its key blocks if they are
+     * compressed, or the record array otherwise.
+     */
+    const char* leaf_ptr(size_t idx) const {
+        switch (m_layout) {
+            case RecordLayout::ROW:
+                return reinterpret_cast<const char*>(m_data + idx);
+            case RecordLayout::COLUMNAR:
+                return reinterpret_cast<const char*>(m_keys + idx);
+            default:
+                return reinterpret_cast<const char*>(this->key_block(idx / inmem_isam_key_leaf_fanout));
+        }
+    }
+
+    /*
+     * Returns the start of the array that the leaves of the tree are in,
+     * from which the leaf children of internal nodes are offsets.
+     */
+    const char* leaf_base() const {
+        switch (m_layout) {
+            case RecordLayout::ROW:
+                return reinterpret_cast<const char*>(m_data);
+            case RecordLayout::COLUMNAR:
+                return reinterpret_cast<const char*>(m_keys);
+            default:
+                return reinterpret_cast<const char*>(m_packed_keys);
+        }
+    }
+
+    const char* leaf_at(uint64_t child) const {
+        return this->leaf_base() + (child & ~INMEM_ISAM_LEAF_BIT);
+    }
+
+    /*
+     * Free memory allocated for the run, through the allocator that it
+     * came from, unless it is part of the file mapping the run was loaded
+     * from.
+     */
+    void release(const void *ptr) {
+        auto p = reinterpret_cast<const char*>(ptr);
+        if (!p || (p >= m_mapping && p < m_mapping + m_mapping_size)) return;
+
+        auto it = m_numa_buffers.find(ptr);
+        if (it != m_numa_buffers.end()) {
+            numa_free(const_cast<char*>(p), it->second);
+            m_numa_buffers.erase(it);
+        } else if (m_pool) {
+            m_pool->release(const_cast<char*>(p));
+        } else {
+            huge_free(const_cast<char*>(p));
+        }
     }
 
     // Members: sorted data, internal ISAM levels, reccnt;
-    record_t* m_data;
+    record_t* m_data = nullptr;
     InMemISAMNode* m_isam_nodes;
-    InMemISAMNode* m_root;
+    uint64_t m_root = 0;
     size_t m_reccnt;
     size_t m_tombstone_cnt;
     size_t m_internal_node_cnt;
     size_t m_deleted_cnt;
     bool m_tagging;
+
+    // The learned index over the run's keys, if it is searched using one.
+    bool m_learned_index;
+    ts::TrieSpline<key_t>* m_ts = nullptr;
+
+    // The columns of the records, in place of m_data, if the run is
+    // columnar. Bit i%64 of word i/64 of each bitmap is the flag of record i.
+    // Compressed keys replace m_keys with m_packed_keys, which holds each
+    // block, header first, at the word offset given by m_key_offsets.
+    RecordLayout m_layout;
+    key_t* m_keys = nullptr;
+    uint32_t* m_key_offsets = nullptr;
+    size_t m_key_block_cnt = 0;
+    uint64_t* m_packed_keys = nullptr;
+    size_t m_packed_key_cnt = 0;
+    value_t* m_values = nullptr;
+    uint64_t* m_tombstone_bits = nullptr;
+    std::atomic<uint64_t>* m_delete_bits = nullptr;
+
+    // The node the run is placed on, when LSM_NUMA_AWARE, and the size of
+    // each of its buffers that was allocated there by numa_alloc.
+    int m_numa_node = NUMA_NO_NODE;
+    std::unordered_map<const void*, size_t> m_numa_buffers;
+
+    // The file mapping the run was loaded from, if any.
+    char* m_mapping = nullptr;
+    size_t m_mapping_size = 0;
+    // The pool the run's buffers are drawn from and returned to, if any.
+    std::shared_ptr<BufferPool> m_pool;
 };
 
+inline InMemRunReader::InMemRunReader(const InMemRun *run, size_t start, size_t cnt)
+: m_run(run), m_next(start), m_end(start + cnt), m_item(nullptr), m_item_cnt(0) {
+    if (run->is_columnar()) {
+        m_buffer.resize(INMEM_RUN_READ_CHUNK);
+    }
+}
+
+inline bool InMemRunReader::next() {
+    if (m_next >= m_end) {
+        return false;
+    }
+
+    if (!m_run->is_columnar()) {
+        m_item = m_run->sorted_output() + m_next;
+        m_item_cnt = m_end - m_next;
+    } else {
+        m_item_cnt = std::min(INMEM_RUN_READ_CHUNK, m_end - m_next);
+        m_run->get_records(m_next, m_item_cnt, m_buffer.data());
+        m_item = m_buffer.data();
+    }
+
+    m_next += m_item_cnt;
+    return true;
+}
+
 }
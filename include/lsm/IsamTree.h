@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include <thread>
+#include <vector>
+#include <algorithm>
+
 #include "util/base.h"
 #include "util/types.h"
 #include "util/record.h"
@@ -11,10 +15,11 @@
 #include "io/PagedFile.h"
 #include "ds/BloomFilter.h"
 #include "lsm/MemTable.h"
-#include "ds/PriorityQueue.h"
+#include "ds/LoserTree.h"
 #include "util/Cursor.h"
 #include "lsm/InMemRun.h"
 #include "util/internal_record.h"
+#include "ds/ts/builder.h"
 
 namespace lsm { 
 
@@ -32,6 +37,25 @@ const PageNum BTREE_FIRST_LEAF_PNUM = 2;
 const size_t ISAM_INIT_BUFFER_SIZE = 64; // measured in pages
 const size_t ISAM_RECORDS_PER_LEAF = PAGE_SIZE / sizeof(record_t);
 
+// The maximum number of threads used to merge the inputs of a new ISAM tree,
+// and the minimum number of input records that each of them must be given.
+// Merges of fewer records than this are performed on a single thread.
+const size_t ISAM_MERGE_THREADS = 8;
+const size_t ISAM_MIN_PARTITION_SIZE = 4 * ISAM_INIT_BUFFER_SIZE * ISAM_RECORDS_PER_LEAF;
+
+// False to skip writing the internal levels of new trees to disk. Searches
+// use the in-memory leaf fences regardless, so the on-disk levels are only
+// needed by external tools that walk the file.
+const bool ISAM_DISK_INTERNAL_LEVELS = true;
+
+// True to search the leaf fences of trees with at least
+// ISAM_LEARNED_INDEX_MIN_LEAVES leaves using a TrieSpline, rather than by
+// binary search, with position estimates that are off by at most
+// ISAM_TS_MAX_ERROR leaves.
+const bool ISAM_LEARNED_INDEX = true;
+const size_t ISAM_LEARNED_INDEX_MIN_LEAVES = 64;
+const size_t ISAM_TS_MAX_ERROR = 16;
+
 thread_local size_t cancelations = 0;
 
 // Convert an index into the runs array to the
@@ -56,58 +80,35 @@ public:
     , tombstone_cnt(ts_cnt)
     , retain_file(false) {
 
-        // rebuild the bloom filters
-        auto iter = this->start_scan();
-        size_t records_processed = 0;
-        while (iter->next()) {
-            auto pg = (record_t*)iter->get_item();
-            for (size_t i=0; i < PAGE_SIZE/sizeof(record_t); i++) {
-                if (++records_processed > this->rec_cnt) {
-                    break;
-                }
-
-                auto key = pg[i].key;
-                tomb_filter->insert(key);
-            }
-        }
-
-        delete iter;
+        // rebuild the bloom filters and leaf fences
+        this->scan_leaves(tomb_filter);
+        this->build_learned_index();
     }
 
+    /*
+     * Create a new ISAM Tree by merging together the records of a set of
+     * in-memory runs and other ISAM trees. The input key space is split into
+     * disjoint ranges, which are merged concurrently on separate threads,
+     * each directly into the leaf pages that the range would occupy if no
+     * records were canceled out by tombstones. The ranges are then stitched
+     * together, shifting them down to close any gaps left by cancellation.
+     * If the inputs have disjoint key ranges, their records are instead
+     * copied over one input after another, without being compared.
+     */
     ISAMTree(PagedFile *pfile, const gsl_rng *rng, BloomFilter *tomb_filter, InMemRun * const* runs, size_t run_cnt, ISAMTree * const*trees, size_t tree_cnt) {
         TIMER_INIT();
-        std::vector<Cursor> cursors(run_cnt + tree_cnt);
-        std::vector<PagedFileIterator *> isam_iters(tree_cnt);
-
-        PriorityQueue pq(run_cnt + tree_cnt);
 
         size_t incoming_record_cnt = 0;
         size_t incoming_tombstone_cnt = 0;
 
-        TIMER_START();
-        // Initialize the priority queue
-        // load up the disk levels
         for (size_t i=0; i<tree_cnt; i++) {
             assert(trees[i]);
-            isam_iters[i] = trees[i]->start_scan();
-            assert(isam_iters[i]->next());
-            const record_t *start = (record_t*)isam_iters[i]->get_item();
-            const record_t *end = start + ISAM_RECORDS_PER_LEAF;
-            cursors[TCUR(i)] = Cursor{start, end, 0, trees[i]->get_record_count()};
-            pq.push(cursors[TCUR(i)].ptr, TCUR(i));
-
             incoming_record_cnt += trees[i]->get_record_count();
             incoming_tombstone_cnt += trees[i]->get_tombstone_count();
         }
 
-        // load up the memory levels;
         for (size_t i=0; i<run_cnt; i++) {
             assert(runs[i]);
-            const record_t *start = runs[i]->sorted_output();
-            const record_t *end = start + runs[i]->get_record_count();
-            cursors[RCUR(i)] = Cursor{start, end, 0, runs[i]->get_record_count()};
-            pq.push(cursors[RCUR(i)].ptr, RCUR(i));
-
             incoming_record_cnt += runs[i]->get_record_count();
             incoming_tombstone_cnt += runs[i]->get_tombstone_count();
         }
@@ -116,88 +117,63 @@ public:
         size_t last_leaf_rec_cnt = 0;
 
         PageNum leaf_page_cnt = ISAMTree::pre_init(incoming_record_cnt, incoming_tombstone_cnt, rng, pfile, &buffer);
-        assert(leaf_page_cnt);
         assert(buffer);
 
-        PageNum cur_leaf_pnum = BTREE_FIRST_LEAF_PNUM;
-        size_t output_idx = 0;
-
-        this->rec_cnt = 0;
-        this->tombstone_cnt = 0;
-
-        while (pq.size()) {
-            auto cur = pq.peek();
-            auto next = pq.size() > 1 ? pq.peek(1) : queue_record{nullptr, 0};
-
-            // If this record is not a tombstone, and there is another
-            // record next in the stream with the same key and value, then
-            // the record and tombstone should cancel each other out.
-            if (!cur.data->is_tombstone() && next.data != nullptr &&
-                cur.data->match(next.data) && next.data->is_tombstone()) {
-                
-                // pop the next two records from the queue and discard them
-                pq.pop(); pq.pop();
-                cancelations++;
-
-                auto iter = (cur.version >= tree_cnt) ? nullptr : isam_iters[cur.version];
-                if (advance_cursor(cursors[cur.version], iter)) {
-                    pq.push(cursors[cur.version].ptr, cur.version);
-
-                }
-
-                iter = (next.version >= tree_cnt ? nullptr : isam_iters[next.version]);
-                if (advance_cursor(cursors[next.version], iter)) {
-                    pq.push(cursors[next.version].ptr, next.version);
-                }
-
-                continue;
-            }
-
-            memcpy(buffer +  sizeof(record_t) * output_idx, cur.data, sizeof(record_t));
-            output_idx++;
-            this->rec_cnt += 1;
-            if (cur.data->is_tombstone() && tomb_filter) {
-                tomb_filter->insert(cur.data->key);
-                this->tombstone_cnt += 1;
+        TIMER_START();
+        auto partitions = ISAMTree::partition_inputs(runs, run_cnt, trees, tree_cnt, incoming_record_cnt, buffer);
+        auto order = ISAMTree::disjoint_order(runs, run_cnt, trees, tree_cnt);
+
+        if (partitions.size() == 1) {
+            ISAMTree::merge_partition(partitions[0], pfile, tomb_filter, runs, run_cnt, trees, tree_cnt, order);
+        } else {
+            std::vector<std::thread> workers(partitions.size());
+            for (size_t i=0; i<partitions.size(); i++) {
+                workers[i] = std::thread(ISAMTree::merge_partition, std::ref(partitions[i]), pfile, tomb_filter, runs, run_cnt, trees, tree_cnt, std::cref(order));
             }
-            
-            pq.pop();
-
-            auto iter = (cur.version >= tree_cnt) ? nullptr : isam_iters[cur.version];
 
-            if (advance_cursor(cursors[cur.version], iter)) {
-                    pq.push(cursors[cur.version].ptr, cur.version);
+            for (size_t i=0; i<workers.size(); i++) {
+                workers[i].join();
             }
+        }
 
-            if (output_idx >= ISAM_INIT_BUFFER_SIZE * ISAM_RECORDS_PER_LEAF) {
-                assert(pfile->write_pages(cur_leaf_pnum, ISAM_INIT_BUFFER_SIZE, buffer));
-                output_idx = 0;
-                cur_leaf_pnum += ISAM_INIT_BUFFER_SIZE;
-            }
+        this->rec_cnt = 0;
+        this->tombstone_cnt = 0;
+        for (auto &part : partitions) {
+            this->rec_cnt += part.output_cnt;
+            this->tombstone_cnt += part.tombstone_cnt;
+            cancelations += part.cancelations;
         }
 
-        this->last_data_page = ISAMTree::write_final_buffer(output_idx, cur_leaf_pnum, &last_leaf_rec_cnt, pfile, buffer);
-        assert(this->last_data_page != INVALID_PNUM);
+        ISAMTree::stitch_partitions(partitions, pfile, buffer);
+
+        size_t used_leaf_pages = (this->rec_cnt / ISAM_RECORDS_PER_LEAF) + ((this->rec_cnt % ISAM_RECORDS_PER_LEAF) != 0);
+        assert(used_leaf_pages <= leaf_page_cnt);
+        this->last_data_page = BTREE_FIRST_LEAF_PNUM + used_leaf_pages - 1;
+        last_leaf_rec_cnt = this->rec_cnt % ISAM_RECORDS_PER_LEAF;
 
         TIMER_STOP();
         auto copy_time = TIMER_RESULT();
 
+        this->pfile = pfile;
+        this->retain_file = false;
+        this->first_data_page = BTREE_FIRST_LEAF_PNUM;
+
+        // The leaf fences are collected while building the first internal
+        // level, which reads every leaf anyway, or else by a separate scan.
         TIMER_START();
-        this->root_page = ISAMTree::generate_internal_levels(pfile, last_leaf_rec_cnt, buffer, ISAM_INIT_BUFFER_SIZE);
+        if (ISAM_DISK_INTERNAL_LEVELS) {
+            this->root_page = ISAMTree::generate_internal_levels(pfile, this->last_data_page, last_leaf_rec_cnt, buffer, ISAM_INIT_BUFFER_SIZE, &m_leaf_min, &m_leaf_max);
+        } else {
+            this->root_page = INVALID_PNUM;
+            this->scan_leaves(nullptr);
+        }
+        this->build_learned_index();
         TIMER_STOP();
 
         auto internal_time = TIMER_RESULT();
-        this->first_data_page = BTREE_FIRST_LEAF_PNUM;
 
         assert(ISAMTree::post_init(this->rec_cnt, this->tombstone_cnt, this->last_data_page, this->root_page, buffer, pfile));
 
-        for (size_t i=0; i<isam_iters.size(); i++) {
-            delete isam_iters[i];
-        }
-
-        this->pfile = pfile;
-        this->retain_file = false;
-
         free(buffer);
     }
 
@@ -206,6 +182,8 @@ public:
         if (!this->retain_file) {
             this->pfile->remove_file();
         }
+
+        delete m_ts;
     }
 
     /*
@@ -213,22 +191,17 @@ public:
      * greater than or equal to the specified boundary key. Returns INVALID_PID
      * if no pages satisfy this constraint.
      *
-     * buffer is a thread-local buffer to be used for IO, to avoid any
-     * inter-thread contention on internal buffering state. This must be
-     * aligned to SECTOR_SIZE and be at least PAGE_SIZE in length. Its contents
-     * will vary over the function call and are not defined. Any data within it
-     * will be clobbered by this function.
+     * The page is found using the in-memory leaf fences, and so no IO is
+     * performed. buffer is unused, and is accepted for symmetry with the
+     * *_index variants, which read the page into it.
      */
     PageNum get_lower_bound(const key_t& key, char *buffer) {
-        PageNum current_page = this->root_page;
-        // The leaf pages are all allocated contiguously at the start of the file,
-        // so we'll know when we have a pointer to one when the pnum is no larger
-        // than the last data page.
-        while (current_page > this->last_data_page) {
-            current_page = search_internal_node_lower(current_page, key, buffer);
+        size_t idx = this->fence_search<false>(key);
+        if (idx == m_leaf_max.size()) {
+            return INVALID_PNUM;
         }
 
-        return current_page;
+        return this->first_data_page + idx;
     }
 
     std::pair<PageNum, size_t> get_lower_bound_index(const key_t& key, char *buffer) {
@@ -271,32 +244,29 @@ public:
      * than or equal to the specified boundary key. Returns INVALID_PID if no
      * pages satisfy this constraint.
      *
-     * buffer is a thread-local buffer to be used for IO, to avoid any
-     * inter-thread contention on internal buffering state. This must be
-     * aligned to SECTOR_SIZE and be at least PAGE_SIZE in length. Its contents
-     * will vary over the function call and are not defined. Any data within it
-     * will be clobbered by this function.
+     * The page is found using the in-memory leaf fences, and so no IO is
+     * performed. buffer is unused, and is accepted for symmetry with the
+     * *_index variants, which read the page into it.
      */
     PageNum get_upper_bound(const key_t& key, char *buffer) {
-        PageNum current_page = this->root_page;
-        // The leaf pages are all allocated contiguously at the start of the file,
-        // so we'll know when we have a pointer to one when the pnum is no larger
-        // than the last data page.
-        while (current_page > this->last_data_page) {
-            current_page = search_internal_node_upper(current_page, key, buffer);
-        }
-
-        // If the key being searched for is the boundary key, search_internal_node_upper
-        // will return the page after the page for which it is the boundary key. If the
-        // page in question does not actually contain the key being searched for, then
-        // we want to return one less than the returned page.
-        if (current_page > BTREE_FIRST_LEAF_PNUM) {
-            if (this->search_leaf_page(current_page, key, buffer) == 0) {
-                return current_page - 1;
-            }
+        if (m_leaf_max.empty()) {
+            return INVALID_PNUM;
+        }
+
+        // Every page before the first one with a key larger than the
+        // boundary key contains only smaller keys, and every page after it
+        // only larger ones, so the bound is either that page or the one
+        // before it, depending upon its first key.
+        size_t idx = this->fence_search<true>(key);
+        if (idx == m_leaf_max.size()) {
+            return this->last_data_page;
+        }
+
+        if (m_leaf_min[idx] > key) {
+            return (idx == 0) ? INVALID_PNUM : this->first_data_page + idx - 1;
         }
 
-        return current_page;
+        return this->first_data_page + idx;
     }
 
     /*
@@ -317,7 +287,7 @@ public:
         PageNum page_offset = record_idx / records_per_page;
         assert(start_page + page_offset <= this->last_data_page);
 
-        size_t idx = page_offset % records_per_page;
+        size_t idx = record_idx % records_per_page;
 
         if (start_page + page_offset != pg_in_buffer) {
             assert(this->pfile->read_page(start_page + page_offset, buffer));
@@ -349,8 +319,8 @@ public:
 
         do {
             assert(this->pfile->read_page(pnum, buffer));
-            for (size_t i=idx; i<this->max_leaf_record_idx(pnum); i++) {
-                auto rec = (record_t*)(buffer + (idx * sizeof(record_t)));
+            for (size_t i=idx; i<=this->max_leaf_record_idx(pnum); i++) {
+                auto rec = (record_t*)(buffer + (i * sizeof(record_t)));
 
                 if (!rec->lt(key, val)) {
                     return rec->match(key, val, true);
@@ -416,7 +386,12 @@ public:
      * associated with this ISAM tree.
      */
     inline size_t get_memory_utilization() {
-        return 0;
+        size_t fences = (m_leaf_min.size() + m_leaf_max.size()) * sizeof(key_t);
+        return (m_ts) ? fences + m_ts->GetSize() : fences;
+    }
+
+    bool has_learned_index() const {
+        return m_ts != nullptr;
     }
 
     /*
@@ -447,58 +422,90 @@ private:
     bool retain_file;
 
 
-    PageNum search_internal_node_lower(PageNum pnum, const key_t& key, char *buffer) {
-        assert(this->pfile->read_page(pnum, buffer));
+    // The first and last key of each leaf page, in page order.
+    std::vector<key_t> m_leaf_min;
+    std::vector<key_t> m_leaf_max;
 
-        size_t min = 0;
-        size_t max = ((ISAMTreeInternalNodeHeader *) buffer)->internal_rec_cnt - 1;
+    // A learned index over m_leaf_max, or nullptr if the fences are to be
+    // binary searched.
+    ts::TrieSpline<key_t> *m_ts = nullptr;
 
-        // If the entire range of numbers falls below the target key, the algorithm
-        // will return max as its bound, even though there actually isn't a valid
-        // bound. So we need to check this case manually and return INVALID_PNUM.
-        auto node_key = get_internal_record_key(buffer, max);
-        if (key > node_key) {
-            return INVALID_PNUM;
-        }
+    /*
+     * Read every leaf page, recording its fence keys, and inserting each of
+     * its keys into tomb_filter, if provided.
+     */
+    void scan_leaves(BloomFilter *tomb_filter) {
+        if (this->rec_cnt == 0) return;
 
-        while (min < max) {
-            size_t mid = (min + max) / 2;
-            node_key = get_internal_record_key(buffer, mid);
-            if (key > node_key) {
-                min = mid + 1;
-            } else {
-                max = mid;
+        m_leaf_min.reserve(this->get_leaf_page_count());
+        m_leaf_max.reserve(this->get_leaf_page_count());
+
+        auto iter = this->start_scan();
+        size_t records_processed = 0;
+        while (records_processed < this->rec_cnt && iter->next()) {
+            auto pg = (record_t*)iter->get_item();
+            size_t pg_cnt = std::min(ISAM_RECORDS_PER_LEAF, this->rec_cnt - records_processed);
+
+            if (tomb_filter) {
+                for (size_t i=0; i<pg_cnt; i++) {
+                    tomb_filter->insert(pg[i].key);
+                }
             }
+
+            m_leaf_min.push_back(pg[0].key);
+            m_leaf_max.push_back(pg[pg_cnt - 1].key);
+            records_processed += pg_cnt;
         }
 
-        return get_internal_value(get_internal_record(buffer, min));
+        delete iter;
     }
 
-    PageNum search_internal_node_upper(PageNum pnum, const key_t& key, char *buffer) {
-        assert(this->pfile->read_page(pnum, buffer));
+    /*
+     * Build the TrieSpline over the leaf fences, if ISAM_LEARNED_INDEX and
+     * the tree is large enough to benefit. It cannot be built over a single
+     * distinct key.
+     */
+    void build_learned_index() {
+        if (!ISAM_LEARNED_INDEX || m_leaf_max.size() < ISAM_LEARNED_INDEX_MIN_LEAVES || m_leaf_max.front() == m_leaf_max.back()) {
+            return;
+        }
 
-        size_t min = 0;
-        size_t max = ((ISAMTreeInternalNodeHeader *) buffer)->internal_rec_cnt - 1;
+        auto bldr = ts::Builder<key_t>(m_leaf_max.front(), m_leaf_max.back(), ISAM_TS_MAX_ERROR);
+        for (auto key : m_leaf_max) {
+            bldr.AddKey(key);
+        }
 
-        // If the entire range of numbers falls below the target key, the algorithm
-        // will return max as its bound, even though there actually isn't a valid
-        // bound. So we need to check this case manually and return INVALID_PNUM.
-        auto node_key = get_internal_record_key(buffer, max);
-        if (key > node_key) {
-            return INVALID_PNUM;
+        m_ts = new ts::TrieSpline<key_t>(bldr.Finalize());
+    }
+
+    /*
+     * Returns the index of the first leaf whose last key is no smaller than
+     * key, or is larger than it if Upper, or the leaf count if there is none.
+     * The window estimated by the learned index is searched first, if there
+     * is one, and the search continues outside of it if the leaf lies
+     * elsewhere, as it may for heavily duplicated keys.
+     */
+    template <bool Upper>
+    size_t fence_search(const key_t& key) const {
+        auto pred = [&](const key_t& fence) { return (Upper) ? fence <= key : fence < key; };
+        auto fences = m_leaf_max.data();
+        size_t cnt = m_leaf_max.size();
+
+        if (!m_ts) {
+            return std::partition_point(fences, fences + cnt, pred) - fences;
         }
 
-        while (min < max) {
-            size_t mid = (min + max) / 2;
-            node_key = get_internal_record_key(buffer, mid);
-            if (key >= node_key) {
-                min = mid + 1;
-            } else {
-                max = mid;
-            }
+        auto bound = m_ts->GetSearchBound(key);
+        if (bound.begin > 0 && !pred(fences[bound.begin - 1])) {
+            return std::partition_point(fences, fences + bound.begin, pred) - fences;
         }
 
-        return get_internal_value(get_internal_record(buffer, min));
+        size_t idx = std::partition_point(fences + bound.begin, fences + bound.end, pred) - fences;
+        if (idx == bound.end) {
+            idx = std::partition_point(fences + idx, fences + cnt, pred) - fences;
+        }
+
+        return idx;
     }
 
     char *search_leaf_page(PageNum pnum, const key_t& key, char *buffer, size_t *idx=nullptr) {
@@ -537,9 +544,450 @@ private:
         return nullptr;
     }
 
+    /*
+     * A disjoint key range of the inputs to a merge, along with the results
+     * of merging it. Inputs are indexed as in the merge cursor array, with
+     * the trees first, followed by the runs.
+     */
+    struct MergePartition {
+        // The index of the first record within the range, and the number of
+        // records in the range, for each input.
+        std::vector<size_t> input_start;
+        std::vector<size_t> input_cnt;
+
+        // The index of the leaf record at which the output of the partition
+        // would begin if no records were canceled.
+        size_t output_start;
+
+        size_t output_cnt;
+        size_t tombstone_cnt;
+        size_t cancelations;
+
+        // The output records falling before the first page boundary, and
+        // after the last full page, of the partition's leaf range. The
+        // pages containing these are shared with the neighboring partitions,
+        // and so are written out when the partitions are stitched together.
+        // All full pages in between are written directly by the merge.
+        std::vector<record_t> head;
+        std::vector<record_t> tail;
+    };
+
+    /*
+     * Returns the index of the first record within the tree with a key
+     * greater than or equal to key, or the record count if there is none.
+     */
+    size_t get_lower_bound_record_idx(const key_t& key, char *buffer) {
+        if (this->rec_cnt == 0) return 0;
+
+        auto lb = this->get_lower_bound_index(key, buffer);
+        if (lb.first == INVALID_PNUM) {
+            return this->rec_cnt;
+        }
+
+        return (lb.first - this->first_data_page) * ISAM_RECORDS_PER_LEAF + lb.second;
+    }
+
+    /*
+     * Split the inputs of a merge into disjoint key ranges of roughly equal
+     * size, using splitter keys drawn at even intervals from the largest
+     * input. All copies of a given key fall within the same partition, and
+     * so tombstone cancellation never crosses a partition boundary.
+     */
+    static std::vector<MergePartition> partition_inputs(InMemRun * const* runs, size_t run_cnt, ISAMTree * const* trees, size_t tree_cnt, size_t record_cnt, char *buffer) {
+        size_t input_cnt = tree_cnt + run_cnt;
+        auto input_size = [&](size_t i) {
+            return (i < tree_cnt) ? trees[i]->get_record_count() : runs[i - tree_cnt]->get_record_count();
+        };
+
+        size_t part_cnt = std::min(ISAM_MERGE_THREADS, std::max<size_t>(1, record_cnt / ISAM_MIN_PARTITION_SIZE));
+
+        std::vector<key_t> splitters;
+        if (part_cnt > 1) {
+            size_t largest = 0;
+            for (size_t i=1; i<input_cnt; i++) {
+                if (input_size(i) > input_size(largest)) largest = i;
+            }
+
+            for (size_t i=1; i<part_cnt; i++) {
+                size_t idx = i * input_size(largest) / part_cnt;
+                key_t key;
+                if (largest < tree_cnt) {
+                    auto tree = trees[largest];
+                    assert(tree->pfile->read_page(tree->first_data_page + idx / ISAM_RECORDS_PER_LEAF, buffer));
+                    key = ((record_t *) buffer)[idx % ISAM_RECORDS_PER_LEAF].key;
+                } else {
+                    key = runs[largest - tree_cnt]->get_key_at(idx);
+                }
+
+                if (splitters.empty() || key > splitters.back()) {
+                    splitters.push_back(key);
+                }
+            }
+        }
+
+        // boundaries[i][j] is the index of the first record in input j
+        // belonging to partition i.
+        std::vector<std::vector<size_t>> boundaries(splitters.size() + 2, std::vector<size_t>(input_cnt, 0));
+        for (size_t j=0; j<input_cnt; j++) {
+            boundaries[splitters.size() + 1][j] = input_size(j);
+        }
+
+        for (size_t i=0; i<splitters.size(); i++) {
+            for (size_t j=0; j<input_cnt; j++) {
+                if (j < tree_cnt) {
+                    boundaries[i + 1][j] = trees[j]->get_lower_bound_record_idx(splitters[i], buffer);
+                } else {
+                    boundaries[i + 1][j] = runs[j - tree_cnt]->get_lower_bound(splitters[i]);
+                }
+            }
+        }
+
+        std::vector<MergePartition> partitions(splitters.size() + 1);
+        size_t output_start = 0;
+        for (size_t i=0; i<partitions.size(); i++) {
+            auto &part = partitions[i];
+            part.input_start.resize(input_cnt);
+            part.input_cnt.resize(input_cnt);
+            part.output_start = output_start;
+            part.output_cnt = 0;
+            part.tombstone_cnt = 0;
+            part.cancelations = 0;
+
+            for (size_t j=0; j<input_cnt; j++) {
+                part.input_start[j] = boundaries[i][j];
+                part.input_cnt[j] = boundaries[i + 1][j] - boundaries[i][j];
+                output_start += part.input_cnt[j];
+            }
+        }
+
+        return partitions;
+    }
+
+    /*
+     * Returns the cursor indexes of the non-empty inputs of a merge in
+     * increasing order of their keys, if each input's keys are all strictly
+     * less than those of the next, or an empty vector otherwise. No record
+     * of one such input can be canceled by a tombstone in another.
+     */
+    static std::vector<size_t> disjoint_order(InMemRun * const* runs, size_t run_cnt, ISAMTree * const* trees, size_t tree_cnt) {
+        std::vector<size_t> order;
+        std::vector<std::pair<key_t, key_t>> ranges(tree_cnt + run_cnt);
+
+        for (size_t i=0; i<tree_cnt; i++) {
+            if (trees[i]->get_record_count() == 0) continue;
+            ranges[TCUR(i)] = {trees[i]->m_leaf_min.front(), trees[i]->m_leaf_max.back()};
+            order.push_back(TCUR(i));
+        }
+
+        for (size_t i=0; i<run_cnt; i++) {
+            size_t cnt = runs[i]->get_record_count();
+            if (cnt == 0) continue;
+            ranges[RCUR(i)] = {runs[i]->get_key_at(0), runs[i]->get_key_at(cnt - 1)};
+            order.push_back(RCUR(i));
+        }
+
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return ranges[a].first < ranges[b].first;
+        });
+
+        for (size_t i=1; i<order.size(); i++) {
+            if (ranges[order[i - 1]].second >= ranges[order[i]].first) {
+                return {};
+            }
+        }
+
+        return order;
+    }
+
+    /*
+     * Merge the records of a single partition, writing them into the leaf
+     * pages of pfile beginning at the partition's output_start. If order is
+     * not empty, the inputs have disjoint key ranges, and are copied over
+     * one after another in that order.
+     */
+    static void merge_partition(MergePartition &part, PagedFile *pfile, BloomFilter *tomb_filter, InMemRun * const* runs, size_t run_cnt, ISAMTree * const* trees, size_t tree_cnt,
+                                const std::vector<size_t> &order) {
+        std::vector<Cursor> cursors(run_cnt + tree_cnt);
+        std::vector<PagedFileIterator *> isam_iters(tree_cnt, nullptr);
+        std::vector<InMemRunReader *> run_readers(run_cnt, nullptr);
+
+        LoserTree lt(run_cnt + tree_cnt);
+
+        for (size_t i=0; i<tree_cnt; i++) {
+            size_t cnt = part.input_cnt[TCUR(i)];
+            if (cnt == 0) continue;
+
+            size_t start = part.input_start[TCUR(i)];
+            isam_iters[i] = trees[i]->pfile->start_scan(trees[i]->first_data_page + start / ISAM_RECORDS_PER_LEAF, trees[i]->last_data_page);
+            assert(isam_iters[i]->next());
+            const record_t *page = (record_t*)isam_iters[i]->get_item();
+            cursors[TCUR(i)] = Cursor{page + start % ISAM_RECORDS_PER_LEAF, page + ISAM_RECORDS_PER_LEAF, 0, cnt};
+            if (order.empty()) lt.push(cursors[TCUR(i)].ptr, TCUR(i));
+        }
+
+        for (size_t i=0; i<run_cnt; i++) {
+            size_t cnt = part.input_cnt[RCUR(i)];
+            if (cnt == 0) continue;
+
+            run_readers[i] = new InMemRunReader(runs[i], part.input_start[RCUR(i)], cnt);
+            assert(run_readers[i]->next());
+            const record_t *start = run_readers[i]->get_item();
+            cursors[RCUR(i)] = Cursor{start, start + run_readers[i]->get_item_count(), 0, cnt};
+            if (order.empty()) lt.push(cursors[RCUR(i)].ptr, RCUR(i));
+        }
+
+        // Advance the cursor of an input, refilling it from the input's page
+        // iterator or run reader as needed.
+        auto advance = [&](size_t version) {
+            return (version < tree_cnt) ? advance_cursor(cursors[version], isam_iters[version])
+                                        : advance_cursor(cursors[version], run_readers[version - tree_cnt]);
+        };
+
+        auto advance_chunk = [&](size_t version) {
+            return (version < tree_cnt) ? advance_cursor_chunk(cursors[version], isam_iters[version])
+                                        : advance_cursor_chunk(cursors[version], run_readers[version - tree_cnt]);
+        };
+
+        char *buffer = (char *) aligned_alloc(SECTOR_SIZE, PAGE_SIZE * ISAM_INIT_BUFFER_SIZE);
+        assert(buffer);
+
+        constexpr size_t buffer_records = ISAM_INIT_BUFFER_SIZE * ISAM_RECORDS_PER_LEAF;
+
+        // The index of the first leaf record at a page boundary within the
+        // partition's range, and of the first record currently in the buffer.
+        size_t first_full = ((part.output_start + ISAM_RECORDS_PER_LEAF - 1) / ISAM_RECORDS_PER_LEAF) * ISAM_RECORDS_PER_LEAF;
+        size_t buffer_start = first_full;
+
+        // Append cnt records to the output, a page at a time.
+        auto output = [&](const record_t *recs, size_t cnt) {
+            while (cnt > 0) {
+                size_t output_idx = part.output_start + part.output_cnt;
+                size_t n;
+                if (output_idx < first_full) {
+                    n = std::min(cnt, first_full - output_idx);
+                    part.head.insert(part.head.end(), recs, recs + n);
+                } else {
+                    size_t offset = output_idx - buffer_start;
+                    n = std::min(cnt, ISAM_RECORDS_PER_LEAF - offset % ISAM_RECORDS_PER_LEAF);
+                    memcpy(get_page(buffer, offset / ISAM_RECORDS_PER_LEAF) + sizeof(record_t) * (offset % ISAM_RECORDS_PER_LEAF), recs, n * sizeof(record_t));
+
+                    if (offset + n == buffer_records) {
+                        assert(pfile->write_pages(BTREE_FIRST_LEAF_PNUM + buffer_start / ISAM_RECORDS_PER_LEAF, ISAM_INIT_BUFFER_SIZE, buffer));
+                        buffer_start += buffer_records;
+                    }
+                }
+
+                part.output_cnt += n;
+                recs += n;
+                cnt -= n;
+            }
+        };
+
+        auto output_record = [&](const record_t &rec) {
+            output(&rec, 1);
+            if (rec.is_tombstone() && tomb_filter) {
+                tomb_filter->insert(rec.key);
+                part.tombstone_cnt += 1;
+            }
+        };
+
+        for (auto version : order) {
+            if (part.input_cnt[version] == 0) continue;
+
+            bool has_tombstones = (version < tree_cnt) ? trees[version]->get_tombstone_count() > 0
+                                                       : runs[version - tree_cnt]->get_tombstone_count() > 0;
+            auto &cursor = cursors[version];
+
+            if (!has_tombstones) {
+                do {
+                    output(cursor.ptr, cursor_chunk_size(cursor));
+                } while (advance_chunk(version));
+
+                continue;
+            }
+
+            // A record's tombstone may directly follow it within the same
+            // input, as below.
+            bool more = true;
+            while (more) {
+                record_t rec = *cursor.ptr;
+                more = advance(version);
+                if (more && !rec.is_tombstone() && rec.match(cursor.ptr) && cursor.ptr->is_tombstone()) {
+                    part.cancelations++;
+                    more = advance(version);
+                    continue;
+                }
+
+                output_record(rec);
+            }
+        }
+
+        // Replace the current record of an input in the tree with its next
+        // one, if any.
+        auto advance_tree = [&](size_t version) {
+            lt.replace(version, advance(version) ? cursors[version].ptr : nullptr);
+        };
+
+        // Records can only be canceled if there are tombstones to cancel
+        // them, and otherwise there is no need to find the next record.
+        bool has_tombstones = false;
+        for (size_t i=0; i<tree_cnt; i++) has_tombstones |= trees[i]->get_tombstone_count() > 0;
+        for (size_t i=0; i<run_cnt; i++) has_tombstones |= runs[i]->get_tombstone_count() > 0;
+
+        while (lt.size()) {
+            auto cur = lt.peek();
+            auto next = (has_tombstones) ? lt.peek_next() : queue_record{nullptr, 0};
+
+            // If this record is not a tombstone, and there is another
+            // record next in the stream with the same key and value, then
+            // the record and tombstone should cancel each other out.
+            if (!cur.data->is_tombstone() && next.data != nullptr &&
+                cur.data->match(next.data) && next.data->is_tombstone()) {
+                
+                // advance past the two records and discard them
+                part.cancelations++;
+                advance_tree(cur.version);
+                advance_tree(next.version);
+                continue;
+            }
+
+            // Advancing a cursor may overwrite the record in its page or
+            // chunk buffer, so take a copy first.
+            record_t rec = *cur.data;
+            auto &cursor = cursors[cur.version];
+
+            // Runs built with delete tagging are not internally canceled,
+            // so the record's tombstone may directly follow it within the
+            // same input.
+            bool more = advance(cur.version);
+            if (more && !rec.is_tombstone() && rec.match(cursor.ptr) && cursor.ptr->is_tombstone()) {
+                part.cancelations++;
+                advance_tree(cur.version);
+                continue;
+            }
+
+            lt.replace(cur.version, (more) ? cursor.ptr : nullptr);
+            output_record(rec);
+        }
+
+        // Write out any full pages remaining in the buffer, and hold on to
+        // the final partial page for stitching.
+        size_t output_end = part.output_start + part.output_cnt;
+        if (output_end > buffer_start) {
+            size_t full_pages = (output_end - buffer_start) / ISAM_RECORDS_PER_LEAF;
+            size_t excess = (output_end - buffer_start) % ISAM_RECORDS_PER_LEAF;
+
+            if (full_pages > 0) {
+                assert(pfile->write_pages(BTREE_FIRST_LEAF_PNUM + buffer_start / ISAM_RECORDS_PER_LEAF, full_pages, buffer));
+            }
+
+            auto tail = (record_t *) get_page(buffer, full_pages);
+            part.tail.assign(tail, tail + excess);
+        }
+
+        for (size_t i=0; i<isam_iters.size(); i++) {
+            delete isam_iters[i];
+        }
+
+        for (size_t i=0; i<run_readers.size(); i++) {
+            delete run_readers[i];
+        }
+
+        free(buffer);
+    }
+
+    /*
+     * Assemble the leaf pages shared between partitions from their head and
+     * tail records. If any records were canceled, the output of every
+     * partition following the first cancellation must also be shifted down
+     * to close the gap, which is done by streaming its records back through
+     * the file in order. As records only ever move to lower indexes, each
+     * page is read before it can be overwritten.
+     */
+    static void stitch_partitions(std::vector<MergePartition> &partitions, PagedFile *pfile, char *buffer) {
+        char *in_buffer = nullptr;
+
+        // The buffer holds out_pg_cnt pages, starting at out_pnum.
+        PageNum out_pnum = INVALID_PNUM;
+        size_t out_pg_cnt = 0;
+
+        auto flush = [&]() {
+            if (out_pnum != INVALID_PNUM) {
+                assert(pfile->write_pages(out_pnum, out_pg_cnt, buffer));
+            }
+            out_pnum = INVALID_PNUM;
+            out_pg_cnt = 0;
+        };
+
+        auto place = [&](size_t idx, const record_t *rec) {
+            PageNum pnum = BTREE_FIRST_LEAF_PNUM + idx / ISAM_RECORDS_PER_LEAF;
+
+            // Pages in the buffer must be contiguous, so that full pages
+            // written by the merge between two partial ones are not
+            // overwritten.
+            if (out_pnum != INVALID_PNUM && (pnum > out_pnum + out_pg_cnt || pnum >= out_pnum + ISAM_INIT_BUFFER_SIZE)) {
+                flush();
+            }
+
+            if (out_pnum == INVALID_PNUM) {
+                out_pnum = pnum;
+                memset(buffer, 0, PAGE_SIZE * ISAM_INIT_BUFFER_SIZE);
+            }
+
+            out_pg_cnt = std::max<size_t>(out_pg_cnt, pnum - out_pnum + 1);
+            memcpy(get_page(buffer, pnum - out_pnum) + sizeof(record_t) * (idx % ISAM_RECORDS_PER_LEAF), rec, sizeof(record_t));
+        };
+
+        size_t output_idx = 0;
+        for (auto &part : partitions) {
+            bool shifted = output_idx != part.output_start;
+
+            for (auto &rec : part.head) {
+                place(output_idx++, &rec);
+            }
+
+            size_t mid_cnt = part.output_cnt - part.head.size() - part.tail.size();
+            if (shifted) {
+                if (!in_buffer) {
+                    in_buffer = (char *) aligned_alloc(SECTOR_SIZE, PAGE_SIZE * ISAM_INIT_BUFFER_SIZE);
+                }
+
+                PageNum in_pnum = BTREE_FIRST_LEAF_PNUM + (part.output_start + part.head.size()) / ISAM_RECORDS_PER_LEAF;
+                size_t mid_pgs = mid_cnt / ISAM_RECORDS_PER_LEAF;
+                while (mid_pgs > 0) {
+                    size_t in_pgs = std::min(mid_pgs, ISAM_INIT_BUFFER_SIZE);
+                    assert(pfile->read_pages(in_pnum, in_pgs, in_buffer));
+                    for (size_t i=0; i<in_pgs; i++) {
+                        for (size_t j=0; j<ISAM_RECORDS_PER_LEAF; j++) {
+                            place(output_idx++, ((record_t *) get_page(in_buffer, i)) + j);
+                        }
+                    }
+
+                    in_pnum += in_pgs;
+                    mid_pgs -= in_pgs;
+                }
+            } else {
+                output_idx += mid_cnt;
+            }
+
+            for (auto &rec : part.tail) {
+                place(output_idx++, &rec);
+            }
+        }
+
+        flush();
+
+        if (in_buffer) free(in_buffer);
+    }
+
     static int initial_page_allocation(PagedFile *pfile, PageNum page_cnt, size_t tombstone_count, PageNum *first_leaf, PageNum *first_internal, PageNum *meta);
 
-    static PageNum generate_internal_levels(PagedFile *pfile, size_t final_leaf_rec_cnt, char *out_buffer, size_t out_buffer_sz) {
+    /*
+     * Build the internal levels of the tree over its leaf pages, returning
+     * the root. The first and last key of each leaf are appended to leaf_min
+     * and leaf_max as it is read.
+     */
+    static PageNum generate_internal_levels(PagedFile *pfile, PageNum last_leaf, size_t final_leaf_rec_cnt, char *out_buffer, size_t out_buffer_sz, std::vector<key_t> *leaf_min, std::vector<key_t> *leaf_max) {
         // FIXME: There're some funky edge cases here if the input_buffer_sz is larger
         // than the number of leaf pages
         size_t in_buffer_sz = 1;
@@ -548,7 +996,7 @@ private:
         // First, generate the first internal level
         PageNum pl_first_pg = BTREE_FIRST_LEAF_PNUM;
         size_t pl_final_rec_cnt = final_leaf_rec_cnt;
-        PageNum pl_pg_cnt = ISAMTree::generate_next_internal_level(pfile, &pl_final_rec_cnt, &pl_first_pg, true, out_buffer, out_buffer_sz, in_buffer, in_buffer_sz);
+        PageNum pl_pg_cnt = ISAMTree::generate_next_internal_level(pfile, &pl_final_rec_cnt, &pl_first_pg, last_leaf, true, out_buffer, out_buffer_sz, in_buffer, in_buffer_sz, leaf_min, leaf_max);
 
         assert(pl_pg_cnt != INVALID_PNUM);
 
@@ -560,7 +1008,7 @@ private:
 
         // Otherwise, we need to repeatedly create new levels until the page count returned
         // is 1.
-        while ((pl_pg_cnt = ISAMTree::generate_next_internal_level(pfile, &pl_final_rec_cnt, &pl_first_pg, false, out_buffer, out_buffer_sz, in_buffer, in_buffer_sz)) != 1) {
+        while ((pl_pg_cnt = ISAMTree::generate_next_internal_level(pfile, &pl_final_rec_cnt, &pl_first_pg, pfile->get_page_count(), false, out_buffer, out_buffer_sz, in_buffer, in_buffer_sz)) != 1) {
             assert(pl_pg_cnt != INVALID_PNUM);
         }
 
@@ -569,7 +1017,14 @@ private:
         return pl_first_pg + pl_pg_cnt - 1;
     }
 
-    static PageNum generate_next_internal_level(PagedFile *pfile, size_t *pl_final_pg_rec_cnt, PageNum *pl_first_pg, bool first_level, char *out_buffer, size_t out_buffer_sz, char *in_buffer, size_t in_buffer_sz) {
+    /*
+     * Create a new level of internal nodes over the pages in the range
+     * [*pl_first_pg, pl_last_pg], which must be the previous level of the
+     * tree. The new level is appended to the end of the file. For the first
+     * level, the fence keys of each leaf are appended to leaf_min and
+     * leaf_max, if provided.
+     */
+    static PageNum generate_next_internal_level(PagedFile *pfile, size_t *pl_final_pg_rec_cnt, PageNum *pl_first_pg, PageNum pl_last_pg, bool first_level, char *out_buffer, size_t out_buffer_sz, char *in_buffer, size_t in_buffer_sz, std::vector<key_t> *leaf_min=nullptr, std::vector<key_t> *leaf_max=nullptr) {
         
         // These variables names were getting very unwieldy. Here's a little glossary
         //      nl - new level (the level being created by this function)
@@ -587,8 +1042,7 @@ private:
         size_t pl_recs_per_pg = (first_level) ? PAGE_SIZE / sizeof(record_t) : int_recs_per_pg;
 
         PageNum in_pnum = *pl_first_pg;
-        PageNum pl_last_pg = pfile->get_page_count();
-        PageNum nl_first_pg = pl_last_pg + 1;
+        PageNum nl_first_pg = pfile->get_page_count() + 1;
         PageNum out_pnum = nl_first_pg;
 
         size_t pl_pgs_remaining = pl_last_pg - *pl_first_pg + 1;
@@ -623,6 +1077,11 @@ private:
                 key_t key = (first_level) ? ((record_t*)(get_page(in_buffer, in_pg_idx) + last_record * sizeof(record_t)))->key
                                                 : get_internal_record_key(get_page(in_buffer, in_pg_idx), last_record);
 
+                if (first_level && leaf_min && leaf_max) {
+                    leaf_min->push_back(((record_t*)get_page(in_buffer, in_pg_idx))->key);
+                    leaf_max->push_back(key);
+                }
+
                 // Increment the total number of children of this internal page
                 get_header(out_buffer, out_pg_idx)->leaf_rec_cnt += (first_level) ? pl_recs_per_pg : get_header(in_buffer, in_pg_idx)->leaf_rec_cnt;
                 total_records += (first_level) ? pl_recs_per_pg : get_header(in_buffer, in_pg_idx)->leaf_rec_cnt;
@@ -722,25 +1181,6 @@ private:
         return leaf_page_cnt;
     }
 
-    static PageNum write_final_buffer(size_t output_idx, PageNum cur_pnum, size_t *last_leaf_rec_cnt, PagedFile *pfile, char *buffer) {
-        size_t full_leaf_pages = (output_idx) / (PAGE_SIZE / sizeof(record_t));
-        *last_leaf_rec_cnt = (output_idx) % (PAGE_SIZE / sizeof(record_t));
-
-        if (full_leaf_pages == 0 && *last_leaf_rec_cnt == 0) {
-            return cur_pnum - 1;
-        }
-
-        if (pfile->write_pages(cur_pnum, full_leaf_pages + ((*last_leaf_rec_cnt == 0) ? 0 : 1), buffer)) {
-            if (full_leaf_pages == 0) {
-                return cur_pnum;
-            }
-
-            return cur_pnum + full_leaf_pages - (*last_leaf_rec_cnt == 0);
-        }
-
-        assert(false);
-    }
-
     static bool post_init(size_t record_count, size_t tombstone_count, PageNum last_leaf, PageNum root_pnum, char* buffer, PagedFile *pfile) {
         memset(buffer, 0, PAGE_SIZE);
 
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <atomic>
+#include <mutex>
 #include <numeric>
 #include <cstdio>
+#include <thread>
 
 #include "lsm/IsamTree.h"
 #include "lsm/MemTable.h"
@@ -11,6 +13,8 @@
 #include "ds/Alias.h"
 
 #include "util/timer.h"
+#include "util/WorkStealingPool.h"
+#include "util/BufferPool.h"
 
 namespace lsm {
 
@@ -36,15 +40,142 @@ thread_local size_t disklevel_sample_time = 0;
  * LSM Tree configuration global variables
  */
 
-// True for memtable rejection sampling
-static constexpr bool LSM_REJ_SAMPLE = true;
+// True for memtable rejection sampling, which weights the memtable by its
+// full record count and rejects records outside of the sample range. When
+// false, the memtable's sorted block index is used to find exactly the
+// records within the range.
+static constexpr bool LSM_REJ_SAMPLE = false;
 
 // True for leveling, false for tiering
 static constexpr bool LSM_LEVELING = false;
 static constexpr bool DELETE_TAGGING = true;
 
+// True to flush full memtables into the tree on a background thread,
+// false to perform the flush inline within append()
+static constexpr bool LSM_BACKGROUND_MERGE = true;
+
+// The number of shards each memtable is split into. Each appending thread
+// writes into its own shard, so this should be set to around the number of
+// concurrent writers.
+static constexpr size_t LSM_MEMTABLE_SHARDS = 1;
+
+// The number of threads in the pool shared by all trees for running the
+// independent level merges of a tiering merge cascade concurrently.
+static constexpr size_t LSM_COMPACTION_THREADS = 8;
+
+// When LSM_NUMA_AWARE, the number of sampling worker threads on each NUMA
+// node, and the smallest number of samples to be drawn from the runs on
+// another node that will be handed off to that node's workers, rather than
+// being drawn on the calling thread.
+static constexpr size_t LSM_NUMA_SAMPLING_THREADS = 4;
+static constexpr size_t LSM_NUMA_SAMPLE_MIN_BATCH = 256;
+
 typedef ssize_t level_index;
 
+/*
+ * The pool of sampling workers pinned to the specified NUMA node.
+ */
+inline WorkStealingPool &numa_sampling_pool(int node) {
+    static std::vector<std::unique_ptr<WorkStealingPool>> pools = [] {
+        std::vector<std::unique_ptr<WorkStealingPool>> pools;
+        for (size_t i=0; i<numa_node_count(); i++) {
+            pools.emplace_back(new WorkStealingPool(LSM_NUMA_SAMPLING_THREADS, [i](size_t) { numa_pin_thread(i); }));
+        }
+        return pools;
+    }();
+
+    return *pools[node];
+}
+
+/*
+ * The pool on which the level merges of every tree are run.
+ */
+inline WorkStealingPool &compaction_pool() {
+    static WorkStealingPool pool(LSM_COMPACTION_THREADS);
+    return pool;
+}
+
+// The RunId used for records drawn from a memtable that is being merged
+// into the tree. Records from the active memtable use INVALID_RID.
+const RunId MERGING_MEMTABLE_RID = {-1, 0};
+
+/*
+ * A snapshot of the structure of the tree. A new version is published each
+ * time a full memtable is swapped out and each time a merge completes.
+ * Readers pin the current version for the duration of an operation, and so
+ * never observe a merge in progress. Levels are reference counted, and
+ * those replaced by a merge are freed once the last version referencing
+ * them has been released. Memtables are pinned by each version that
+ * references them, and are not reused until all such versions are
+ * released.
+ */
+struct LevelVersion {
+    LevelVersion(const std::vector<std::shared_ptr<MemoryLevel>>& memory_levels,
+                 const std::vector<std::shared_ptr<DiskLevel>>& disk_levels,
+                 MemTable *memtable, MemTable *merging_memtable)
+    : memory_levels(memory_levels), disk_levels(disk_levels)
+    , memtable(memtable), merging_memtable(merging_memtable) {
+        memtable->pin();
+        if (merging_memtable) merging_memtable->pin();
+    }
+
+    ~LevelVersion() {
+        memtable->unpin();
+        if (merging_memtable) merging_memtable->unpin();
+    }
+
+    std::vector<std::shared_ptr<MemoryLevel>> memory_levels;
+    std::vector<std::shared_ptr<DiskLevel>> disk_levels;
+
+    // The memtable accepting appends, and the full memtable being merged
+    // into the levels, if any.
+    MemTable *memtable;
+    MemTable *merging_memtable;
+};
+
+/*
+ * The state required to draw samples from a range of a single version of
+ * the tree: the version itself, pinned for as long as the state is held,
+ * along with the sample ranges within each run and an alias structure over
+ * their lengths. Built by LSMTree::prepare_sample_state, and consumed by
+ * LSMTree::sample_pass.
+ */
+struct SampleState {
+    std::shared_ptr<LevelVersion> version;
+    key_t lower_key;
+    key_t upper_key;
+
+    std::vector<SampleRange> memory_ranges;
+    std::vector<SampleRange> disk_ranges;
+    std::vector<size_t> record_counts;
+
+    // The memtables as of when the state was built, along with the index of
+    // the last record that may be drawn from each.
+    MemTableSnapshot memtable_snapshot;
+    MemTableSnapshot merging_memtable_snapshot;
+    size_t memtable_cutoff = 0;
+    size_t merging_memtable_cutoff = 0;
+    MemTableRange memtable_range;
+    MemTableRange merging_memtable_range;
+
+    // The total number of records that may be drawn from the version for
+    // this range, including those that will be rejected.
+    size_t total_records = 0;
+
+    std::vector<double> weights;
+    std::unique_ptr<Alias> alias;
+    std::vector<size_t> run_samples;
+};
+
+/*
+ * A single query within a call to LSMTree::range_sample_batch.
+ */
+struct SampleQuery {
+    key_t lower_key;
+    key_t upper_key;
+    size_t sample_sz;
+};
+
 class LSMTree {
 public:
     LSMTree(std::string root_dir, size_t memtable_cap, size_t memtable_bf_sz, size_t scale_factor, size_t memory_levels,
@@ -55,10 +186,13 @@ public:
           root_directory(root_dir),
           last_level_idx(-1),
           memory_level_cnt(memory_levels),
-          memtable_1(new MemTable(memtable_cap, LSM_REJ_SAMPLE, memtable_bf_sz, rng)), 
-          memtable_2(new MemTable(memtable_cap, LSM_REJ_SAMPLE, memtable_bf_sz, rng)),
-          memtable_1_merging(false), memtable_2_merging(false) {
+          memtable_1(new MemTable(memtable_cap, LSM_REJ_SAMPLE, memtable_bf_sz, rng, LSM_MEMTABLE_SHARDS, DELETE_TAGGING)), 
+          memtable_2(new MemTable(memtable_cap, LSM_REJ_SAMPLE, memtable_bf_sz, rng, LSM_MEMTABLE_SHARDS, DELETE_TAGGING)),
+          memtable_1_merging(false), memtable_2_merging(false),
+          merge_rng(gsl_rng_alloc(gsl_rng_mt19937)) {
 
+        gsl_rng_set(merge_rng, gsl_rng_get(rng));
+        this->create_memory_level_pools();
         size_t run_cap =  (LSM_LEVELING) ? 1 : scale_factor;
 
         FILE *meta_f = fopen(meta_fname.c_str(), "r");
@@ -73,11 +207,12 @@ public:
             if (disk) {
                 this->disk_levels.emplace_back(new DiskLevel(idx, run_cap, root_directory, fbuf, rng));
             } else {
-                this->memory_levels.emplace_back(new MemoryLevel(idx, run_cap, root_directory, fbuf, DELETE_TAGGING, rng));
+                this->memory_levels.emplace_back(new MemoryLevel(idx, run_cap, root_directory, fbuf, DELETE_TAGGING, rng, this->memory_level_pools[idx]));
             }
             idx++;
         }
 
+        this->publish_version(nullptr);
     }
 
 
@@ -89,26 +224,38 @@ public:
           root_directory(root_dir),
           last_level_idx(-1),
           memory_level_cnt(memory_levels),
-          memtable_1(new MemTable(memtable_cap, LSM_REJ_SAMPLE, memtable_bf_sz, rng)), 
-          memtable_2(new MemTable(memtable_cap, LSM_REJ_SAMPLE, memtable_bf_sz, rng)),
-          memtable_1_merging(false), memtable_2_merging(false) {}
+          memtable_1(new MemTable(memtable_cap, LSM_REJ_SAMPLE, memtable_bf_sz, rng, LSM_MEMTABLE_SHARDS, DELETE_TAGGING)), 
+          memtable_2(new MemTable(memtable_cap, LSM_REJ_SAMPLE, memtable_bf_sz, rng, LSM_MEMTABLE_SHARDS, DELETE_TAGGING)),
+          memtable_1_merging(false), memtable_2_merging(false),
+          merge_rng(gsl_rng_alloc(gsl_rng_mt19937)) {
+        gsl_rng_set(merge_rng, gsl_rng_get(rng));
+        this->create_memory_level_pools();
+        this->publish_version(nullptr);
+    }
 
     ~LSMTree() {
-        delete this->memtable_1;
-        delete this->memtable_2;
+        this->await_merge();
+        gsl_rng_free(this->merge_rng);
 
-        for (size_t i=0; i<this->memory_levels.size(); i++) {
-            delete this->memory_levels[i];
-        }
+        // Release the levels before the memtables, as the current
+        // version holds pins on the latter.
+        std::atomic_store(&this->version, std::shared_ptr<LevelVersion>());
+        this->memory_levels.clear();
+        this->disk_levels.clear();
 
-        for (size_t i=0; i<this->disk_levels.size(); i++) {
-            delete this->disk_levels[i];
-        }
+        delete this->memtable_1;
+        delete this->memtable_2;
     }
 
    int delete_record(const key_t& key, const value_t& val, gsl_rng *rng) {
         assert(DELETE_TAGGING);
 
+        // The background merge copies records out of the levels, and the
+        // memtable it was given, so a tag applied mid-merge could be lost.
+        // Holding the levels also keeps another writer from handing the
+        // memtable off to a new merge while it is being tagged.
+        auto lock = this->hold_levels();
+
         auto mtable = this->memtable();
         // Check the levels first. This assumes there aren't 
         // any undeleted duplicate records.
@@ -124,58 +271,204 @@ public:
         return mtable->delete_record(key, val);
     }
 
+    /*
+     * Append a record to the tree. Safe to call from multiple threads
+     * concurrently: records are appended to the active memtable without
+     * locking, and only the swap of a full memtable and the scheduling of
+     * its merge are serialized, by merge_lock. Returns 0 if the record is
+     * a tombstone and the memtable's tombstone capacity has been reached.
+     */
     int append(const key_t& key, const value_t& val, bool tombstone, gsl_rng *rng) {
-        // NOTE: single-threaded implementation only
-        MemTable *mtable;
-        while (!(mtable = this->memtable()))
-            ;
-        
-        if (mtable->is_full()) {
-            this->merge_memtable(rng);
+        while (true) {
+            MemTable *mtable;
+            while (!(mtable = this->memtable()))
+                ;
+
+            if (mtable->is_full()) {
+                std::unique_lock<std::mutex> lock(this->merge_lock);
+
+                // Another writer may have already swapped it out.
+                if (this->memtable() == mtable && mtable->is_full()) {
+                    this->schedule_merge();
+                    if (!LSM_BACKGROUND_MERGE) {
+                        this->join_merge();
+                    }
+                }
+
+                continue;
+            }
+
+            if (mtable->append(key, val, tombstone)) {
+                return 1;
+            }
+
+            // The memtable may have filled up since it was checked, in
+            // which case the record goes into the next one.
+            if (!mtable->is_full()) {
+                return 0;
+            }
         }
+    }
 
-        return mtable->append(key, val, tombstone);
+    /*
+     * Block until any in-progress background memtable merge has been
+     * completed. Concurrent writers may start another merge as soon as
+     * this returns, so it does not by itself keep the levels still.
+     */
+    void await_merge() {
+        std::unique_lock<std::mutex> lock(this->merge_lock);
+        this->join_merge();
     }
 
     void range_sample(record_t *sample_set, const key_t& lower_key, const key_t& upper_key, size_t sample_sz, char *buffer, char *utility_buffer, gsl_rng *rng) {
-        TIMER_INIT();
-
         // Allocate buffer into which to write the samples
         size_t sample_idx = 0;
 
-        // Obtain the sampling ranges for each level
-        std::vector<SampleRange> memory_ranges;
-        std::vector<SampleRange> disk_ranges;
-        std::vector<size_t> record_counts;
+        SampleState state;
+        this->prepare_sample_state(state, lower_key, upper_key, buffer);
 
-        MemTable *memtable = nullptr;
+        if (state.total_records == 0) return;
 
-        while (!memtable) {
-            memtable = this->memtable();
+        // For implementation convenience, we'll treat the very
+        // first sampling pass as though it were a sampling
+        // pass following one in which every single sample
+        // was rejected
+        size_t rejections = sample_sz;
+        sampling_attempts = 0;
+        sampling_rejections = 0;
+        tombstone_rejections = 0;
+        bounds_rejections = 0;
+        deletion_rejections = 0;
+
+        do {
+            rejections = this->sample_pass(state, rejections, sample_set, sample_idx, buffer, utility_buffer, rng);
+        } while (sample_idx < sample_sz);
+    }
+
+    /*
+     * Pin the current version of the tree and prepare state for drawing
+     * samples from it within the range [lower_key, upper_key]. The version
+     * remains pinned, so that the levels and memtables being sampled are not
+     * freed or reused by a concurrent merge, until the state is destroyed.
+     *
+     * Once this returns, state.total_records holds the number of records
+     * from which each attempt in sample_pass is drawn. If it is 0, no
+     * samples can be drawn.
+     */
+    void prepare_sample_state(SampleState &state, const key_t& lower_key, const key_t& upper_key, char *buffer) {
+        state.version = this->pin_version();
+        this->build_sample_state(state, lower_key, upper_key, buffer, nullptr);
+    }
+
+    /*
+     * Draw samples for each of a batch of query_cnt queries, writing
+     * queries[i].sample_sz records into results[i]. Produces the same
+     * distribution of results as calling range_sample for each query, but
+     * all of the queries are answered from a single pinned version of the
+     * tree, and the state used for sampling is reused between them.
+     *
+     * The queries are processed in increasing order of lower_key, so that
+     * the bound searches on each in-memory run can gallop forward from where
+     * those of the previous query ended, rather than descending the run's
+     * index each time. This is most effective for large batches of narrow
+     * queries.
+     */
+    void range_sample_batch(const SampleQuery *queries, record_t **results, size_t query_cnt, char *buffer, char *utility_buffer, gsl_rng *rng) {
+        std::vector<size_t> order(query_cnt);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return queries[a].lower_key < queries[b].lower_key;
+        });
+
+        SampleState state;
+        state.version = this->pin_version();
+
+        size_t memory_run_cnt = 0;
+        for (auto &level : state.version->memory_levels) {
+            if (level) memory_run_cnt += level->get_run_count();
+        }
+        std::vector<size_t> hints(memory_run_cnt, 0);
+
+        sampling_attempts = 0;
+        sampling_rejections = 0;
+        tombstone_rejections = 0;
+        bounds_rejections = 0;
+        deletion_rejections = 0;
+
+        for (size_t q : order) {
+            this->build_sample_state(state, queries[q].lower_key, queries[q].upper_key, buffer, hints.data());
+
+            if (state.total_records == 0) continue;
+
+            size_t sample_idx = 0;
+            size_t rejections = queries[q].sample_sz;
+            do {
+                rejections = this->sample_pass(state, rejections, results[q], sample_idx, buffer, utility_buffer, rng);
+            } while (sample_idx < queries[q].sample_sz);
         }
+    }
 
+    /*
+     * Build the sample ranges and alias structure of state for the range
+     * [lower_key, upper_key] of the already pinned state.version. Any
+     * existing contents of state are replaced, but its allocations are
+     * reused. If memory_hints is not null, it must hold a galloping search
+     * hint for each run of the memory levels, in order (see
+     * MemoryLevel::get_sample_ranges), which will be updated.
+     */
+    void build_sample_state(SampleState &state, const key_t& lower_key, const key_t& upper_key, char *buffer, size_t *memory_hints) {
+        TIMER_INIT();
+
+        state.lower_key = lower_key;
+        state.upper_key = upper_key;
+        state.memory_ranges.clear();
+        state.disk_ranges.clear();
+        state.record_counts.clear();
+
+        MemTable *memtable = state.version->memtable;
+        MemTable *merging_memtable = state.version->merging_memtable;
+
+        // Obtain the sampling ranges for each level
         TIMER_START();
 
-        size_t memtable_cutoff;
-        std::vector<const record_t*> memtable_records;
+        auto &record_counts = state.record_counts;
+        memtable->get_snapshot(state.memtable_snapshot);
+        if (merging_memtable) {
+            merging_memtable->get_snapshot(state.merging_memtable_snapshot);
+        }
+
         if (LSM_REJ_SAMPLE) {
-            memtable_cutoff = memtable->get_record_count() - 1;
-            record_counts.push_back(memtable_cutoff + 1);
+            state.memtable_cutoff = state.memtable_snapshot.get_record_count() - 1;
+            record_counts.push_back(state.memtable_cutoff + 1);
+            if (merging_memtable) {
+                state.merging_memtable_cutoff = state.merging_memtable_snapshot.get_record_count() - 1;
+                record_counts.push_back(state.merging_memtable_cutoff + 1);
+            }
         } else {
-            memtable->create_sampling_vector(lower_key, upper_key, memtable_records);
-            memtable_cutoff = memtable_records.size() - 1;
-            record_counts.push_back(memtable_cutoff + 1);
+            memtable->get_range(lower_key, upper_key, state.memtable_range, &state.memtable_snapshot);
+            state.memtable_cutoff = state.memtable_range.get_record_count() - 1;
+            record_counts.push_back(state.memtable_cutoff + 1);
+            if (merging_memtable) {
+                merging_memtable->get_range(lower_key, upper_key, state.merging_memtable_range, &state.merging_memtable_snapshot);
+                state.merging_memtable_cutoff = state.merging_memtable_range.get_record_count() - 1;
+                record_counts.push_back(state.merging_memtable_cutoff + 1);
+            }
         }
 
-        for (auto &level : this->memory_levels) {
+        for (auto &level : state.version->memory_levels) {
             if (level) {
-                level->get_sample_ranges(memory_ranges, record_counts, lower_key, upper_key);
+                if (memory_hints) {
+                    level->get_sample_ranges(state.memory_ranges, record_counts, lower_key, upper_key, memory_hints);
+                    memory_hints += level->get_run_count();
+                } else {
+                    level->get_sample_ranges(state.memory_ranges, record_counts, lower_key, upper_key);
+                }
             }
         }
 
-        for (auto &level : this->disk_levels) {
+        for (auto &level : state.version->disk_levels) {
             if (level) {
-                level->get_sample_ranges(disk_ranges, record_counts, lower_key, upper_key, buffer);
+                level->get_sample_ranges(state.disk_ranges, record_counts, lower_key, upper_key, buffer);
             }
         }
 
@@ -183,143 +476,279 @@ public:
         sample_range_time += TIMER_RESULT();
 
         TIMER_START();
-        size_t total_records = std::accumulate(record_counts.begin(), record_counts.end(), 0);
+        state.total_records = std::accumulate(record_counts.begin(), record_counts.end(), (size_t) 0);
 
-        if (total_records == 0) return;
+        if (state.total_records == 0) return;
 
-        std::vector<double> weights(record_counts.size());
+        auto &weights = state.weights;
+        weights.resize(record_counts.size());
         for (size_t i=0; i < record_counts.size(); i++) {
-            weights[i] = (double) record_counts[i] / (double) total_records;
+            weights[i] = (double) record_counts[i] / (double) state.total_records;
         }
 
-        auto alias = Alias(weights);
+        if (state.alias) {
+            state.alias->build(weights);
+        } else {
+            state.alias.reset(new Alias(weights));
+        }
+        state.run_samples.assign(record_counts.size(), 0);
 
         TIMER_STOP();
         alias_time += TIMER_RESULT();
+    }
 
-        // For implementation convenience, we'll treat the very
-        // first sampling pass as though it were a sampling
-        // pass following one in which every single sample
-        // was rejected
-        size_t rejections = sample_sz;
-        sampling_attempts = 0;
-        sampling_rejections = 0;
-        tombstone_rejections = 0;
-        bounds_rejections = 0;
-        deletion_rejections = 0;
+    /*
+     * Make the specified number of sampling attempts against a prepared
+     * state, each of which draws a record uniformly from among the
+     * state.total_records candidates. Those that are not rejected are written
+     * into sample_set starting at sample_idx, which is advanced past them.
+     * Returns the number of attempts that were rejected.
+     */
+    size_t sample_pass(SampleState &state, size_t attempts, record_t *sample_set, size_t &sample_idx, char *buffer, char *utility_buffer, gsl_rng *rng) {
+        TIMER_INIT();
 
-        std::vector<size_t> run_samples(record_counts.size(), 0);
+        auto &run_samples = state.run_samples;
+        LevelVersion *version = state.version.get();
+        MemTable *memtable = version->memtable;
+        MemTable *merging_memtable = version->merging_memtable;
+        const key_t &lower_key = state.lower_key;
+        const key_t &upper_key = state.upper_key;
+        size_t memtable_cutoff = state.memtable_cutoff;
+
+        // This *should* be fully reset to 0 at the end of each pass.
+        for (size_t i=0; i<run_samples.size(); i++) {
+            assert(run_samples[i] == 0);
+        }
 
-        do {
-            // This *should* be fully reset to 0 at the end of each loop
-            // iteration.
-            for (size_t i=0; i<run_samples.size(); i++) {
-                assert(run_samples[i] == 0);
-            }
+        // pre-calculate the random numbers. If a sample rejects,
+        // we'll track that and redo the rejections in bulk, until
+        // there are no further rejections.
+        TIMER_START();
+        for (size_t i=0; i<attempts; i++) {
+            run_samples[state.alias->get(rng)] += 1;
+        }
+        TIMER_STOP();
+        alias_query_time += TIMER_RESULT();
+
+        size_t rejections = 0;
+        const record_t *sample_record;
 
-            // pre-calculate the random numbers. If a sample rejects,
-            // we'll track that and redo the rejections in bulk, until
-            // there are no further rejections.
+        // We will draw the records from the runs in order
+
+        // First the memtable,
+        while (run_samples[0] > 0) {
             TIMER_START();
-            for (size_t i=0; i<rejections; i++) {
-                run_samples[alias.get(rng)] += 1;
-            }
+            size_t idx = get_random(rng, memtable_cutoff + 1);
+            sample_record = (LSM_REJ_SAMPLE) ? memtable->get_record_at(idx, &state.memtable_snapshot) : memtable->get_range_record(state.memtable_range, idx);
             TIMER_STOP();
-            alias_query_time += TIMER_RESULT();
+            memtable_sample_time += TIMER_RESULT();
 
-            // reset rejection counter to begin tracking for next
-            // sampling pass
-            rejections = 0;
-            const record_t *sample_record;
+            run_samples[0]--;
 
-            // We will draw the records from the runs in order
+            if (!add_to_sample(sample_record, INVALID_RID, upper_key, lower_key, utility_buffer, sample_set, sample_idx, state)) {
+                rejections++;
+            }
+        }
 
-            // First the memtable,
-            while (run_samples[0] > 0) {
+        // then the memtable being merged, if there is one,
+        size_t run_offset = 1; // skip the memtable
+        if (merging_memtable) {
+            while (run_samples[run_offset] > 0) {
                 TIMER_START();
-                size_t idx = get_random(rng, memtable_cutoff);
-                sample_record = (LSM_REJ_SAMPLE) ? memtable->get_record_at(idx) : memtable_records[idx];
+                size_t idx = get_random(rng, state.merging_memtable_cutoff + 1);
+                sample_record = (LSM_REJ_SAMPLE) ? merging_memtable->get_record_at(idx, &state.merging_memtable_snapshot) : merging_memtable->get_range_record(state.merging_memtable_range, idx);
                 TIMER_STOP();
                 memtable_sample_time += TIMER_RESULT();
 
-                run_samples[0]--;
+                run_samples[run_offset]--;
 
-                if (!add_to_sample(sample_record, INVALID_RID, upper_key, lower_key, utility_buffer, sample_set, sample_idx, memtable, memtable_cutoff)) {
+                if (!add_to_sample(sample_record, MERGING_MEMTABLE_RID, upper_key, lower_key, utility_buffer, sample_set, sample_idx, state)) {
                     rejections++;
                 }
             }
+            run_offset++;
+        }
 
 
-            // Next the in-memory runs
-            // QUESTION: can we assume that the memory page size is a multiple of the record length?
-            // If so, we can do this. Otherwise, we'll need to do a double roll to get a leaf page
-            // first, or use an interface like I have for the ISAM tree for getting a record based
-            // on an index offset and a starting page.
-            size_t run_offset = 1; // skip the memtable
-            for (size_t i=0; i<memory_ranges.size(); i++) {
-                size_t range_length = memory_ranges[i].high - memory_ranges[i].low;
-                auto run_id = memory_ranges[i].run_id;
-                while (run_samples[i+run_offset] > 0) {
-                    TIMER_START();
-                    size_t idx = get_random(rng, range_length);
-                    sample_record = memory_levels[run_id.level_idx]->get_record_at(run_id.run_idx, idx + memory_ranges[i].low);
-                    run_samples[i+run_offset]--;
-                    TIMER_STOP();
-                    memlevel_sample_time += TIMER_RESULT();
-
-                    if (!add_to_sample(sample_record, memory_ranges[i].run_id, upper_key, lower_key, utility_buffer, sample_set, sample_idx, memtable, memtable_cutoff)) {
-                        rejections++;
-                    }
+        // Next the in-memory runs
+        // QUESTION: can we assume that the memory page size is a multiple of the record length?
+        // If so, we can do this. Otherwise, we'll need to do a double roll to get a leaf page
+        // first, or use an interface like I have for the ISAM tree for getting a record based
+        // on an index offset and a starting page.
+        auto &memory_ranges = state.memory_ranges;
+        size_t memtable_offset = run_offset;
+        if (LSM_NUMA_AWARE && numa_node_count() > 1) {
+            rejections += this->sample_remote_memory_ranges(state, run_offset, sample_set, sample_idx, rng);
+        }
+
+        for (size_t i=0; i<memory_ranges.size(); i++) {
+            size_t range_length = memory_ranges[i].high - memory_ranges[i].low;
+            auto run_id = memory_ranges[i].run_id;
+            while (run_samples[i+run_offset] > 0) {
+                TIMER_START();
+                size_t idx = get_random(rng, range_length);
+                record_t rec = version->memory_levels[run_id.level_idx]->get_record_at(run_id.run_idx, idx + memory_ranges[i].low);
+                run_samples[i+run_offset]--;
+                TIMER_STOP();
+                memlevel_sample_time += TIMER_RESULT();
+
+                if (!add_to_sample(&rec, memory_ranges[i].run_id, upper_key, lower_key, utility_buffer, sample_set, sample_idx, state)) {
+                    rejections++;
                 }
+            }
+
+        }
+
+        // Finally, the ISAM Trees
+        // NOTE: this setup is not leveraging rolling all the pages first,
+        // and then batching the IO operations so that each duplicate page
+        // is sampled multiple times in a row. This could be done at the
+        // cost of space, by tracking each page and the number of times it
+        // is sampled, or at the cost of time, by sorting. In either case,
+        // we'd need to double the number of random numbers rolled--as we'd
+        // need to roll the pages, and then the record index within each
+        // page
+        auto &disk_ranges = state.disk_ranges;
+        run_offset = memtable_offset + memory_ranges.size(); // Skip the memtables and the memory levels
+        size_t records_per_page = PAGE_SIZE / sizeof(record_t);
+        PageNum buffered_page = INVALID_PNUM;
+        for (size_t i=0; i<disk_ranges.size(); i++) {
+            size_t range_length = (disk_ranges[i].high - disk_ranges[i].low + 1) * records_per_page;
+            size_t level_idx = disk_ranges[i].run_id.level_idx - this->memory_level_cnt;
+            size_t run_idx = disk_ranges[i].run_id.run_idx;
+
+            while (run_samples[i+run_offset] > 0) {
+                TIMER_START();
+                size_t idx = get_random(rng, range_length);
+                sample_record = version->disk_levels[level_idx]->get_run(run_idx)->sample_record(disk_ranges[i].low, idx, buffer, buffered_page);
+                run_samples[i+run_offset]--;
+                TIMER_STOP();
+                disklevel_sample_time += TIMER_RESULT();
+
+                if (!add_to_sample(sample_record, disk_ranges[i].run_id, upper_key, lower_key, utility_buffer, sample_set, sample_idx, state)) {
+                    rejections++;
+                }
+            }
+        }
+
+        return rejections;
+    }
 
+    /*
+     * Draw the samples assigned to in-memory runs placed on other NUMA nodes
+     * than the calling thread, on sampling workers local to those nodes.
+     * The samples for any node with too few of them to be worth handing off
+     * are left in state.run_samples, to be drawn locally. Returns the number
+     * of rejected attempts. Attempts made by the workers are not counted in
+     * the calling thread's sampling statistics.
+     */
+    size_t sample_remote_memory_ranges(SampleState &state, size_t run_offset, record_t *sample_set, size_t &sample_idx, gsl_rng *rng) {
+        auto &run_samples = state.run_samples;
+        auto &memory_ranges = state.memory_ranges;
+        LevelVersion *version = state.version.get();
+
+        size_t node_cnt = numa_node_count();
+        int local_node = numa_current_node();
+
+        std::vector<std::vector<std::pair<size_t, size_t>>> node_work(node_cnt);
+        std::vector<size_t> node_samples(node_cnt, 0);
+        for (size_t i=0; i<memory_ranges.size(); i++) {
+            auto run_id = memory_ranges[i].run_id;
+            int node = version->memory_levels[run_id.level_idx]->get_run(run_id.run_idx)->get_numa_node();
+            if (node == NUMA_NO_NODE || node == local_node || run_samples[i+run_offset] == 0) {
+                continue;
             }
 
-            // Finally, the ISAM Trees
-            // NOTE: this setup is not leveraging rolling all the pages first,
-            // and then batching the IO operations so that each duplicate page
-            // is sampled multiple times in a row. This could be done at the
-            // cost of space, by tracking each page and the number of times it
-            // is sampled, or at the cost of time, by sorting. In either case,
-            // we'd need to double the number of random numbers rolled--as we'd
-            // need to roll the pages, and then the record index within each
-            // page
-            run_offset = 1 + memory_ranges.size(); // Skip the memtable and the memory levels
-            size_t records_per_page = PAGE_SIZE / sizeof(record_t);
-            PageNum buffered_page = INVALID_PNUM;
-            for (size_t i=0; i<disk_ranges.size(); i++) {
-                size_t range_length = (disk_ranges[i].high - disk_ranges[i].low + 1) * records_per_page;
-                size_t level_idx = disk_ranges[i].run_id.level_idx - this->memory_level_cnt;
-                size_t run_idx = disk_ranges[i].run_id.run_idx;
-
-                while (run_samples[i+run_offset] > 0) {
-                    TIMER_START();
-                    size_t idx = get_random(rng, range_length);
-                    sample_record = this->disk_levels[level_idx]->get_run(run_idx)->sample_record(disk_ranges[i].low, idx, buffer, buffered_page);
-                    run_samples[i+run_offset]--;
-                    TIMER_STOP();
-                    disklevel_sample_time += TIMER_RESULT();
-
-                    if (!add_to_sample(sample_record, disk_ranges[i].run_id, upper_key, lower_key, utility_buffer, sample_set, sample_idx, memtable, memtable_cutoff)) {
-                        rejections++;
+            node_work[node].push_back({i, run_samples[i+run_offset]});
+            node_samples[node] += run_samples[i+run_offset];
+        }
+
+        struct NodeResult {
+            std::vector<record_t> samples;
+            size_t sample_cnt = 0;
+            size_t rejections = 0;
+        };
+
+        std::vector<NodeResult> node_results(node_cnt);
+        std::vector<std::future<void>> results;
+        for (size_t node=0; node<node_cnt; node++) {
+            if (node_samples[node] < LSM_NUMA_SAMPLE_MIN_BATCH) continue;
+
+            for (auto &work : node_work[node]) {
+                run_samples[work.first + run_offset] = 0;
+            }
+
+            auto &result = node_results[node];
+            result.samples.resize(node_samples[node]);
+            unsigned long seed = gsl_rng_get(rng);
+
+            results.emplace_back(numa_sampling_pool(node).submit([this, &state, &result, &work = node_work[node], seed] {
+                auto worker_rng = gsl_rng_alloc(gsl_rng_mt19937);
+                gsl_rng_set(worker_rng, seed);
+                char *io_buffer = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+
+                for (auto &w : work) {
+                    auto &range = state.memory_ranges[w.first];
+                    auto level = state.version->memory_levels[range.run_id.level_idx].get();
+                    for (size_t j=0; j<w.second; j++) {
+                        size_t idx = get_random(worker_rng, range.high - range.low);
+                        auto rec = level->get_record_at(range.run_id.run_idx, idx + range.low);
+                        if (!add_to_sample(&rec, range.run_id, state.upper_key, state.lower_key, io_buffer, result.samples.data(),
+                                           result.sample_cnt, state)) {
+                            result.rejections++;
+                        }
                     }
                 }
+
+                free(io_buffer);
+                gsl_rng_free(worker_rng);
+            }));
+        }
+
+        for (auto &r : results) {
+            r.get();
+        }
+
+        size_t rejections = 0;
+        for (auto &result : node_results) {
+            for (size_t j=0; j<result.sample_cnt; j++) {
+                sample_set[sample_idx++] = result.samples[j];
             }
-        } while (sample_idx < sample_sz);
+            rejections += result.rejections;
+        }
+
+        return rejections;
     }
 
-    // Checks the tree and memtable for a tombstone corresponding to
+    // Checks the tree and memtables for a tombstone corresponding to
     // the provided record in any run *above* the rid, which
     // should correspond to the run containing the record in question
     // 
-    // Passing INVALID_RID indicates that the record exists within the MemTable
-    bool is_deleted(const record_t* record, const RunId &rid, char *buffer, MemTable *memtable, size_t memtable_cutoff) {
+    // Passing INVALID_RID indicates that the record exists within the
+    // active MemTable, and MERGING_MEMTABLE_RID that it exists within the
+    // MemTable being merged.
+    //
+    // The memtables are read as of the snapshots in state, so that records
+    // appended or deleted after the sample began do not affect it.
+    bool is_deleted(const record_t* record, const RunId &rid, char *buffer, const SampleState &state) {
+        LevelVersion *version = state.version.get();
+
         // If tagging is in use, check the delete status of the record directly.
-        if (DELETE_TAGGING && record->get_delete_status()) {
-            return true;
+        if (DELETE_TAGGING) {
+            bool deleted;
+            if (rid == INVALID_RID) {
+                deleted = version->memtable->is_deleted(record, &state.memtable_snapshot);
+            } else if (rid == MERGING_MEMTABLE_RID) {
+                deleted = version->merging_memtable->is_deleted(record, &state.merging_memtable_snapshot);
+            } else {
+                deleted = record->get_delete_status();
+            }
+
+            if (deleted) return true;
         }
 
-        // check for tombstone in the memtable. This will require accounting for the cutoff eventually.
-        if (memtable->check_tombstone(record->key, record->value)) {
+        // check for tombstone in the memtable.
+        if (version->memtable->check_tombstone(record->key, record->value, &state.memtable_snapshot)) {
             return true;
         }
 
@@ -328,6 +757,18 @@ public:
             return false;
         }
 
+        // The memtable being merged is newer than all of the levels.
+        if (version->merging_memtable && version->merging_memtable->check_tombstone(record->key, record->value, &state.merging_memtable_snapshot)) {
+            return true;
+        }
+
+        if (rid == MERGING_MEMTABLE_RID) {
+            return false;
+        }
+
+        auto &memory_levels = version->memory_levels;
+        auto &disk_levels = version->disk_levels;
+
         for (size_t lvl=0; lvl<rid.level_idx; lvl++) {
             if (lvl < memory_levels.size()) {
                 if (memory_levels[lvl]->tombstone_check(0, record->key, record->value)) {
@@ -353,7 +794,8 @@ public:
 
 
     size_t get_record_cnt() {
-        // FIXME: need to account for both memtables with concurrency
+        auto lock = this->hold_levels();
+
         size_t cnt = this->memtable()->get_record_count();
 
         for (size_t i=0; i<this->memory_levels.size(); i++) {
@@ -369,7 +811,8 @@ public:
 
 
     size_t get_tombstone_cnt() {
-        // FIXME: need to account for both memtables with concurrency
+        auto lock = this->hold_levels();
+
         size_t cnt = this->memtable()->get_tombstone_count();
 
         for (size_t i=0; i<this->memory_levels.size(); i++) {
@@ -384,10 +827,14 @@ public:
     }
 
     size_t get_height() {
+        auto lock = this->hold_levels();
+
         return this->memory_levels.size() + this->disk_levels.size();
     }
 
     size_t get_memory_utilization() {
+        auto lock = this->hold_levels();
+
         size_t cnt = this->memtable_1->get_memory_utilization() + this->memtable_2->get_memory_utilization();
 
         for (size_t i=0; i<this->memory_levels.size(); i++) {
@@ -398,6 +845,8 @@ public:
     }
 
     size_t get_aux_memory_utilization() {
+        auto lock = this->hold_levels();
+
         size_t cnt = this->memtable_1->get_aux_memory_utilization() + this->memtable_2->get_aux_memory_utilization();
 
         for (size_t i=0; i<this->memory_levels.size(); i++) {
@@ -471,6 +920,8 @@ public:
      * performance comparisons.
      */
     ISAMTree *get_flat_isam_tree(gsl_rng *rng) {
+        auto lock = this->hold_levels();
+
         auto mem_level = new MemoryLevel(-1, 1, this->root_directory, DELETE_TAGGING);
         mem_level->append_mem_table(this->memtable(), rng);
 
@@ -508,6 +959,8 @@ public:
 
 
     bool validate_tombstone_proportion() {
+        auto lock = this->hold_levels();
+
         long double ts_prop;
         for (size_t i=0; i<this->memory_levels.size(); i++) {
             if (this->memory_levels[i]) {
@@ -539,10 +992,12 @@ public:
         assert(meta_f);
 
         // merge the memtable down to ensure it is persisted
-        this->merge_memtable(rng);
+        auto lock = this->hold_levels();
+        this->schedule_merge();
+        this->join_merge();
         
         // persist each level of the tree
-        for (size_t i=0; i<this->get_height(); i++) {
+        for (size_t i=0; i<this->memory_levels.size() + this->disk_levels.size(); i++) {
             bool disk = false;
 
             auto level_idx = this->decode_level_index(i, &disk);
@@ -565,12 +1020,35 @@ private:
     std::atomic<bool> memtable_1_merging;
     std::atomic<bool> memtable_2_merging;
 
+    // The thread running the in-progress background memtable merge, if
+    // any, and the rng it uses, as gsl_rngs cannot be shared across threads.
+    std::thread merge_thread;
+    gsl_rng *merge_rng;
+
+    // Serializes the swapping of a full memtable and the scheduling, and
+    // joining, of merge_thread among concurrent writers.
+    std::mutex merge_lock;
+
     size_t scale_factor;
     double max_tombstone_prop;
 
-    std::vector<MemoryLevel *> memory_levels;
+    // The levels of the tree. These are modified only by merges, and are
+    // only accessed directly by the thread performing the merge, or by one
+    // holding them still with hold_levels(). All other access goes through
+    // a pinned version.
+    std::vector<std::shared_ptr<MemoryLevel>> memory_levels;
     size_t memory_level_cnt;
-    std::vector<DiskLevel *> disk_levels;
+    std::vector<std::shared_ptr<DiskLevel>> disk_levels;
+
+    // One buffer pool for each memory level, shared by every version of
+    // that level, so that the buffers of the runs merged out of a level are
+    // reused by the runs next merged into it, rather than being unmapped
+    // and mapped again.
+    std::vector<std::shared_ptr<BufferPool>> memory_level_pools;
+
+    // The most recently published version of the tree. Must be accessed
+    // using std::atomic_load/std::atomic_store.
+    std::shared_ptr<LevelVersion> version;
 
     level_index last_level_idx;
 
@@ -580,6 +1058,25 @@ private:
 
 
 
+    /*
+     * Returns the current version of the tree. The levels and memtables
+     * it references will remain valid for as long as the returned pointer
+     * (or a copy of it) is held.
+     */
+    std::shared_ptr<LevelVersion> pin_version() {
+        return std::atomic_load(&this->version);
+    }
+
+    /*
+     * Publish the current state of the levels and active memtable as the
+     * new version of the tree. Versions are published only by the writer
+     * while no merge is in progress, or by the merge thread itself, so there
+     * is never more than one publisher at a time.
+     */
+    inline void publish_version(MemTable *merging_memtable) {
+        std::atomic_store(&this->version, std::make_shared<LevelVersion>(this->memory_levels, this->disk_levels, this->memtable(), merging_memtable));
+    }
+
     MemTable *memtable() {
         if (memtable_1_merging && memtable_2_merging) {
             return nullptr;
@@ -588,14 +1085,14 @@ private:
         return (active_memtable) ? memtable_2 : memtable_1;
     }
 
-    inline bool rejection(const record_t *record, RunId rid, const key_t& lower_bound, const key_t& upper_bound, char *buffer, MemTable *memtable, size_t memtable_cutoff) {
+    inline bool rejection(const record_t *record, RunId rid, const key_t& lower_bound, const key_t& upper_bound, char *buffer, const SampleState &state) {
         if (record->is_tombstone()) {
             tombstone_rejections++;
             return true;
         } else if (record->key < lower_bound || record->key > upper_bound) {
             bounds_rejections++;
             return true;
-        } else if (this->is_deleted(record, rid, buffer, memtable, memtable_cutoff)) {
+        } else if (this->is_deleted(record, rid, buffer, state)) {
             deletion_rejections++;
             return true;
         }
@@ -608,11 +1105,11 @@ private:
     }
 
     inline bool add_to_sample(const record_t *record, RunId rid, const key_t& upper_key, const key_t& lower_key, char *io_buffer,
-                              record_t *sample_buffer, size_t &sample_idx, MemTable *memtable, size_t memtable_cutoff) {
+                              record_t *sample_buffer, size_t &sample_idx, const SampleState &state) {
         TIMER_INIT();
         TIMER_START();
         sampling_attempts++;
-        if (!record || rejection(record, rid, lower_key, upper_key, io_buffer, memtable, memtable_cutoff)) {
+        if (!record || rejection(record, rid, lower_key, upper_key, io_buffer, state)) {
             sampling_rejections++;
             return false;
         }
@@ -623,6 +1120,12 @@ private:
         return true;
     }
 
+    void create_memory_level_pools() {
+        for (size_t i=0; i<this->memory_level_cnt; i++) {
+            this->memory_level_pools.emplace_back(std::make_shared<BufferPool>());
+        }
+    }
+
     /*
      * Add a new level to the LSM Tree and return that level's index. Will
      * automatically determine whether the level should be on memory or on disk,
@@ -637,13 +1140,14 @@ private:
             if (new_idx > 0) {
                 assert(this->memory_levels[new_idx - 1]->get_run(0)->get_tombstone_count() == 0);
             }
-            this->memory_levels.emplace_back(new MemoryLevel(new_idx, new_run_cnt, this->root_directory, DELETE_TAGGING));
+            this->memory_levels.emplace_back(std::make_shared<MemoryLevel>(new_idx, new_run_cnt, this->root_directory, DELETE_TAGGING,
+                                                                           this->memory_level_pools[new_idx]));
         } else {
             new_idx = this->disk_levels.size() + this->memory_levels.size();
             if (this->disk_levels.size() > 0) {
                 assert(this->disk_levels[this->disk_levels.size() - 1]->get_run(0)->get_tombstone_count() == 0);
             }
-            this->disk_levels.emplace_back(new DiskLevel(new_idx, new_run_cnt, this->root_directory));
+            this->disk_levels.emplace_back(std::make_shared<DiskLevel>(new_idx, new_run_cnt, this->root_directory));
         } 
 
         this->last_level_idx++;
@@ -651,18 +1155,73 @@ private:
     }
 
 
+    /*
+     * Swap the full active memtable for the idle one and start merging
+     * it down into the tree on a background thread. Only one merge runs
+     * at a time, so if the previous merge has not yet finished this will
+     * block until it does, at which point the idle memtable is empty again.
+     * The caller must hold merge_lock.
+     */
+    inline void schedule_merge() {
+        this->join_merge();
+
+        MemTable *mtable = this->memtable();
+        std::atomic<bool> *merging = (this->active_memtable) ? &this->memtable_2_merging : &this->memtable_1_merging;
+
+        merging->store(true);
+        this->active_memtable.store(!this->active_memtable.load());
+        this->publish_version(mtable);
+
+        this->merge_thread = std::thread([this, mtable, merging] {
+            this->merge_memtable(mtable, this->merge_rng);
+            merging->store(false);
+        });
+    }
+
+    /*
+     * Wait for any in-progress merge to finish, and return a lock on
+     * merge_lock which keeps another from starting, so that the levels and
+     * active memtable can be read, or tagged, directly for as long as it
+     * is held.
+     */
+    std::unique_lock<std::mutex> hold_levels() {
+        std::unique_lock<std::mutex> lock(this->merge_lock);
+        this->join_merge();
+        return lock;
+    }
+
+    /*
+     * Wait for merge_thread to finish, if it is running. The caller must
+     * hold merge_lock.
+     */
+    inline void join_merge() {
+        if (this->merge_thread.joinable()) {
+            this->merge_thread.join();
+        }
+    }
+
     // Merge the memory table down into the tree, completing any required other
     // merges to make room for it.
-    inline void merge_memtable(gsl_rng *rng) {
-        auto mtable = this->memtable();
+    inline void merge_memtable(MemTable *mtable, gsl_rng *rng) {
+        // Wait for any appends still in flight against the memtable to
+        // land before merging it.
+        mtable->seal();
 
         if (!this->can_merge_with(0, mtable->get_record_count())) {
-            this->merge_down(0, rng);
+            this->merge_down(0, rng, true);
         }
 
         this->merge_memtable_into_l0(mtable, rng);
         this->enforce_tombstone_maximum(0, rng);
 
+        // Make the merged levels visible, and then wait for any readers
+        // still accessing the memtable through older versions to finish
+        // before clearing it out for reuse.
+        this->publish_version(nullptr);
+        while (mtable->get_pin_count() > 0) {
+            std::this_thread::yield();
+        }
+
         mtable->truncate();
         return;
     }
@@ -672,19 +1231,61 @@ private:
      * non-negative (i.e., this function cannot be used to merge the memtable). This
      * routine will recursively perform any necessary merges to make room for the 
      * specified level.
+     *
+     * Under tiering, each step of the cascade builds its new run purely from
+     * the original contents of the level above it, so all of the steps are
+     * built concurrently on the compaction pool, and then installed together.
+     * Those on the path of a memtable flush should be marked as priority,
+     * so that they are not held up behind other trees' background work.
      */
-    inline void merge_down(level_index idx, gsl_rng *rng) {
+    inline void merge_down(level_index idx, gsl_rng *rng, bool priority=false) {
         level_index merge_base_level = this->find_mergable_level(idx);
         if (merge_base_level == -1) {
             merge_base_level = this->grow();
         }
 
+        if (LSM_LEVELING || merge_base_level - idx == 1) {
+            for (level_index i=merge_base_level; i>idx; i--) {
+                this->merge_levels(i, i-1, rng);
+                this->enforce_tombstone_maximum(i, rng);
+            }
+
+            return;
+        }
+
+        // Every level other than the base is emptied by the merge into the
+        // level below it before receiving the run from the level above, and
+        // so is built from an empty level rather than a copy of itself.
+        std::vector<MergeJob> jobs(merge_base_level - idx);
+        std::vector<gsl_rng *> rngs(jobs.size());
+        std::vector<std::future<void>> results(jobs.size());
+        for (size_t i=0; i<jobs.size(); i++) {
+            rngs[i] = gsl_rng_alloc(gsl_rng_mt19937);
+            gsl_rng_set(rngs[i], gsl_rng_get(rng));
+        }
+
+        // Submit the deepest, and so largest, merges first, so that they are
+        // started as early as possible.
+        for (size_t i=0; i<jobs.size(); i++) {
+            level_index base = merge_base_level - i;
+            jobs[i].base_level = base;
+            results[i] = compaction_pool().submit([this, &jobs, &rngs, i, base, merge_base_level] {
+                this->build_merge(jobs[i], base, base - 1, base != merge_base_level, rngs[i]);
+            }, priority);
+        }
+
+        for (size_t i=0; i<jobs.size(); i++) {
+            results[i].get();
+            gsl_rng_free(rngs[i]);
+        }
+
+        for (size_t i=0; i<jobs.size(); i++) {
+            this->install_merge(jobs[i], jobs[i].base_level - 1);
+        }
+
         for (level_index i=merge_base_level; i>idx; i--) {
-            this->merge_levels(i, i-1, rng);
             this->enforce_tombstone_maximum(i, rng);
         }
-
-        return;
     }
 
     /*
@@ -714,6 +1315,18 @@ private:
         return -1;
     }
 
+    /*
+     * The result of merging one level into the level below it, which is
+     * built separately from being installed into the tree, so that
+     * independent merges may be built concurrently. Only the member
+     * matching the type of the base level is set.
+     */
+    struct MergeJob {
+        level_index base_level;
+        std::shared_ptr<MemoryLevel> memory_level;
+        std::shared_ptr<DiskLevel> disk_level;
+    };
+
     /*
      * Merge the level specified by incoming level into the level specified
      * by base level. The two levels should be sequential--i.e. no levels
@@ -721,53 +1334,96 @@ private:
      * invariant may be violated by the merge operation.
      */
     inline void merge_levels(level_index base_level, level_index incoming_level, gsl_rng *rng) {
+        MergeJob job;
+        job.base_level = base_level;
+        this->build_merge(job, base_level, incoming_level, false, rng);
+        this->install_merge(job, incoming_level);
+    }
+
+    /*
+     * Build the new level resulting from merging incoming_level into
+     * base_level, without modifying the tree. If empty_base is true, the
+     * incoming level is merged into an empty level in place of the current
+     * contents of base_level. Merges into different base levels touch
+     * disjoint levels, and may be built concurrently, given separate rngs.
+     */
+    inline void build_merge(MergeJob &job, level_index base_level, level_index incoming_level, bool empty_base, gsl_rng *rng) {
         bool base_disk_level;
         bool incoming_disk_level;
 
         size_t base_idx = decode_level_index(base_level, &base_disk_level);
         size_t incoming_idx = decode_level_index(incoming_level, &incoming_disk_level);
+        size_t run_cap = (LSM_LEVELING) ? 1 : this->scale_factor;
 
         // If the base level is a memory level, then the incoming level
         // cannot be a disk level.
         assert(!(!base_disk_level && incoming_disk_level));
 
-        if (base_disk_level && incoming_disk_level) {
-            // Merging two disk levels
-            if (LSM_LEVELING) {
-                auto tmp = this->disk_levels[base_idx];
-                this->disk_levels[base_idx] = DiskLevel::merge_levels(this->disk_levels[base_idx], this->disk_levels[incoming_idx], rng);
-                this->mark_as_unused(tmp);
-            } else {
-                this->disk_levels[base_idx]->append_merged_runs(this->disk_levels[incoming_idx], rng);
-            }
-            this->mark_as_unused(this->disk_levels[incoming_idx]);
-            this->disk_levels[incoming_idx] = new DiskLevel(incoming_level, (LSM_LEVELING) ? 1 : this->scale_factor, this->root_directory);
-        } else if (base_disk_level) {
-            // Merging the last memory level into the first disk level
-            assert(base_idx == 0);
-            assert(incoming_idx == this->memory_level_cnt - 1);
-            if (LSM_LEVELING) {
-                auto tmp = this->disk_levels[base_idx];
-                this->disk_levels[base_idx] = DiskLevel::merge_levels(this->disk_levels[base_idx], this->memory_levels[incoming_idx], rng);
-                this->mark_as_unused(tmp);
+        // Levels may be in use by readers of an older version of the tree,
+        // so they are never modified in place once published. Each merge
+        // instead replaces both levels with new ones, and the old levels are
+        // freed once the last version referencing them is released.
+        if (base_disk_level) {
+            auto base = (empty_base) ? std::make_shared<DiskLevel>(base_level, run_cap, this->root_directory)
+                                     : this->disk_levels[base_idx];
+
+            if (incoming_disk_level) {
+                // Merging two disk levels
+                if (LSM_LEVELING) {
+                    job.disk_level = std::shared_ptr<DiskLevel>(DiskLevel::merge_levels(base.get(), this->disk_levels[incoming_idx].get(), rng));
+                } else {
+                    job.disk_level = std::make_shared<DiskLevel>(*base);
+                    job.disk_level->append_merged_runs(this->disk_levels[incoming_idx].get(), rng);
+                }
             } else {
-                this->disk_levels[base_idx]->append_merged_runs(this->memory_levels[incoming_idx], rng);
+                // Merging the last memory level into the first disk level
+                assert(base_idx == 0);
+                assert(incoming_idx == this->memory_level_cnt - 1);
+                if (LSM_LEVELING) {
+                    job.disk_level = std::shared_ptr<DiskLevel>(DiskLevel::merge_levels(base.get(), this->memory_levels[incoming_idx].get(), rng));
+                } else {
+                    job.disk_level = std::make_shared<DiskLevel>(*base);
+                    job.disk_level->append_merged_runs(this->memory_levels[incoming_idx].get(), rng);
+                }
             }
-
-            this->mark_as_unused(this->memory_levels[incoming_idx]);
-            this->memory_levels[incoming_idx] = new MemoryLevel(incoming_level, (LSM_LEVELING) ? 1 : this->scale_factor, this->root_directory, DELETE_TAGGING);
         } else {
             // merging two memory levels
+            auto base = (empty_base) ? std::make_shared<MemoryLevel>(base_level, run_cap, this->root_directory, DELETE_TAGGING,
+                                                                     this->memory_level_pools[base_idx])
+                                     : this->memory_levels[base_idx];
+
             if (LSM_LEVELING) {
-                auto tmp = this->memory_levels[base_idx];
-                this->memory_levels[base_idx] = MemoryLevel::merge_levels(this->memory_levels[base_idx], this->memory_levels[incoming_idx], DELETE_TAGGING, rng);
-                this->mark_as_unused(tmp);
+                job.memory_level = std::shared_ptr<MemoryLevel>(MemoryLevel::merge_levels(base.get(), this->memory_levels[incoming_idx].get(), DELETE_TAGGING, rng));
             } else {
-                this->memory_levels[base_idx]->append_merged_runs(this->memory_levels[incoming_idx], rng);
+                job.memory_level = std::make_shared<MemoryLevel>(*base);
+                job.memory_level->append_merged_runs(this->memory_levels[incoming_idx].get(), rng);
             }
+        }
+    }
+
+    /*
+     * Replace the base level of a built merge with its result, and
+     * incoming_level with an empty level.
+     */
+    inline void install_merge(MergeJob &job, level_index incoming_level) {
+        bool base_disk_level;
+        bool incoming_disk_level;
+
+        size_t base_idx = decode_level_index(job.base_level, &base_disk_level);
+        size_t incoming_idx = decode_level_index(incoming_level, &incoming_disk_level);
+        size_t run_cap = (LSM_LEVELING) ? 1 : this->scale_factor;
 
-            this->mark_as_unused(this->memory_levels[incoming_idx]);
-            this->memory_levels[incoming_idx] = new MemoryLevel(incoming_level, (LSM_LEVELING) ? 1 : this->scale_factor, this->root_directory, DELETE_TAGGING);
+        if (base_disk_level) {
+            this->disk_levels[base_idx] = job.disk_level;
+        } else {
+            this->memory_levels[base_idx] = job.memory_level;
+        }
+
+        if (incoming_disk_level) {
+            this->disk_levels[incoming_idx] = std::make_shared<DiskLevel>(incoming_level, run_cap, this->root_directory);
+        } else {
+            this->memory_levels[incoming_idx] = std::make_shared<MemoryLevel>(incoming_level, run_cap, this->root_directory, DELETE_TAGGING,
+                                                                              this->memory_level_pools[incoming_idx]);
         }
     }
 
@@ -776,38 +1432,19 @@ private:
         if (LSM_LEVELING) {
             // FIXME: Kludgey implementation due to interface constraints.
             auto old_level = this->memory_levels[0];
-            auto temp_level = new MemoryLevel(0, 1, this->root_directory, DELETE_TAGGING);
+            auto temp_level = new MemoryLevel(0, 1, this->root_directory, DELETE_TAGGING, this->memory_level_pools[0]);
             temp_level->append_mem_table(mtable, rng);
-            auto new_level = MemoryLevel::merge_levels(old_level, temp_level, DELETE_TAGGING, rng);
+            auto new_level = MemoryLevel::merge_levels(old_level.get(), temp_level, DELETE_TAGGING, rng);
 
-            this->memory_levels[0] = new_level;
+            this->memory_levels[0] = std::shared_ptr<MemoryLevel>(new_level);
             delete temp_level;
-            this->mark_as_unused(old_level);
         } else {
-            this->memory_levels[0]->append_mem_table(mtable, rng);
+            auto new_level = std::make_shared<MemoryLevel>(*this->memory_levels[0]);
+            new_level->append_mem_table(mtable, rng);
+            this->memory_levels[0] = new_level;
         }
     }
 
-    /*
-     * Mark a given disk level as no-longer in use by the tree. For now this
-     * will just free the level. In future, this will be more complex as the
-     * level may not be able to immediately be deleted, depending upon who
-     * else is using it.
-     */ 
-    inline void mark_as_unused(DiskLevel *level) {
-        delete level;
-    }
-
-    /*
-     * Mark a given memory level as no-longer in use by the tree. For now this
-     * will just free the level. In future, this will be more complex as the
-     * level may not be able to immediately be deleted, depending upon who
-     * else is using it.
-     */ 
-    inline void mark_as_unused(MemoryLevel *level) {
-        delete level;
-    }
-
     /*
      * Check the tombstone proportion for the specified level and
      * if the limit is exceeded, forcibly merge levels until all
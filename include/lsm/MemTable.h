@@ -5,150 +5,679 @@
 #include <cassert>
 #include <vector>
 #include <algorithm>
+#include <cstring>
+#include <thread>
+#include <new>
+#include <memory>
 
 #include "util/base.h"
 #include "util/bf_config.h"
 #include "ds/BloomFilter.h"
+#include "ds/SlotIndex.h"
 #include "util/record.h"
+#include "util/radix_sort.h"
+#include "util/hash.h"
+#include "util/hugepage.h"
 
 namespace lsm {
 
+// The maximum number of threads used to sort the contents of a memtable
+// when it is flushed. Only large memtables will use more than one.
+const size_t MEMTABLE_SORT_THREADS = 4;
+
+// The number of consecutive slots of a shard that are sorted together, once
+// all of them have been committed, so that range queries need only search
+// each block rather than scan the buffer.
+const size_t MEMTABLE_SORTED_BLOCK_SIZE = 1024;
+
+/*
+ * The non-tombstone records of a memtable within some key range, as found
+ * by MemTable::get_range. Each sorted block contributes a contiguous run of
+ * its sorted index, and the records not yet in any sorted block are listed
+ * individually.
+ */
+struct MemTableRange {
+    // The [start, stop) positions within the sorted block index of each
+    // block's records in range, and the number of records in range within
+    // all of the blocks before each one.
+    std::vector<std::pair<size_t, size_t>> blocks;
+    std::vector<size_t> preceding;
+    size_t block_record_cnt = 0;
+
+    // The slots of the in-range records that are not in a sorted block.
+    std::vector<uint32_t> unsorted;
+
+    size_t get_record_count() const {
+        return block_record_cnt + unsorted.size();
+    }
+};
+
+/*
+ * A point-in-time view of a memtable, as taken by MemTable::get_snapshot.
+ * Reads that are given a snapshot see only the records committed, and the
+ * deletes applied, before it was taken, regardless of any writes since.
+ */
+struct MemTableSnapshot {
+    // The committed record count of each shard.
+    std::vector<size_t> reccnts;
+
+    // Deletes applied with an epoch at or below this are visible.
+    size_t delete_epoch = 0;
+
+    size_t get_record_count() const {
+        size_t cnt = 0;
+        for (auto c : reccnts) cnt += c;
+        return cnt;
+    }
+};
+
 class MemTable {
 public:
-    MemTable(size_t capacity, bool rej_sampling, size_t max_tombstone_cap, const gsl_rng* rng)
+    /*
+     * Create a memtable with space for capacity records. The record buffer
+     * is split into shard_cnt equal shards, each with its own tail, and
+     * each writer thread appends to its own shard, so that concurrent
+     * writers do not all contend on a single counter.
+     *
+     * If tagging is true, every record is indexed by key and value as it is
+     * appended, so that delete_record does not need to scan the buffer.
+     */
+    MemTable(size_t capacity, bool rej_sampling, size_t max_tombstone_cap, const gsl_rng* rng, size_t shard_cnt=1, bool tagging=false)
     : m_cap(capacity), m_tombstone_cap(max_tombstone_cap)
-    , m_reccnt(0), m_tombstonecnt(0) {
+    , m_tombstonecnt(0), m_pins(0), m_delete_tail(0), m_delete_epoch(0) {
+        assert(shard_cnt > 0);
+        m_shard_cnt = std::max<size_t>(1, std::min(shard_cnt, capacity));
+        m_shard_cap = (capacity + m_shard_cnt - 1) / m_shard_cnt;
+        m_shards = new Shard[m_shard_cnt];
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            m_shards[i].start = std::min(i * m_shard_cap, capacity);
+            m_shards[i].cap = std::min(m_shard_cap, capacity - m_shards[i].start);
+            m_shards[i].reccnt.store(0);
+            m_shards[i].tail.store(0);
+            m_shards[i].sorted_blocks.store(0);
+            m_shards[i].block_cnts.resize((m_shards[i].cap + MEMTABLE_SORTED_BLOCK_SIZE - 1) / MEMTABLE_SORTED_BLOCK_SIZE);
+            m_shards[i].block_sorted.reset(new std::atomic<bool>[m_shards[i].block_cnts.size()]);
+            for (size_t b=0; b<m_shards[i].block_cnts.size(); b++) {
+                m_shards[i].block_sorted[b].store(false);
+            }
+        }
+
         auto len = capacity * sizeof(record_t);
         size_t aligned_buffersize = len + (CACHELINE_SIZE - (len %  CACHELINE_SIZE));
-        m_data = (record_t*) std::aligned_alloc(CACHELINE_SIZE, aligned_buffersize);
-        m_tombstone_filter = nullptr;
+        m_data = (record_t*) huge_alloc(aligned_buffersize);
+        m_sorted_data = (record_t*) huge_alloc(aligned_buffersize);
+        m_sort_buffer = (record_t*) huge_alloc(aligned_buffersize);
+        m_tombstone_index = nullptr;
         if (max_tombstone_cap > 0) {
-            assert(rng != nullptr);
-            m_tombstone_filter = new BloomFilter(BF_FPR, max_tombstone_cap, BF_HASH_FUNCS, rng);
+            m_tombstone_index = new SlotIndex(max_tombstone_cap);
+        }
+
+        m_record_index = (tagging) ? new SlotIndex(capacity) : nullptr;
+
+        m_block_index = (BlockEntry *) huge_alloc(capacity * sizeof(BlockEntry));
+
+        m_delete_epochs = (std::atomic<size_t> *) huge_alloc(capacity * sizeof(std::atomic<size_t>));
+        for (size_t i=0; i<capacity; i++) {
+            new (&m_delete_epochs[i]) std::atomic<size_t>(0);
         }
     }
 
     ~MemTable() {
-        if (m_data) free(m_data);
-        if (m_tombstone_filter) delete m_tombstone_filter;
+        if (m_data) huge_free(m_data);
+        if (m_sorted_data) huge_free(m_sorted_data);
+        if (m_sort_buffer) huge_free(m_sort_buffer);
+        if (m_tombstone_index) delete m_tombstone_index;
+        if (m_record_index) delete m_record_index;
+        huge_free(m_block_index);
+        huge_free(m_delete_epochs);
+        delete[] m_shards;
     }
 
+    /*
+     * Append a record to the memtable. Safe to call from multiple threads
+     * concurrently. Each writer reserves a slot by advancing the tail of its
+     * shard, fills it in, and then commits it. Slots are committed in order
+     * within each shard, so the record count only ever covers fully written
+     * records. A writer whose shard is full falls back to the others.
+     * Returns 0 if the memtable is full or sealed, or if the record is a
+     * tombstone and the tombstone capacity has been reached.
+     */
     int append(const key_t& key, const value_t& value, bool is_tombstone = false) {
-        if (is_tombstone && m_tombstonecnt + 1 > m_tombstone_cap) return 0;
+        if (is_tombstone && m_tombstonecnt.fetch_add(1) >= m_tombstone_cap) {
+            m_tombstonecnt.fetch_sub(1);
+            return 0;
+        }
 
+        size_t home = (m_shard_cnt == 1) ? 0 : get_thread_idx() % m_shard_cnt;
+        size_t shard = home;
         int32_t pos = 0;
-        if ((pos = try_advance_tail()) == -1) return 0;
+        while ((pos = try_advance_tail(shard)) == -1) {
+            shard = (shard + 1) % m_shard_cnt;
+            if (shard == home) {
+                if (is_tombstone) m_tombstonecnt.fetch_sub(1);
+                return 0;
+            }
+        }
 
         m_data[pos].key = key;
         m_data[pos].value = value;
         m_data[pos].header = ((pos << 2) | (is_tombstone ? 1 : 0));
         
+        // Index the record before committing it, so that it can be found
+        // by check_tombstone or delete_record as soon as it is counted.
         if (is_tombstone) {
-            m_tombstonecnt.fetch_add(1);
-            if (m_tombstone_filter) m_tombstone_filter->insert(key);
+            m_tombstone_index->insert(hash_pair(key, value), pos);
+        } else if (m_record_index) {
+            m_record_index->insert(hash_pair(key, value), pos);
         }
-        //m_reccnt.fetch_add(1);
+
+        commit(shard, pos - m_shards[shard].start);
 
         return 1;     
     }
 
+    /*
+     * Stop the memtable from accepting any further appends, and wait for
+     * all in-flight appends to commit, and for the blocks they completed
+     * to be sorted. Returns the final record count.
+     * A sealed memtable remains sealed until it is truncated.
+     */
+    size_t seal() {
+        size_t total = 0;
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            auto &shard = m_shards[i];
+            size_t tail = shard.tail.load();
+            while (tail < shard.cap && !shard.tail.compare_exchange_weak(tail, shard.cap))
+                ;
+
+            size_t reserved = std::min(tail, shard.cap);
+            while (shard.reccnt.load(std::memory_order_acquire) < reserved) {
+                std::this_thread::yield();
+            }
+
+            size_t complete = (reserved == shard.cap) ? shard.block_cnts.size() : reserved / MEMTABLE_SORTED_BLOCK_SIZE;
+            while (shard.sorted_blocks.load(std::memory_order_acquire) < complete) {
+                std::this_thread::yield();
+            }
+
+            total += reserved;
+        }
+
+        return total;
+    }
+
     bool truncate() {
         m_tombstonecnt.store(0);
-        m_reccnt.store(0);
-        if (m_tombstone_filter) m_tombstone_filter->clear();
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            m_shards[i].reccnt.store(0);
+            m_shards[i].tail.store(0);
+            m_shards[i].sorted_blocks.store(0);
+            for (size_t b=0; b<m_shards[i].block_cnts.size(); b++) {
+                m_shards[i].block_sorted[b].store(false);
+            }
+        }
+        if (m_tombstone_index) m_tombstone_index->clear();
+        if (m_record_index) m_record_index->clear();
+
+        for (size_t i=0; i<m_cap; i++) {
+            m_delete_epochs[i].store(0, std::memory_order_relaxed);
+        }
+        m_delete_tail.store(0);
+        m_delete_epoch.store(0);
 
         return true;
     }
 
+    /*
+     * Returns a sorted copy of the records within the memtable. The
+     * buffer itself is left in insertion order, as readers may still be
+     * sampling from it while it is merged into the tree. The copy remains
+     * valid until the next call to sorted_output() or truncate().
+     *
+     * The records are gathered in slot order, and so a stable radix sort
+     * on key and value yields the same order as memtable_record_cmp. The
+     * delete status of each record is set in the copy, as the records of
+     * the buffer itself are not modified once they have been committed.
+     */
     record_t* sorted_output() {
-        std::sort(m_data, m_data + m_reccnt.load(), memtable_record_cmp);
-        return m_data;
+        bool deletes = m_delete_tail.load() > 0;
+        size_t reccnt = 0;
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            size_t cnt = m_shards[i].reccnt.load(std::memory_order_acquire);
+            memcpy(m_sorted_data + reccnt, m_data + m_shards[i].start, cnt * sizeof(record_t));
+
+            for (size_t j=0; deletes && j<cnt; j++) {
+                if (m_delete_epochs[m_shards[i].start + j].load(std::memory_order_acquire) != 0) {
+                    m_sorted_data[reccnt + j].set_delete_status();
+                }
+            }
+
+            reccnt += cnt;
+        }
+
+        return radix_sort(m_sorted_data, m_sort_buffer, reccnt, MEMTABLE_SORT_THREADS);
     }
     
+    /*
+     * Returns the number of committed records. Records at indexes below
+     * this count are fully written and will not change until the memtable
+     * is truncated. Their delete status is kept apart from them, and is
+     * read using is_deleted.
+     */
     size_t get_record_count() {
-        return m_reccnt;
+        size_t cnt = 0;
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            cnt += m_shards[i].reccnt.load(std::memory_order_acquire);
+        }
+        return cnt;
     }
     
     size_t get_capacity() {
         return m_cap;
     }
 
+    /*
+     * Returns true if every slot has been reserved, even if some writes
+     * have yet to commit, or if the memtable has been sealed.
+     */
     bool is_full() {
-        return m_reccnt == m_cap;
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            if (m_shards[i].tail.load() < m_shards[i].cap) return false;
+        }
+        return true;
     }
 
     size_t get_tombstone_count() {
         return m_tombstonecnt.load();
     }
 
+    /*
+     * Tag the record matching key and val as deleted. Returns false if
+     * there is no such record. Constant time if the memtable was created
+     * with tagging enabled, and a scan of the buffer otherwise.
+     */
     bool delete_record(const key_t& key, const value_t& val) {
-        auto offset = 0;
-        while (offset < m_reccnt.load()) {
-            if (m_data[offset].match(key, val, false)) {
-                m_data[offset].set_delete_status();
-                return true;
+        if (m_record_index) {
+            auto slot = m_record_index->find(hash_pair(key, val), [&](uint32_t slot) {
+                return m_data[slot].match(key, val, false);
+            });
+
+            if (slot == -1) return false;
+
+            this->apply_delete(slot);
+            return true;
+        }
+
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            auto data = m_data + m_shards[i].start;
+            size_t offset = 0;
+            while (offset < m_shards[i].reccnt.load(std::memory_order_acquire)) {
+                if (data[offset].match(key, val, false)) {
+                    this->apply_delete(m_shards[i].start + offset);
+                    return true;
+                }
+                offset++;
             }
-            offset++;
         }
         return false;
     }
 
-    bool check_tombstone(const key_t& key, const value_t& value) {
-        if (m_tombstone_filter && !m_tombstone_filter->lookup(key)) return false;
+    /*
+     * Returns true if the specified record of this memtable has been
+     * deleted, or, if a snapshot is provided, if it had been deleted when
+     * the snapshot was taken.
+     */
+    bool is_deleted(const record_t *rec, const MemTableSnapshot *snapshot=nullptr) {
+        size_t epoch = m_delete_epochs[rec - m_data].load(std::memory_order_acquire);
+        return epoch != 0 && (!snapshot || epoch <= snapshot->delete_epoch);
+    }
+
+    /*
+     * Returns true if the memtable contains a tombstone for the specified
+     * record. Tombstones are indexed by hash as they are appended, so this
+     * does not need to scan the buffer. If a snapshot is provided, only
+     * tombstones committed before it was taken are considered.
+     */
+    bool check_tombstone(const key_t& key, const value_t& value, const MemTableSnapshot *snapshot=nullptr) {
+        if (!m_tombstone_index) return false;
+
+        return m_tombstone_index->find(hash_pair(key, value), [&](uint32_t slot) {
+            return m_data[slot].match(key, value, true) && (!snapshot || this->in_snapshot(slot, *snapshot));
+        }) != -1;
+    }
 
-        auto offset = 0;
-        while (offset < m_reccnt.load()) {
-            if (m_data[offset].match(key, value, true)) return true;
-            offset++;
+    /*
+     * Record the current state of the memtable into snapshot, replacing its
+     * contents. The snapshot remains valid until the memtable is truncated.
+     */
+    void get_snapshot(MemTableSnapshot &snapshot) {
+        snapshot.delete_epoch = m_delete_epoch.load(std::memory_order_acquire);
+        snapshot.reccnts.resize(m_shard_cnt);
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            snapshot.reccnts[i] = m_shards[i].reccnt.load(std::memory_order_acquire);
         }
-        return false;
     }
 
     void create_sampling_vector(const key_t& min, const key_t& max, std::vector<const record_t*> &records) {
         records.clear();
-        for (size_t i=0; i<m_reccnt.load(); i++) {
-            auto rec = this->get_record_at(i);
-            auto key = rec->key;
-            if (min <= key && key <= max && !rec->get_delete_status()) {
-                records.push_back(rec);
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            auto data = m_data + m_shards[i].start;
+            size_t cnt = m_shards[i].reccnt.load(std::memory_order_acquire);
+            for (size_t j=0; j<cnt; j++) {
+                auto rec = data + j;
+                auto key = rec->key;
+                if (min <= key && key <= max && !this->is_deleted(rec)) {
+                    records.push_back(rec);
+                }
+            }
+        }
+    }
+
+    /*
+     * Find the committed, non-tombstone, records with keys in [min, max],
+     * replacing the contents of range. This searches each sorted block,
+     * and only scans the records that have not yet been sorted, of which
+     * there are at most around MEMTABLE_SORTED_BLOCK_SIZE per shard. If a
+     * snapshot is provided, only the records within it are included.
+     */
+    void get_range(const key_t& min, const key_t& max, MemTableRange &range, const MemTableSnapshot *snapshot=nullptr) {
+        range.blocks.clear();
+        range.preceding.clear();
+        range.unsorted.clear();
+        range.block_record_cnt = 0;
+
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            auto &shard = m_shards[i];
+
+            // A block is sorted after its last record is committed, so the
+            // sorted blocks usually lag the committed records, but a
+            // snapshot's record count may lag the sorted blocks.
+            size_t sorted = shard.sorted_blocks.load(std::memory_order_acquire);
+            size_t reccnt = (snapshot) ? snapshot->reccnts[i] : shard.reccnt.load(std::memory_order_acquire);
+            while (sorted > 0 && block_end(shard, sorted - 1) > reccnt) {
+                sorted--;
+            }
+
+            for (size_t b=0; b<sorted; b++) {
+                size_t start = shard.start + b * MEMTABLE_SORTED_BLOCK_SIZE;
+                auto first = m_block_index + start;
+                auto last = first + shard.block_cnts[b];
+
+                auto lo = std::lower_bound(first, last, min, [](const BlockEntry &e, const key_t &k) { return e.key < k; });
+                auto hi = std::upper_bound(lo, last, max, [](const key_t &k, const BlockEntry &e) { return k < e.key; });
+                if (lo == hi) continue;
+
+                range.blocks.push_back({lo - m_block_index, hi - m_block_index});
+                range.preceding.push_back(range.block_record_cnt);
+                range.block_record_cnt += hi - lo;
+            }
+
+            for (size_t j=(sorted > 0) ? block_end(shard, sorted - 1) : 0; j<reccnt; j++) {
+                auto rec = m_data + shard.start + j;
+                if (min <= rec->key && rec->key <= max && !rec->is_tombstone()) {
+                    range.unsorted.push_back(shard.start + j);
+                }
             }
         }
     }
 
-    const record_t* get_record_at(size_t idx) {
-        return m_data + idx;
+    /*
+     * Returns the idx'th record of a range, which must be less than
+     * range.get_record_count().
+     */
+    const record_t *get_range_record(const MemTableRange &range, size_t idx) {
+        if (idx >= range.block_record_cnt) {
+            return m_data + range.unsorted[idx - range.block_record_cnt];
+        }
+
+        size_t b = std::upper_bound(range.preceding.begin(), range.preceding.end(), idx) - range.preceding.begin() - 1;
+        return m_data + m_block_index[range.blocks[b].first + idx - range.preceding[b]].slot;
+    }
+
+    /*
+     * Returns the idx'th committed record, counting through the shards in
+     * order, such that the committed records of all shards together form
+     * a single range of get_record_count() records. idx must be less than
+     * a record count previously returned by get_record_count(), or that of
+     * the snapshot, if one is provided.
+     */
+    const record_t* get_record_at(size_t idx, const MemTableSnapshot *snapshot=nullptr) {
+        if (m_shard_cnt == 1) return m_data + idx;
+
+        for (size_t i=0; i<m_shard_cnt; i++) {
+            size_t cnt = (snapshot) ? snapshot->reccnts[i] : m_shards[i].reccnt.load(std::memory_order_acquire);
+            if (idx < cnt) return m_data + m_shards[i].start + idx;
+            idx -= cnt;
+        }
+
+        return nullptr;
+    }
+
+    size_t get_shard_count() {
+        return m_shard_cnt;
     }
 
     size_t get_memory_utilization() {
         return m_cap * sizeof(record_t);
     }
 
+    /*
+     * Returns the memory used by the memtable beyond its record buffer,
+     * which includes the two buffers of the same size that sorted_output
+     * copies and sorts the records into.
+     */
     size_t get_aux_memory_utilization() {
-        return m_tombstone_filter->get_memory_utilization();
+        return 2 * m_cap * sizeof(record_t)
+             + ((m_tombstone_index) ? m_tombstone_index->get_memory_utilization() : 0)
+             + ((m_record_index) ? m_record_index->get_memory_utilization() : 0)
+             + m_cap * sizeof(BlockEntry)
+             + m_cap * sizeof(std::atomic<size_t>);
     }
 
     size_t get_tombstone_capacity() {
         return m_tombstone_cap;
     }
 
+    /*
+     * Readers that may access the memtable's records concurrently with
+     * its merge hold a pin on it for the duration of their access. A
+     * memtable must not be truncated while it is pinned.
+     */
+    void pin() {
+        m_pins.fetch_add(1);
+    }
+
+    void unpin() {
+        m_pins.fetch_sub(1);
+    }
+
+    size_t get_pin_count() {
+        return m_pins.load();
+    }
+
 private:
-    int32_t try_advance_tail() {
-        size_t new_tail = m_reccnt.fetch_add(1);
+    /*
+     * The tail and committed record count of one shard of the record
+     * buffer, each on its own cacheline. The tail may run past cap due to
+     * failed reservations.
+     */
+    struct Shard {
+        alignas(64) std::atomic<size_t> reccnt;
+        alignas(64) std::atomic<size_t> tail;
+        size_t start;
+        size_t cap;
+
+        // The number of leading blocks of the shard that have been sorted
+        // into the block index, the number of entries in each, and whether
+        // each has been sorted, as blocks may finish sorting out of order.
+        std::atomic<size_t> sorted_blocks;
+        std::vector<size_t> block_cnts;
+        std::unique_ptr<std::atomic<bool>[]> block_sorted;
+    };
+
+    /*
+     * An entry of the sorted block index, which holds the non-tombstone
+     * records of each sorted block in key order, at the same offsets as the
+     * block's slots in the record buffer.
+     */
+    struct BlockEntry {
+        key_t key;
+        uint32_t slot;
+    };
 
-        if (new_tail < m_cap) return new_tail;
+    /*
+     * Returns the shard-relative index one past the last slot of the
+     * specified block of a shard.
+     */
+    static size_t block_end(const Shard &shard, size_t block) {
+        return std::min((block + 1) * MEMTABLE_SORTED_BLOCK_SIZE, shard.cap);
+    }
+
+    /*
+     * Sort the non-tombstone records of the specified block of a shard
+     * into the block index.
+     */
+    void sort_block(Shard &shard, size_t block) {
+        size_t start = block * MEMTABLE_SORTED_BLOCK_SIZE;
+        auto first = m_block_index + shard.start + start;
+
+        size_t cnt = 0;
+        for (size_t i=start; i<block_end(shard, block); i++) {
+            auto rec = m_data + shard.start + i;
+            if (!rec->is_tombstone()) {
+                first[cnt++] = BlockEntry{rec->key, (uint32_t) (shard.start + i)};
+            }
+        }
+
+        std::sort(first, first + cnt, [](const BlockEntry &a, const BlockEntry &b) { return a.key < b.key; });
+        shard.block_cnts[block] = cnt;
+    }
+
+    /*
+     * Returns true if the specified slot was committed as of the snapshot.
+     */
+    bool in_snapshot(size_t slot, const MemTableSnapshot &snapshot) {
+        size_t shard = slot / m_shard_cap;
+        return slot - m_shards[shard].start < snapshot.reccnts[shard];
+    }
+
+    /*
+     * Tag the record in the specified slot as deleted. Each delete is
+     * assigned the next epoch, and deletes are published in epoch order,
+     * in the same way as appends are committed, so that a snapshot's epoch
+     * covers exactly the deletes that had been published when it was
+     * taken. A record keeps the epoch at which it was first deleted.
+     *
+     * The record itself is left untouched, as readers copy and inspect
+     * committed records without synchronizing with deletes, and the epoch
+     * alone marks it as deleted.
+     */
+    void apply_delete(size_t slot) {
+        size_t epoch = m_delete_tail.fetch_add(1) + 1;
+
+        size_t spins = 0;
+        while (m_delete_epoch.load(std::memory_order_acquire) != epoch - 1) {
+            if (++spins % 64 == 0) std::this_thread::yield();
+        }
+
+        if (m_delete_epochs[slot].load(std::memory_order_relaxed) == 0) {
+            m_delete_epochs[slot].store(epoch, std::memory_order_release);
+        }
+
+        m_delete_epoch.store(epoch, std::memory_order_release);
+    }
+
+    /*
+     * Reserve a slot within the specified shard, returning its index
+     * within the full record buffer, or -1 if the shard is full.
+     */
+    int32_t try_advance_tail(size_t shard) {
+        auto &s = m_shards[shard];
+
+        // Avoid advancing the tail any further once the shard is full
+        if (s.tail.load() >= s.cap) return -1;
+
+        size_t new_tail = s.tail.fetch_add(1);
+
+        if (new_tail < s.cap) return s.start + new_tail;
         else return -1;
     }
 
+    /*
+     * Publish the record in slot pos of the shard, once all of the slots
+     * before it have been published.
+     */
+    void commit(size_t shard, size_t pos) {
+        auto &s = m_shards[shard];
+        size_t spins = 0;
+        while (s.reccnt.load(std::memory_order_acquire) != pos) {
+            if (++spins % 64 == 0) std::this_thread::yield();
+        }
+
+        s.reccnt.store(pos + 1, std::memory_order_release);
+
+        // The writer completing a block sorts it once every record in it is
+        // committed, outside of the commit order, so that later writers to
+        // the shard are not held up behind the sort.
+        size_t block = pos / MEMTABLE_SORTED_BLOCK_SIZE;
+        if (pos + 1 == block_end(s, block)) {
+            this->sort_block(s, block);
+            this->publish_sorted_block(s, block);
+        }
+    }
+
+    /*
+     * Mark a block of a shard as sorted, and advance the shard's count of
+     * sorted blocks over every leading block that now is. Whichever of the
+     * writers sorting neighbouring blocks finishes last advances the count
+     * past both.
+     */
+    void publish_sorted_block(Shard &s, size_t block) {
+        s.block_sorted[block].store(true);
+
+        size_t sorted = s.sorted_blocks.load();
+        while (sorted < s.block_cnts.size() && s.block_sorted[sorted].load()) {
+            if (s.sorted_blocks.compare_exchange_weak(sorted, sorted + 1)) {
+                sorted++;
+            }
+        }
+    }
+
+    /*
+     * Returns a small integer identifying the calling thread, assigned
+     * in the order in which threads first append to any memtable.
+     */
+    static size_t get_thread_idx() {
+        static std::atomic<size_t> next_idx(0);
+        thread_local size_t idx = next_idx.fetch_add(1);
+        return idx;
+    }
+
     size_t m_cap;
     //size_t m_buffersize;
     size_t m_tombstone_cap;
     
     record_t* m_data;
-    BloomFilter* m_tombstone_filter;
+    record_t* m_sorted_data;
+    record_t* m_sort_buffer;
+    SlotIndex* m_tombstone_index;
+    SlotIndex* m_record_index;
+    BlockEntry* m_block_index;
+
+    // The epoch at which each record was deleted, or 0 if it has not been.
+    // This is the only record of a memtable record's delete status.
+    std::atomic<size_t>* m_delete_epochs;
+
+    size_t m_shard_cnt;
+    size_t m_shard_cap;
+    Shard *m_shards;
 
     alignas(64) std::atomic<size_t> m_tombstonecnt;
-    //alignas(64) std::atomic<size_t> m_current_tail;
-    alignas(64) std::atomic<size_t> m_reccnt;
+    alignas(64) std::atomic<size_t> m_pins;
+
+    // The last delete epoch handed out, and the last one published.
+    alignas(64) std::atomic<size_t> m_delete_tail;
+    alignas(64) std::atomic<size_t> m_delete_epoch;
 };
 
 }
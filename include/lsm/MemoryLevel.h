@@ -7,6 +7,7 @@
 #include "util/bf_config.h"
 #include "lsm/InMemRun.h"
 #include "ds/BloomFilter.h"
+#include "util/BufferPool.h"
 
 namespace lsm {
 
@@ -16,34 +17,15 @@ class DiskLevel;
 class MemoryLevel {
 friend class DiskLevel;
 
-private:
-    struct InternalLevelStructure {
-        InternalLevelStructure(size_t cap)
-        : m_cap(cap)
-        , m_runs(new InMemRun*[cap]{nullptr})
-        , m_bfs(new BloomFilter*[cap]{nullptr}) {} 
-
-        ~InternalLevelStructure() {
-            for (size_t i = 0; i < m_cap; ++i) {
-                if (m_runs[i]) delete m_runs[i];
-                if (m_bfs[i]) delete m_bfs[i];
-            }
-
-            delete[] m_runs;
-            delete[] m_bfs;
-        }
-
-        size_t m_cap;
-        InMemRun** m_runs;
-        BloomFilter** m_bfs;
-    };
-
 public:
-    MemoryLevel(ssize_t level_no, size_t run_cap, std::string root_directory, std::string meta_fname, bool tagging, gsl_rng *rng) 
+    MemoryLevel(ssize_t level_no, size_t run_cap, std::string root_directory, std::string meta_fname, bool tagging, gsl_rng *rng,
+                std::shared_ptr<BufferPool> pool=nullptr)
     : m_level_no(level_no), m_run_cnt(0)
-    , m_structure(new InternalLevelStructure(run_cap))
+    , m_runs(run_cap, nullptr)
+    , m_bfs(run_cap, nullptr)
     , m_directory(root_directory)
-    , m_tagging(tagging) {
+    , m_tagging(tagging)
+    , m_pool(pool) {
         FILE *meta_f = fopen(meta_fname.c_str(), "r");
         assert(meta_f);
 
@@ -58,65 +40,92 @@ public:
         //          case here, but a more robust solution may be helpful
         while (fscanf(meta_f, "%s %s %ld %ld\n", typebuff, fnamebuff, &reccnt, &tscnt) != EOF && m_run_cnt < run_cap) {
             assert(strcmp(typebuff, "memory") == 0);
-            m_structure->m_bfs[m_run_cnt] = new BloomFilter(BF_FPR, tscnt, BF_HASH_FUNCS, rng);
-            m_structure->m_runs[m_run_cnt] = new InMemRun(std::string(fnamebuff), reccnt, tscnt, m_structure->m_bfs[m_run_cnt], m_tagging);
+            // The run's tombstone filter is saved with it, and replaces
+            // this one as the run is loaded.
+            m_bfs[m_run_cnt] = std::make_shared<BloomFilter>(BF_FPR, tscnt, BF_HASH_FUNCS, rng);
+            m_runs[m_run_cnt] = std::make_shared<InMemRun>(std::string(fnamebuff), m_bfs[m_run_cnt].get(), m_tagging);
             m_run_cnt++;
         }
     }
 
-    MemoryLevel(ssize_t level_no, size_t run_cap, std::string root_directory, bool tagging)
+    /*
+     * Create an empty level. The runs built for the level draw their
+     * buffers from pool, if one is given, and return them to it once they
+     * are freed, to be reused by the runs of later merges into the level.
+     * The pool is shared with every copy of the level.
+     */
+    MemoryLevel(ssize_t level_no, size_t run_cap, std::string root_directory, bool tagging, std::shared_ptr<BufferPool> pool=nullptr)
     : m_level_no(level_no), m_run_cnt(0)
-    , m_structure(new InternalLevelStructure(run_cap))
+    , m_runs(run_cap, nullptr)
+    , m_bfs(run_cap, nullptr)
     , m_directory(root_directory)
-    , m_tagging(tagging) {}
+    , m_tagging(tagging)
+    , m_pool(pool) {}
 
     // Create a new memory level sharing the runs and repurposing it as previous level_no + 1
     // WARNING: for leveling only.
     MemoryLevel(MemoryLevel* level)
     : m_level_no(level->m_level_no + 1), m_run_cnt(level->m_run_cnt)
-    , m_structure(level->m_structure) 
+    , m_runs(level->m_runs)
+    , m_bfs(level->m_bfs)
     , m_directory(level->m_directory)
     , m_tagging(level->m_tagging) {
-        assert(m_structure->m_cap == 1 && m_run_cnt == 1);
+        assert(m_runs.size() == 1 && m_run_cnt == 1);
     }
 
+    // Create a copy of a level, sharing its runs. Runs are immutable once
+    // built, so the copy can have new runs appended to it without
+    // affecting any readers of the original level.
+    MemoryLevel(const MemoryLevel& level) = default;
+
     ~MemoryLevel() {}
 
     // WARNING: for leveling only.
     // assuming the base level is the level new level is merging into. (base_level is larger.)
     static MemoryLevel* merge_levels(MemoryLevel* base_level, MemoryLevel* new_level, bool tagging, const gsl_rng* rng) {
         assert(base_level->m_level_no > new_level->m_level_no || (base_level->m_level_no == 0 && new_level->m_level_no == 0));
-        auto res = new MemoryLevel(base_level->m_level_no, 1, base_level->m_directory, tagging);
+        auto res = new MemoryLevel(base_level->m_level_no, 1, base_level->m_directory, tagging, base_level->m_pool);
         res->m_run_cnt = 1;
-        res->m_structure->m_bfs[0] =
-            new BloomFilter(BF_FPR,
+
+        // If the base level is empty, the new level's run can simply be
+        // shared by the result, rather than copied.
+        if (base_level->get_run_count() == 0) {
+            res->m_bfs[0] = new_level->m_bfs[0];
+            res->m_runs[0] = new_level->m_runs[0];
+            return res;
+        }
+
+        res->m_bfs[0] =
+            std::make_shared<BloomFilter>(BF_FPR,
                             new_level->get_tombstone_count() + base_level->get_tombstone_count(),
                             BF_HASH_FUNCS, rng);
         InMemRun* runs[2];
-        runs[0] = base_level->m_structure->m_runs[0];
-        runs[1] = new_level->m_structure->m_runs[0];
+        runs[0] = base_level->m_runs[0].get();
+        runs[1] = new_level->m_runs[0].get();
 
-        res->m_structure->m_runs[0] = new InMemRun(runs, 2, res->m_structure->m_bfs[0], tagging);
+        res->m_runs[0] = std::make_shared<InMemRun>(runs, 2, res->m_bfs[0].get(), tagging, INMEM_RUN_LEARNED_INDEX, INMEM_RUN_LAYOUT, res->m_pool);
         return res;
     }
 
     void append_mem_table(MemTable* memtable, const gsl_rng* rng) {
-        assert(m_run_cnt < m_structure->m_cap);
-        m_structure->m_bfs[m_run_cnt] = new BloomFilter(BF_FPR, memtable->get_tombstone_count(), BF_HASH_FUNCS, rng);
-        m_structure->m_runs[m_run_cnt] = new InMemRun(memtable, m_structure->m_bfs[m_run_cnt], m_tagging);
+        assert(m_run_cnt < m_runs.size());
+        m_bfs[m_run_cnt] = std::make_shared<BloomFilter>(BF_FPR, memtable->get_tombstone_count(), BF_HASH_FUNCS, rng);
+        m_runs[m_run_cnt] = std::make_shared<InMemRun>(memtable, m_bfs[m_run_cnt].get(), m_tagging, INMEM_RUN_LEARNED_INDEX, INMEM_RUN_LAYOUT, m_pool);
         ++m_run_cnt;
     }
 
     void append_merged_runs(MemoryLevel* level, const gsl_rng* rng) {
-        assert(m_run_cnt < m_structure->m_cap);
-        m_structure->m_bfs[m_run_cnt] = new BloomFilter(BF_FPR, level->get_tombstone_count(), BF_HASH_FUNCS, rng);
-        m_structure->m_runs[m_run_cnt] = new InMemRun(level->m_structure->m_runs, level->m_run_cnt, m_structure->m_bfs[m_run_cnt], m_tagging);
+        assert(m_run_cnt < m_runs.size());
+        m_bfs[m_run_cnt] = std::make_shared<BloomFilter>(BF_FPR, level->get_tombstone_count(), BF_HASH_FUNCS, rng);
+        auto runs = level->get_runs();
+        m_runs[m_run_cnt] = std::make_shared<InMemRun>(runs.data(), level->m_run_cnt, m_bfs[m_run_cnt].get(), m_tagging,
+                                                       INMEM_RUN_LEARNED_INDEX, INMEM_RUN_LAYOUT, m_pool);
         ++m_run_cnt;
     }
 
     bool delete_record(const key_t& key, const value_t& val) {
-        for (size_t i = 0; i < m_structure->m_cap;  ++i) {
-            if (m_structure->m_runs[i] && m_structure->m_runs[i]->delete_record(key, val)) {
+        for (size_t i = 0; i < m_runs.size();  ++i) {
+            if (m_runs[i] && m_runs[i]->delete_record(key, val)) {
                 return true;
             }
         }
@@ -127,17 +136,33 @@ public:
     // Append the sample range in-order.....
     void get_sample_ranges(std::vector<SampleRange>& dst, std::vector<size_t>& rec_cnts, const key_t& low, const key_t& high) {
         for (ssize_t i = 0; i < m_run_cnt; ++i) {
-            auto low_pos = m_structure->m_runs[i]->get_lower_bound(low);
-            auto high_pos = m_structure->m_runs[i]->get_upper_bound(high);
+            auto [low_pos, high_pos] = m_runs[i]->get_bounds(low, high);
             assert(high_pos >= low_pos);
             dst.emplace_back(SampleRange{RunId{m_level_no, i}, low_pos, high_pos});
             rec_cnts.emplace_back(high_pos - low_pos);
         }
     }
 
+    /*
+     * As above, but using the galloping searches of each run, starting from
+     * hints[i] for run i. hints must hold one entry per run, each no larger
+     * than the lower bound of low within its run (0 is always valid), and
+     * each is updated to that lower bound. This is intended for sampling
+     * from a sequence of ranges in increasing order of low.
+     */
+    void get_sample_ranges(std::vector<SampleRange>& dst, std::vector<size_t>& rec_cnts, const key_t& low, const key_t& high, size_t *hints) {
+        for (ssize_t i = 0; i < m_run_cnt; ++i) {
+            auto low_pos = m_runs[i]->get_lower_bound_from(low, hints[i]);
+            auto high_pos = m_runs[i]->get_upper_bound_from(high, low_pos);
+            hints[i] = low_pos;
+            dst.emplace_back(SampleRange{RunId{m_level_no, i}, low_pos, high_pos});
+            rec_cnts.emplace_back(high_pos - low_pos);
+        }
+    }
+
     bool bf_rejection_check(size_t run_stop, const key_t& key) {
         for (size_t i = 0; i < run_stop; ++i) {
-            if (m_structure->m_bfs[i] && m_structure->m_bfs[i]->lookup(key))
+            if (m_bfs[i] && m_bfs[i]->lookup(key))
                 return true;
         }
         return false;
@@ -147,19 +172,29 @@ public:
         if (m_run_cnt == 0) return false;
 
         for (int i = m_run_cnt - 1; i >= (ssize_t) run_stop;  i--) {
-            if (m_structure->m_runs[i] && (m_structure->m_bfs[i]->lookup(key))
-                && m_structure->m_runs[i]->check_tombstone(key, val))
+            if (m_runs[i] && (m_bfs[i]->lookup(key))
+                && m_runs[i]->check_tombstone(key, val))
                 return true;
         }
         return false;
     }
 
-    const record_t* get_record_at(size_t run_no, size_t idx) {
-        return m_structure->m_runs[run_no]->get_record_at(idx);
+    record_t get_record_at(size_t run_no, size_t idx) {
+        return m_runs[run_no]->get_record(idx);
     }
     
     InMemRun* get_run(size_t idx) {
-        return m_structure->m_runs[idx];
+        return m_runs[idx].get();
+    }
+
+    // Returns the runs within this level as an array of raw pointers,
+    // for use by the merge constructors of InMemRun and ISAMTree.
+    std::vector<InMemRun*> get_runs() {
+        std::vector<InMemRun*> runs(m_run_cnt);
+        for (size_t i = 0; i < m_run_cnt; ++i) {
+            runs[i] = m_runs[i].get();
+        }
+        return runs;
     }
 
     size_t get_run_count() {
@@ -169,7 +204,7 @@ public:
     size_t get_record_cnt() {
         size_t cnt = 0;
         for (size_t i=0; i<m_run_cnt; i++) {
-            cnt += m_structure->m_runs[i]->get_record_count();
+            cnt += m_runs[i]->get_record_count();
         }
 
         return cnt;
@@ -178,7 +213,7 @@ public:
     size_t get_tombstone_count() {
         size_t res = 0;
         for (size_t i = 0; i < m_run_cnt; ++i) {
-            res += m_structure->m_runs[i]->get_tombstone_count();
+            res += m_runs[i]->get_tombstone_count();
         }
         return res;
     }
@@ -186,8 +221,8 @@ public:
     size_t get_aux_memory_utilization() {
         size_t cnt = 0;
         for (size_t i=0; i<m_run_cnt; i++) {
-            if (m_structure->m_bfs[i]) {
-                cnt += m_structure->m_bfs[i]->get_memory_utilization();
+            if (m_bfs[i]) {
+                cnt += m_bfs[i]->get_memory_utilization();
             }
         }
 
@@ -197,8 +232,8 @@ public:
     size_t get_memory_utilization() {
         size_t cnt = 0;
         for (size_t i=0; i<m_run_cnt; i++) {
-            if (m_structure->m_runs[i]) {
-                cnt += m_structure->m_runs[i]->get_memory_utilization();
+            if (m_runs[i]) {
+                cnt += m_runs[i]->get_memory_utilization();
             }
         }
 
@@ -209,9 +244,9 @@ public:
         size_t tscnt = 0;
         size_t reccnt = 0;
         for (size_t i=0; i<m_run_cnt; i++) {
-            if (m_structure->m_runs[i]) {
-                tscnt += m_structure->m_runs[i]->get_tombstone_count();
-                reccnt += m_structure->m_runs[i]->get_record_count();
+            if (m_runs[i]) {
+                tscnt += m_runs[i]->get_tombstone_count();
+                reccnt += m_runs[i]->get_record_count();
             }
         }
 
@@ -221,12 +256,12 @@ public:
     void persist_level(std::string meta_fname) {
         FILE *meta_f = fopen(meta_fname.c_str(), "w");
         assert(meta_f);
-        for (size_t i=0; i<m_structure->m_cap; i++) {
-            if (m_structure->m_runs[i]) {
+        for (size_t i=0; i<m_runs.size(); i++) {
+            if (m_runs[i]) {
                 std::string fname = m_directory + "/level" + std::to_string(m_level_no) 
                                      + "_run" + std::to_string(i) + "-0.dat";
-                m_structure->m_runs[i]->persist_to_file(fname);
-                fprintf(meta_f, "memory %s %ld %ld\n", fname.c_str(), m_structure->m_runs[i]->get_record_count(), m_structure->m_runs[i]->get_tombstone_count());
+                m_runs[i]->persist_to_file(fname, m_bfs[i].get());
+                fprintf(meta_f, "memory %s %ld %ld\n", fname.c_str(), m_runs[i]->get_record_count(), m_runs[i]->get_tombstone_count());
             }
         }
         fclose(meta_f);
@@ -237,9 +272,16 @@ private:
     
     size_t m_run_cnt;
     size_t m_run_size_cap;
-    std::shared_ptr<InternalLevelStructure> m_structure;
+
+    // Runs and their tombstone filters are shared between copies of a
+    // level, and are freed once the last level referencing them is.
+    std::vector<std::shared_ptr<InMemRun>> m_runs;
+    std::vector<std::shared_ptr<BloomFilter>> m_bfs;
     std::string m_directory;
     bool m_tagging;
+
+    // The pool the level's runs draw their buffers from, if any.
+    std::shared_ptr<BufferPool> m_pool;
 };
 
 }
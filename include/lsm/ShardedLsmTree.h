@@ -0,0 +1,192 @@
+#pragma once
+
+#include <memory>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "lsm/LsmTree.h"
+
+namespace lsm {
+
+/*
+ * An LSM Tree whose key space is split into a number of disjoint ranges, each
+ * of which is stored in its own, fully independent, LSMTree (with its own
+ * backing directory, memtables and merge thread). Each LSMTree is safe for
+ * concurrent writers, so all operations are passed straight through to the
+ * shard, and writers to the same or to different shards proceed in
+ * parallel.
+ *
+ * Shard i holds the keys in [boundaries[i-1], boundaries[i]), with the first
+ * and last shards being unbounded below and above respectively.
+ */
+class ShardedLSMTree {
+public:
+    ShardedLSMTree(std::string root_dir, const std::vector<key_t> &boundaries, size_t memtable_cap, size_t memtable_bf_sz,
+                   size_t scale_factor, size_t memory_levels, double max_tombstone_prop, gsl_rng *rng)
+    : m_boundaries(boundaries) {
+        assert(std::is_sorted(m_boundaries.begin(), m_boundaries.end()));
+
+        for (size_t i=0; i<=m_boundaries.size(); i++) {
+            std::string shard_dir = root_dir + "/shard-" + std::to_string(i);
+            mkdir(shard_dir.c_str(), 0755);
+
+            // Each shard gets its own rng, as the memtables and levels hold
+            // on to the one they are constructed with.
+            gsl_rng *shard_rng = gsl_rng_alloc(gsl_rng_mt19937);
+            gsl_rng_set(shard_rng, gsl_rng_get(rng));
+            m_rngs.push_back(shard_rng);
+
+            m_shards.emplace_back(new LSMTree(shard_dir, memtable_cap, memtable_bf_sz, scale_factor, memory_levels, max_tombstone_prop, shard_rng));
+        }
+    }
+
+    ~ShardedLSMTree() {
+        m_shards.clear();
+
+        for (auto rng : m_rngs) {
+            gsl_rng_free(rng);
+        }
+    }
+
+    int append(const key_t& key, const value_t& val, bool tombstone, gsl_rng *rng) {
+        size_t idx = this->get_shard_idx(key);
+        return m_shards[idx]->append(key, val, tombstone, rng);
+    }
+
+    int delete_record(const key_t& key, const value_t& val, gsl_rng *rng) {
+        size_t idx = this->get_shard_idx(key);
+        return m_shards[idx]->delete_record(key, val, rng);
+    }
+
+    /*
+     * Draw sample_sz records uniformly at random from among those in the
+     * range [lower_key, upper_key] across all shards. May be called
+     * concurrently with appends.
+     *
+     * Each sampling attempt within a shard draws uniformly from the
+     * candidate records of that shard (all of those in its sample ranges),
+     * and then rejects those that are not valid. So long as the shard for
+     * each attempt is chosen with probability proportional to its number of
+     * candidates, every attempt is a uniform draw over the candidates of the
+     * whole tree, and the accepted samples are uniform over its valid
+     * records. Rejected attempts are redrawn across all of the shards, rather
+     * than within the shard that rejected them, to preserve this.
+     */
+    void range_sample(record_t *sample_set, const key_t& lower_key, const key_t& upper_key, size_t sample_sz, char *buffer, char *utility_buffer, gsl_rng *rng) {
+        if (lower_key > upper_key) return;
+
+        size_t first = this->get_shard_idx(lower_key);
+        size_t last = this->get_shard_idx(upper_key);
+
+        std::vector<SampleState> states(last - first + 1);
+        std::vector<size_t> shard_counts(states.size());
+        size_t total_records = 0;
+
+        for (size_t i=0; i<states.size(); i++) {
+            m_shards[first + i]->prepare_sample_state(states[i], lower_key, upper_key, buffer);
+            shard_counts[i] = states[i].total_records;
+            total_records += shard_counts[i];
+        }
+
+        if (total_records == 0) return;
+
+        std::vector<double> weights(states.size());
+        for (size_t i=0; i<states.size(); i++) {
+            weights[i] = (double) shard_counts[i] / (double) total_records;
+        }
+
+        auto alias = Alias(weights);
+
+        sampling_attempts = 0;
+        sampling_rejections = 0;
+        tombstone_rejections = 0;
+        bounds_rejections = 0;
+        deletion_rejections = 0;
+
+        size_t sample_idx = 0;
+        size_t rejections = sample_sz;
+        std::vector<size_t> shard_samples(states.size(), 0);
+
+        do {
+            for (size_t i=0; i<rejections; i++) {
+                shard_samples[alias.get(rng)]++;
+            }
+
+            rejections = 0;
+            for (size_t i=0; i<states.size(); i++) {
+                if (shard_samples[i] == 0) continue;
+
+                rejections += m_shards[first + i]->sample_pass(states[i], shard_samples[i], sample_set, sample_idx, buffer, utility_buffer, rng);
+                shard_samples[i] = 0;
+            }
+        } while (sample_idx < sample_sz);
+    }
+
+    /*
+     * Block until every shard has completed any in-progress background
+     * merge.
+     */
+    void await_merge() {
+        for (size_t i=0; i<m_shards.size(); i++) {
+            m_shards[i]->await_merge();
+        }
+    }
+
+    size_t get_record_cnt() {
+        size_t cnt = 0;
+        for (size_t i=0; i<m_shards.size(); i++) {
+            cnt += m_shards[i]->get_record_cnt();
+        }
+
+        return cnt;
+    }
+
+    size_t get_tombstone_cnt() {
+        size_t cnt = 0;
+        for (size_t i=0; i<m_shards.size(); i++) {
+            cnt += m_shards[i]->get_tombstone_cnt();
+        }
+
+        return cnt;
+    }
+
+    size_t get_memory_utilization() {
+        size_t cnt = 0;
+        for (size_t i=0; i<m_shards.size(); i++) {
+            cnt += m_shards[i]->get_memory_utilization();
+        }
+
+        return cnt;
+    }
+
+    size_t get_aux_memory_utilization() {
+        size_t cnt = 0;
+        for (size_t i=0; i<m_shards.size(); i++) {
+            cnt += m_shards[i]->get_aux_memory_utilization();
+        }
+
+        return cnt;
+    }
+
+    size_t get_shard_count() {
+        return m_shards.size();
+    }
+
+    LSMTree *get_shard(size_t idx) {
+        return m_shards[idx].get();
+    }
+
+    /*
+     * Returns the index of the shard responsible for key.
+     */
+    size_t get_shard_idx(const key_t& key) {
+        return std::upper_bound(m_boundaries.begin(), m_boundaries.end(), key) - m_boundaries.begin();
+    }
+
+private:
+    std::vector<key_t> m_boundaries;
+    std::vector<std::unique_ptr<LSMTree>> m_shards;
+    std::vector<gsl_rng *> m_rngs;
+};
+
+}
@@ -5,6 +5,7 @@
 #include <cstring>
 
 #include "util/base.h"
+#include "util/hugepage.h"
 
 namespace lsm {
 
@@ -13,23 +14,25 @@ public:
     BitArray(size_t bits): m_bits(bits), m_data(nullptr) {
         if (m_bits > 0) {
             size_t n_bytes = (m_bits >> 3) << 3;
-            m_data = (char*) std::aligned_alloc(CACHELINE_SIZE, CACHELINEALIGN(n_bytes));
+            m_data = (char*) huge_alloc(n_bytes);
             memset(m_data, 0, n_bytes);
         }
     }
 
     ~BitArray() {
-        if (m_data) free(m_data);
+        if (m_data) huge_free(m_data);
     }
 
     bool is_set(size_t bit) {
         if (bit >= m_bits) return false;
-        return m_data[bit >> 3] & (1 << (bit & 7));
+        return __atomic_load_n(&m_data[bit >> 3], __ATOMIC_RELAXED) & (1 << (bit & 7));
     }
 
     int set(size_t bit) {
         if (bit >= m_bits) return 0;
-        m_data[bit >> 3] |= ((char) 1 << (bit & 7));
+        // Atomic, so that concurrent writers setting bits within the same
+        // byte do not lose each other's updates.
+        __atomic_fetch_or(&m_data[bit >> 3], (char) (1 << (bit & 7)), __ATOMIC_RELAXED);
         return 1;
     }
 
@@ -50,6 +53,31 @@ public:
     size_t size() {
         return m_bits;
     }
+
+    /*
+     * Returns the bytes holding the bits of the array, of which there are
+     * (size() + 7) / 8.
+     */
+    const char *data() {
+        return m_data;
+    }
+
+    /*
+     * Replace the contents of the array with bits bits copied from src, as
+     * returned by data().
+     */
+    void load(const char *src, size_t bits) {
+        if (m_data) huge_free(m_data);
+
+        m_bits = bits;
+        m_data = nullptr;
+        if (m_bits > 0) {
+            size_t n_bytes = (m_bits >> 3) << 3;
+            m_data = (char*) huge_alloc(n_bytes);
+            memset(m_data, 0, n_bytes);
+            memcpy(m_data, src, (m_bits + 7) >> 3);
+        }
+    }
     
 private:
     size_t m_bits;
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "util/hugepage.h"
+
+namespace lsm {
+
+// Buffers smaller than this are allocated and freed directly, rather than
+// being pooled.
+static constexpr size_t BUFFER_POOL_MIN_SIZE = HUGE_PAGE_SIZE;
+
+// The most memory that a pool will hold on to for reuse.
+static constexpr size_t BUFFER_POOL_MAX_SIZE = 4ul << 30;
+
+// The number of size classes per doubling of size, which bounds the space
+// wasted by rounding a buffer up to its class at 1 / BUFFER_POOL_CLASS_STEPS
+// of it.
+static constexpr size_t BUFFER_POOL_CLASS_STEPS = 8;
+
+/*
+ * A pool of large buffers, which holds on to those that are released for
+ * reuse by later allocations of a similar size, rather than returning them
+ * to the system. The memory of a pooled buffer is already faulted in, so
+ * reusing it saves both the page faults and the zeroing of fresh pages by
+ * the kernel, but its contents are arbitrary.
+ *
+ * Buffers are grouped into size classes, each allocated at the size of its
+ * class so that it can be reused for any request in that class. Buffers
+ * come from huge_alloc when there are none to reuse.
+ *
+ * All operations are thread-safe.
+ */
+class BufferPool {
+public:
+    BufferPool(size_t max_size=BUFFER_POOL_MAX_SIZE)
+    : m_max_size(max_size), m_pooled_size(0), m_reuse_cnt(0), m_alloc_cnt(0) {}
+
+    ~BufferPool() {
+        for (auto &[cls, buffers] : m_free) {
+            for (auto buf : buffers) {
+                huge_free(buf);
+            }
+        }
+
+        // Any buffers still allocated from the pool are freed directly when
+        // released.
+    }
+
+    /*
+     * Allocate a buffer of at least len bytes, aligned to a cache line.
+     */
+    void *alloc(size_t len) {
+        if (len < BUFFER_POOL_MIN_SIZE) {
+            return huge_alloc(len);
+        }
+
+        size_t cls = size_class(len);
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            auto &buffers = m_free[cls];
+            if (!buffers.empty()) {
+                void *buf = buffers.back();
+                buffers.pop_back();
+                m_pooled_size -= class_size(cls);
+                m_reuse_cnt++;
+                m_allocated[buf] = cls;
+                return buf;
+            }
+        }
+
+        void *buf = huge_alloc(class_size(cls));
+        if (!buf) return nullptr;
+
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_alloc_cnt++;
+        m_allocated[buf] = cls;
+        return buf;
+    }
+
+    /*
+     * Return a buffer allocated from the pool, which is kept for reuse if
+     * the pool has room for it, and freed otherwise.
+     */
+    void release(void *buf) {
+        if (!buf) return;
+
+        std::unique_lock<std::mutex> lock(m_lock);
+        auto it = m_allocated.find(buf);
+        if (it == m_allocated.end()) {
+            lock.unlock();
+            huge_free(buf);
+            return;
+        }
+
+        size_t cls = it->second;
+        m_allocated.erase(it);
+        if (m_pooled_size + class_size(cls) > m_max_size) {
+            lock.unlock();
+            huge_free(buf);
+            return;
+        }
+
+        m_free[cls].push_back(buf);
+        m_pooled_size += class_size(cls);
+    }
+
+    /*
+     * Returns the number of bytes held for reuse.
+     */
+    size_t get_pooled_size() {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_pooled_size;
+    }
+
+    /*
+     * Returns the number of pooled allocations that reused a buffer, and
+     * the number that required a new one.
+     */
+    size_t get_reuse_count() {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_reuse_cnt;
+    }
+
+    size_t get_alloc_count() {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_alloc_cnt;
+    }
+
+private:
+    std::mutex m_lock;
+    size_t m_max_size;
+    size_t m_pooled_size;
+    size_t m_reuse_cnt;
+    size_t m_alloc_cnt;
+
+    // The released buffers of each size class, and the class of each
+    // buffer currently allocated from the pool.
+    std::unordered_map<size_t, std::vector<void*>> m_free;
+    std::unordered_map<void*, size_t> m_allocated;
+
+    /*
+     * The first BUFFER_POOL_CLASS_STEPS classes are successive multiples
+     * of BUFFER_POOL_MIN_SIZE, and after that, BUFFER_POOL_CLASS_STEPS
+     * classes evenly divide each doubling of size, so that every class is
+     * a whole number of huge pages.
+     */
+    static size_t size_class(size_t len) {
+        size_t cls = 0;
+        while (class_size(cls) < len) cls++;
+        return cls;
+    }
+
+    static size_t class_size(size_t cls) {
+        if (cls < BUFFER_POOL_CLASS_STEPS) {
+            return (cls + 1) * BUFFER_POOL_MIN_SIZE;
+        }
+
+        cls -= BUFFER_POOL_CLASS_STEPS;
+        size_t base = (BUFFER_POOL_MIN_SIZE * BUFFER_POOL_CLASS_STEPS) << (cls / BUFFER_POOL_CLASS_STEPS);
+        return base + (base / BUFFER_POOL_CLASS_STEPS) * (cls % BUFFER_POOL_CLASS_STEPS);
+    }
+};
+
+}
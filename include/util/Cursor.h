@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+
 #include "util/base.h"
 #include "util/record.h"
 
@@ -19,6 +21,14 @@ struct Cursor {
 
 static Cursor g_empty_cursor = {0};
 
+/*
+ * Returns the number of records remaining in the cursor's current page or
+ * chunk, including the one it points to.
+ */
+inline size_t cursor_chunk_size(const Cursor &cur) {
+    return std::min<size_t>(cur.end - cur.ptr, cur.rec_cnt - cur.cur_rec_idx);
+}
+
 /*
  * Advance the cursor to the next record. If the cursor is backed by an
  * iterator, will attempt to advance the iterator once the cursor reaches its
@@ -47,6 +57,19 @@ inline bool advance_cursor(Cursor &cur, PagedFileIterator *iter = nullptr) {
     return true;
 }
 
+/*
+ * Advance the cursor past all of the records remaining in its current page
+ * or chunk, once they have been consumed as a block, refilling it from iter
+ * as advance_cursor does.
+ */
+template <typename Iter>
+inline bool advance_cursor_chunk(Cursor &cur, Iter *iter) {
+    size_t cnt = cursor_chunk_size(cur);
+    cur.ptr += cnt - 1;
+    cur.cur_rec_idx += cnt - 1;
+    return advance_cursor(cur, iter);
+}
+
 inline static Cursor *get_next(std::vector<Cursor> &cursors, Cursor *current=&g_empty_cursor) {
     const record_t *min_rec = nullptr;
     Cursor *result = &g_empty_cursor;
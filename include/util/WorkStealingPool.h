@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lsm {
+
+/*
+ * A fixed-size pool of worker threads, each with its own job queue. Jobs are
+ * spread round-robin across the queues on submission. A worker takes jobs
+ * from the front of its own queue, and once that is empty steals from the
+ * others, taking the front job of a victim if it has priority and the back
+ * one otherwise, so that priority jobs are picked up by whichever worker is
+ * free first.
+ *
+ * Priority jobs are queued ahead of all normal ones.
+ */
+class WorkStealingPool {
+public:
+    /*
+     * If init is provided, each worker calls it with its index on starting,
+     * before running any jobs.
+     */
+    WorkStealingPool(size_t thread_cnt, std::function<void(size_t)> init=nullptr)
+    : m_queues(std::max<size_t>(thread_cnt, 1)), m_init(std::move(init)), m_next_queue(0), m_pending(0), m_shutdown(false) {
+        for (size_t i=0; i<m_queues.size(); i++) {
+            m_workers.emplace_back(&WorkStealingPool::worker, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::unique_lock<std::mutex> lock(m_idle_lock);
+            m_shutdown = true;
+        }
+        m_idle_cv.notify_all();
+
+        for (auto &w : m_workers) {
+            w.join();
+        }
+    }
+
+    /*
+     * Queue a job for execution, returning a future which becomes ready
+     * once it has run.
+     */
+    std::future<void> submit(std::function<void()> fn, bool priority=false) {
+        auto task = std::make_shared<std::packaged_task<void()>>(std::move(fn));
+        auto result = task->get_future();
+
+        auto &queue = m_queues[m_next_queue.fetch_add(1) % m_queues.size()];
+        {
+            std::unique_lock<std::mutex> lock(queue.lock);
+            if (priority) {
+                queue.jobs.push_front(Job{[task] { (*task)(); }, true});
+            } else {
+                queue.jobs.push_back(Job{[task] { (*task)(); }, false});
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(m_idle_lock);
+            m_pending++;
+        }
+        m_idle_cv.notify_one();
+
+        return result;
+    }
+
+    size_t get_thread_count() {
+        return m_workers.size();
+    }
+
+private:
+    struct Job {
+        std::function<void()> fn;
+        bool priority;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<Queue> m_queues;
+    std::vector<std::thread> m_workers;
+    std::function<void(size_t)> m_init;
+    std::atomic<size_t> m_next_queue;
+
+    // The number of jobs queued but not yet taken by a worker. Idle workers
+    // sleep on m_idle_cv until this is non-zero.
+    std::mutex m_idle_lock;
+    std::condition_variable m_idle_cv;
+    size_t m_pending;
+    bool m_shutdown;
+
+    bool take_own(size_t idx, Job &job) {
+        auto &queue = m_queues[idx];
+        std::unique_lock<std::mutex> lock(queue.lock);
+        if (queue.jobs.empty()) return false;
+
+        job = std::move(queue.jobs.front());
+        queue.jobs.pop_front();
+        return true;
+    }
+
+    bool steal(size_t idx, Job &job) {
+        for (size_t i=1; i<m_queues.size(); i++) {
+            auto &queue = m_queues[(idx + i) % m_queues.size()];
+            std::unique_lock<std::mutex> lock(queue.lock);
+            if (queue.jobs.empty()) continue;
+
+            if (queue.jobs.front().priority) {
+                job = std::move(queue.jobs.front());
+                queue.jobs.pop_front();
+            } else {
+                job = std::move(queue.jobs.back());
+                queue.jobs.pop_back();
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+    void worker(size_t idx) {
+        if (m_init) {
+            m_init(idx);
+        }
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_idle_lock);
+                m_idle_cv.wait(lock, [&] { return m_pending > 0 || m_shutdown; });
+                if (m_pending == 0) return;
+
+                // Claim one of the pending jobs, which is guaranteed to be
+                // in some queue until it is taken.
+                m_pending--;
+            }
+
+            Job job;
+            while (!take_own(idx, job) && !steal(idx, job))
+                ;
+
+            job.fn();
+        }
+    }
+};
+
+}
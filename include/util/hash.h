@@ -25,6 +25,21 @@ inline uint64_t hash(uint64_t input) {
     return rotr64(local_rand_hash, 43);
 }
 
+/*
+ * Hash a pair of 64-bit values, such as the key and value of a record.
+ * Uses the 64-bit finalizer from MurmurHash3, so that all of the output
+ * bits are well mixed.
+ */
+inline uint64_t hash_pair(uint64_t a, uint64_t b) {
+    uint64_t h = a ^ rotr64(b * 0x9E3779B97F4A7C15ull, 32);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
 inline uint64_t hash_bytes(const char* str, size_t len) {
     uint64_t hashState = len;
 
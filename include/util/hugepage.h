@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "util/base.h"
+
+namespace lsm {
+
+/*
+ * Huge page backed allocation of large buffers. Sampling draws records from
+ * random positions across buffers that may be gigabytes in size, and with
+ * 4 KB pages nearly every draw then misses the TLB. Buffers of at least
+ * HUGE_PAGE_MIN_SIZE are instead mapped directly, rounded up to and aligned
+ * on whole huge pages, and backed by them as selected by LSM_HUGE_PAGES.
+ * Smaller ones come from aligned_alloc. Either kind is released using
+ * huge_free().
+ */
+
+enum class HugePageMode {
+    // Never use huge pages.
+    NONE,
+
+    // Ask for transparent huge pages using madvise. The kernel backs the
+    // buffer with them as they become available, and otherwise uses
+    // normal pages.
+    TRANSPARENT,
+
+    // Map the buffer from the pool of huge pages reserved by the system
+    // (vm.nr_hugepages), falling back to TRANSPARENT if it is exhausted.
+    EXPLICIT
+};
+
+static constexpr HugePageMode LSM_HUGE_PAGES = HugePageMode::TRANSPARENT;
+
+static constexpr size_t HUGE_PAGE_SIZE = 2ul << 20;
+
+// Buffers smaller than this are not worth padding out to a huge page.
+static constexpr size_t HUGE_PAGE_MIN_SIZE = HUGE_PAGE_SIZE;
+
+struct HugePageStats {
+    // The bytes of all of the buffers currently mapped by huge_alloc.
+    size_t mapped_bytes;
+
+    // Of those, the bytes mapped from the reserved pool, and the bytes
+    // that were to be but fell back to transparent huge pages.
+    size_t explicit_bytes;
+    size_t fallback_bytes;
+
+    // The bytes of those buffers that are actually backed by huge pages.
+    size_t huge_page_bytes;
+};
+
+struct HugeMapping {
+    size_t len;
+    bool is_explicit;
+    bool fallback;
+};
+
+/*
+ * The buffers currently mapped by huge_alloc, by address, which may only
+ * be accessed while holding huge_mappings_lock().
+ */
+inline std::unordered_map<uintptr_t, HugeMapping> &huge_mappings() {
+    static std::unordered_map<uintptr_t, HugeMapping> mappings;
+    return mappings;
+}
+
+inline std::mutex &huge_mappings_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
+/*
+ * Map len bytes, aligned on a huge page, for transparent huge pages.
+ * These only back whole, aligned, huge pages, so an extra page is mapped
+ * and the unaligned ends are trimmed.
+ */
+inline void *huge_map_transparent(size_t len) {
+    size_t map_len = len + HUGE_PAGE_SIZE;
+    char *raw = (char *) mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return nullptr;
+
+    char *ptr = (char *) TYPEALIGN(HUGE_PAGE_SIZE, (uintptr_t) raw);
+    if (ptr > raw) munmap(raw, ptr - raw);
+    if (raw + map_len > ptr + len) munmap(ptr + len, (raw + map_len) - (ptr + len));
+
+    madvise(ptr, len, MADV_HUGEPAGE);
+    return ptr;
+}
+
+/*
+ * Allocate len bytes, aligned to align (which may be no more than
+ * HUGE_PAGE_SIZE), backed by huge pages if it is large enough. Unlike
+ * aligned_alloc, len need not be a multiple of align. Returns nullptr if
+ * the memory could not be allocated.
+ */
+inline void *huge_alloc(size_t len, size_t align=CACHELINE_SIZE) {
+    len = std::max<size_t>(len, 1);
+    if (LSM_HUGE_PAGES == HugePageMode::NONE || len < HUGE_PAGE_MIN_SIZE) {
+        return std::aligned_alloc(align, TYPEALIGN(align, len));
+    }
+
+    len = TYPEALIGN(HUGE_PAGE_SIZE, len);
+    HugeMapping mapping{len, false, false};
+
+    void *ptr = nullptr;
+    if (LSM_HUGE_PAGES == HugePageMode::EXPLICIT) {
+        ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr == MAP_FAILED) {
+            ptr = nullptr;
+            mapping.fallback = true;
+        } else {
+            mapping.is_explicit = true;
+        }
+    }
+
+    if (!ptr) {
+        ptr = huge_map_transparent(len);
+        if (!ptr) return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(huge_mappings_lock());
+    huge_mappings()[(uintptr_t) ptr] = mapping;
+    return ptr;
+}
+
+/*
+ * Release memory allocated by huge_alloc.
+ */
+inline void huge_free(void *ptr) {
+    if (!ptr) return;
+
+    std::unique_lock<std::mutex> lock(huge_mappings_lock());
+    auto &mappings = huge_mappings();
+    auto it = mappings.find((uintptr_t) ptr);
+    if (it == mappings.end()) {
+        lock.unlock();
+        free(ptr);
+        return;
+    }
+
+    size_t len = it->second.len;
+    mappings.erase(it);
+    lock.unlock();
+
+    munmap(ptr, len);
+}
+
+/*
+ * Returns the current totals of the buffers mapped by huge_alloc. The
+ * bytes on transparent huge pages are read from /proc/self/smaps, so this
+ * is not cheap, and is meant for reporting.
+ */
+inline HugePageStats huge_page_stats() {
+    HugePageStats stats = {};
+    std::vector<std::pair<uintptr_t, uintptr_t>> transparent;
+    {
+        std::unique_lock<std::mutex> lock(huge_mappings_lock());
+        for (auto &[addr, mapping] : huge_mappings()) {
+            stats.mapped_bytes += mapping.len;
+            if (mapping.is_explicit) {
+                stats.explicit_bytes += mapping.len;
+            } else {
+                transparent.push_back({addr, addr + mapping.len});
+            }
+
+            if (mapping.fallback) {
+                stats.fallback_bytes += mapping.len;
+            }
+        }
+    }
+
+    // Explicit huge pages are reserved when they are mapped.
+    stats.huge_page_bytes = stats.explicit_bytes;
+
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) return stats;
+
+    // Adjacent buffers may be merged into a single area, or one with other
+    // memory, so each area's huge pages are counted only up to the number
+    // of bytes of it that belong to the buffers.
+    char line[512];
+    size_t overlap = 0;
+    while (fgets(line, sizeof(line), f)) {
+        uintptr_t start, end;
+        size_t kb;
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2) {
+            overlap = 0;
+            for (auto &[lo, hi] : transparent) {
+                if (lo < end && hi > start) {
+                    overlap += std::min(hi, end) - std::max(lo, start);
+                }
+            }
+        } else if (overlap > 0 && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            stats.huge_page_bytes += std::min(kb << 10, overlap);
+        }
+    }
+
+    fclose(f);
+    return stats;
+}
+
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "util/base.h"
+#include "util/hugepage.h"
+
+namespace lsm {
+
+/*
+ * NUMA placement helpers. These are implemented directly on top of the
+ * mbind, getcpu and sched_setaffinity system calls and the node topology
+ * exported in sysfs, rather than libnuma, which is not otherwise a
+ * dependency. All of them degrade to no-ops on single-node machines, or
+ * where the calls are unavailable.
+ */
+
+// True to place in-memory runs on specific NUMA nodes, and to draw the
+// samples from each run on worker threads local to its node.
+static constexpr bool LSM_NUMA_AWARE = false;
+
+// Runs at least this large (in bytes) are interleaved across all nodes
+// rather than being placed on a single one, so that no one node has to
+// serve all of the accesses to them.
+static constexpr size_t NUMA_INTERLEAVE_MIN_SIZE = 256ul << 20;
+
+// Allocations to be placed with mbind are aligned and padded to this, the
+// smallest unit that placement applies to.
+static constexpr size_t NUMA_PAGE_SIZE = 4096;
+
+// The largest number of nodes supported, limited by the single word
+// node masks used below.
+static constexpr size_t NUMA_MAX_NODES = 64;
+
+// The node field of allocations that are not placed on any single node.
+static constexpr int NUMA_NO_NODE = -1;
+
+/*
+ * Parse a sysfs cpu or node list (e.g. "0-3,8,10-11") into its members.
+ */
+inline std::vector<size_t> numa_parse_list(const std::string &fname) {
+    std::vector<size_t> members;
+
+    FILE *f = fopen(fname.c_str(), "r");
+    if (!f) return members;
+
+    size_t lo, hi;
+    while (fscanf(f, "%zu", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%zu", &hi) != 1) break;
+            c = fgetc(f);
+        }
+
+        for (size_t i=lo; i<=hi; i++) members.push_back(i);
+        if (c != ',') break;
+    }
+
+    fclose(f);
+    return members;
+}
+
+/*
+ * Returns the number of NUMA nodes available, which is always at least 1.
+ */
+inline size_t numa_node_count() {
+    static size_t node_cnt = [] {
+        auto nodes = numa_parse_list("/sys/devices/system/node/online");
+        size_t cnt = (nodes.empty()) ? 1 : nodes.back() + 1;
+        return std::min(cnt, NUMA_MAX_NODES);
+    }();
+
+    return node_cnt;
+}
+
+/*
+ * Returns the node of the CPU the calling thread is running on.
+ */
+inline int numa_current_node() {
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return 0;
+    }
+
+    return node;
+}
+
+/*
+ * Returns the node on which to place the next run, cycling through all of
+ * the nodes so that runs are spread evenly between them.
+ */
+inline int numa_next_node() {
+    static std::atomic<size_t> next_node{0};
+    return next_node.fetch_add(1) % numa_node_count();
+}
+
+/*
+ * Restrict the calling thread to the CPUs of the specified node. Returns
+ * false if this could not be done.
+ */
+inline bool numa_pin_thread(int node) {
+    auto cpus = numa_parse_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    if (cpus.empty()) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+/*
+ * Returns true if numa_alloc draws an allocation of len bytes from
+ * huge_alloc, rather than mapping it itself.
+ */
+inline bool numa_uses_huge_alloc(size_t len) {
+    return LSM_HUGE_PAGES != HugePageMode::NONE && len >= HUGE_PAGE_MIN_SIZE;
+}
+
+/*
+ * Allocate len bytes of memory, placed on the specified node, or
+ * interleaved across all nodes for NUMA_NO_NODE. Placement applies to
+ * whole pages, so the memory is always a fresh mapping of its own: large
+ * allocations come from huge_alloc, and smaller ones, which huge_alloc
+ * would take from the heap, are mapped here in whole pages. The policy is
+ * set before the memory is first touched, so nothing has to be migrated.
+ * The memory is released using numa_free(), with the same len.
+ */
+inline void *numa_alloc(size_t len, int node) {
+    len = TYPEALIGN(NUMA_PAGE_SIZE, std::max<size_t>(len, 1));
+
+    void *ptr;
+    if (numa_uses_huge_alloc(len)) {
+        ptr = huge_alloc(len, NUMA_PAGE_SIZE);
+    } else {
+        ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) ptr = nullptr;
+    }
+
+    if (!ptr || numa_node_count() < 2) return ptr;
+
+    unsigned long mask;
+    int mode;
+    if (node == NUMA_NO_NODE) {
+        mask = (numa_node_count() == NUMA_MAX_NODES) ? ~0ul : (1ul << numa_node_count()) - 1;
+        mode = MPOL_INTERLEAVE;
+    } else {
+        mask = 1ul << node;
+        mode = MPOL_PREFERRED;
+    }
+
+    // A node is only preferred rather than required, and a failure here
+    // only costs locality, so it is ignored.
+    syscall(SYS_mbind, ptr, len, mode, &mask, NUMA_MAX_NODES + 1, 0);
+    return ptr;
+}
+
+/*
+ * Release len bytes of memory allocated by numa_alloc.
+ */
+inline void numa_free(void *ptr, size_t len) {
+    if (!ptr) return;
+
+    len = TYPEALIGN(NUMA_PAGE_SIZE, std::max<size_t>(len, 1));
+    if (numa_uses_huge_alloc(len)) {
+        huge_free(ptr);
+    } else {
+        munmap(ptr, len);
+    }
+}
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include "util/record.h"
+
+namespace lsm {
+
+// Inputs smaller than this are sorted using std::sort directly, for which
+// the fixed cost of the histogram pass outweighs any benefit.
+const size_t RADIX_SORT_MIN_SIZE = 4096;
+
+// The number of key bits used to distribute records into buckets.
+const size_t RADIX_SORT_BITS = 12;
+const size_t RADIX_SORT_BUCKETS = 1 << RADIX_SORT_BITS;
+
+// The minimum number of records that each thread must be given before a
+// sort will be split across multiple threads.
+const size_t RADIX_SORT_MIN_PER_THREAD = 1 << 16;
+
+/*
+ * Sort n records into memtable_record_cmp order, using tmp as scratch
+ * space, which must be at least n records long. The sorted records may end
+ * up in either buffer, and a pointer to whichever of data or tmp holds
+ * them is returned.
+ *
+ * This is an MSD radix sort. The records are first scattered into buckets
+ * on the most significant bits of the key that are not the same across
+ * all records, and then each bucket, which will usually be small enough to
+ * fit in cache, is sorted with std::sort. Up to thread_cnt threads will be
+ * used, subject to each being given at least RADIX_SORT_MIN_PER_THREAD
+ * records.
+ */
+inline record_t *radix_sort(record_t *data, record_t *tmp, size_t n, size_t thread_cnt=1) {
+    if (n < RADIX_SORT_MIN_SIZE) {
+        std::sort(data, data + n, memtable_record_cmp);
+        return data;
+    }
+
+    thread_cnt = std::max<size_t>(1, std::min(thread_cnt, n / RADIX_SORT_MIN_PER_THREAD));
+    size_t chunk = (n + thread_cnt - 1) / thread_cnt;
+    auto chunk_start = [&](size_t t) { return std::min(t * chunk, n); };
+
+    auto run = [&](auto fn) {
+        if (thread_cnt == 1) {
+            fn(0);
+            return;
+        }
+
+        std::vector<std::thread> workers(thread_cnt);
+        for (size_t t=0; t<thread_cnt; t++) {
+            workers[t] = std::thread(fn, t);
+        }
+
+        for (size_t t=0; t<thread_cnt; t++) {
+            workers[t].join();
+        }
+    };
+
+    // Find the highest key bit that differs between any two records, by
+    // ORing together the XOR of every key with the first.
+    std::vector<key_t> diffs(thread_cnt, 0);
+    run([&](size_t t) {
+        key_t diff = 0;
+        for (size_t i=chunk_start(t); i<chunk_start(t + 1); i++) {
+            diff |= data[i].key ^ data[0].key;
+        }
+        diffs[t] = diff;
+    });
+
+    key_t diff = 0;
+    for (auto d : diffs) diff |= d;
+
+    // All of the keys are equal, so there's nothing to bucket on.
+    if (diff == 0) {
+        std::sort(data, data + n, memtable_record_cmp);
+        return data;
+    }
+
+    size_t diff_bits = 64 - __builtin_clzll(diff);
+    size_t shift = (diff_bits > RADIX_SORT_BITS) ? diff_bits - RADIX_SORT_BITS : 0;
+    auto bucket = [&](const record_t &rec) { return (rec.key >> shift) & (RADIX_SORT_BUCKETS - 1); };
+
+    std::vector<size_t> counts(thread_cnt * RADIX_SORT_BUCKETS, 0);
+    run([&](size_t t) {
+        size_t *cnt = counts.data() + t * RADIX_SORT_BUCKETS;
+        for (size_t i=chunk_start(t); i<chunk_start(t + 1); i++) {
+            cnt[bucket(data[i])]++;
+        }
+    });
+
+    // Convert the counts into per-thread starting offsets for each bucket,
+    // and note where each bucket starts in the output.
+    std::vector<size_t> bucket_start(RADIX_SORT_BUCKETS + 1);
+    size_t offset = 0;
+    for (size_t b=0; b<RADIX_SORT_BUCKETS; b++) {
+        bucket_start[b] = offset;
+        for (size_t t=0; t<thread_cnt; t++) {
+            size_t cnt = counts[t * RADIX_SORT_BUCKETS + b];
+            counts[t * RADIX_SORT_BUCKETS + b] = offset;
+            offset += cnt;
+        }
+    }
+    bucket_start[RADIX_SORT_BUCKETS] = n;
+
+    run([&](size_t t) {
+        size_t *off = counts.data() + t * RADIX_SORT_BUCKETS;
+        for (size_t i=chunk_start(t); i<chunk_start(t + 1); i++) {
+            tmp[off[bucket(data[i])]++] = data[i];
+        }
+    });
+
+    // Sort the buckets, splitting them between the threads so that each
+    // gets a contiguous range of roughly the same number of records.
+    run([&](size_t t) {
+        size_t b = std::upper_bound(bucket_start.begin(), bucket_start.end(), chunk_start(t)) - bucket_start.begin() - 1;
+        for (; b<RADIX_SORT_BUCKETS && bucket_start[b] < chunk_start(t + 1); b++) {
+            if (t > 0 && bucket_start[b] < chunk_start(t)) continue;
+            std::sort(tmp + bucket_start[b], tmp + bucket_start[b + 1], memtable_record_cmp);
+        }
+    });
+
+    return tmp;
+}
+
+}
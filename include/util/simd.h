@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdlib>
+
+namespace lsm {
+
+/*
+ * Runtime selection of SIMD code paths. Kernels that use wider instruction
+ * sets are compiled with function-level target attributes, rather than
+ * by raising the target of the whole build, and are only called once the
+ * running CPU is known to support them, so the same binary runs anywhere.
+ */
+
+// False to always use the portable scalar code paths.
+static constexpr bool LSM_USE_SIMD = true;
+
+enum class SIMDLevel {
+    SCALAR,
+    AVX2,
+    AVX512
+};
+
+/*
+ * Returns the widest instruction set supported by the running CPU, or
+ * SIMDLevel::SCALAR if LSM_USE_SIMD is false.
+ */
+inline SIMDLevel simd_level() {
+    static const SIMDLevel level = [] {
+        if (!LSM_USE_SIMD) return SIMDLevel::SCALAR;
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return SIMDLevel::AVX512;
+        if (__builtin_cpu_supports("avx2")) return SIMDLevel::AVX2;
+#endif
+        return SIMDLevel::SCALAR;
+    }();
+
+    return level;
+}
+
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "util/record.h"
+#include "util/simd.h"
+
+namespace lsm {
+
+/*
+ * Two-way merging of sorted key arrays. Rather than moving the records
+ * themselves, the merge writes out, for each position of the result, where
+ * the key at that position came from: its index in the first input, or its
+ * index in the second with MERGE_FROM_B set. Keys that are equal between
+ * the inputs are output in no particular order, and it is up to the caller
+ * to order their records as it requires.
+ *
+ * The keys of each input are read every stride keys, so that those of an
+ * array of records can be merged in place, without copying them out.
+ */
+
+// Set in the positions written by merge_keys of keys from the second input.
+static constexpr uint64_t MERGE_FROM_B = 1ull << 63;
+
+/*
+ * Merge the remainders of the inputs from a[i] and b[j] one key at a time,
+ * along with up to 4 sorted keys, hk, held over from a vectorized merge,
+ * which are no smaller than any key already written.
+ */
+inline void merge_keys_scalar(const key_t *a, size_t na, size_t a_stride, size_t i,
+                              const key_t *b, size_t nb, size_t b_stride, size_t j,
+                              uint64_t *out, const key_t *hk=nullptr, const uint64_t *hp=nullptr, size_t hn=0) {
+    size_t h = 0;
+    while (h < hn || i < na || j < nb) {
+        if (h < hn && (i >= na || hk[h] <= a[i * a_stride]) && (j >= nb || hk[h] <= b[j * b_stride])) {
+            *out++ = hp[h++];
+        } else if (i < na && (j >= nb || a[i * a_stride] <= b[j * b_stride])) {
+            *out++ = i++;
+        } else {
+            *out++ = MERGE_FROM_B | j++;
+        }
+    }
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+/*
+ * Load the 4 keys starting at keys, stride keys apart, as signed values.
+ */
+__attribute__((target("avx2")))
+inline __m256i load_keys_avx2(const key_t *keys, size_t stride, __m256i offsets) {
+    const __m256i bias = _mm256_set1_epi64x(0x8000000000000000ll);
+    __m256i k = (stride == 1) ? _mm256_loadu_si256((const __m256i *) keys)
+                              : _mm256_i64gather_epi64((const long long *) keys, offsets, sizeof(key_t));
+    return _mm256_xor_si256(k, bias);
+}
+
+/*
+ * Sort a bitonic sequence of 4 keys, and their positions alongside them,
+ * comparing the lanes two apart and then adjacent lanes. Each lane decides
+ * for itself whether to take its partner's key, which it does only if the
+ * partner's is strictly smaller (for the lower lane of a pair) or larger
+ * (for the upper), so that equal keys never both take the same position.
+ */
+__attribute__((target("avx2")))
+inline void bitonic_clean_avx2(__m256i &k, __m256i &p) {
+    __m256i sk = _mm256_permute4x64_epi64(k, 0x4E);
+    __m256i sp = _mm256_permute4x64_epi64(p, 0x4E);
+    __m256i swap = _mm256_blend_epi32(_mm256_cmpgt_epi64(k, sk), _mm256_cmpgt_epi64(sk, k), 0xF0);
+    k = _mm256_blendv_epi8(k, sk, swap);
+    p = _mm256_blendv_epi8(p, sp, swap);
+
+    sk = _mm256_permute4x64_epi64(k, 0xB1);
+    sp = _mm256_permute4x64_epi64(p, 0xB1);
+    swap = _mm256_blend_epi32(_mm256_cmpgt_epi64(k, sk), _mm256_cmpgt_epi64(sk, k), 0xCC);
+    k = _mm256_blendv_epi8(k, sk, swap);
+    p = _mm256_blendv_epi8(p, sp, swap);
+}
+
+/*
+ * Merge two sorted vectors of 4 keys, lo and hi, with their positions,
+ * leaving the smallest 4 in lo and the largest 4 in hi, each sorted.
+ * Reversing hi makes the 8 keys a bitonic sequence, which one round of
+ * pairwise minimums and maximums splits into two bitonic halves.
+ */
+__attribute__((target("avx2")))
+inline void bitonic_merge_avx2(__m256i &lo_k, __m256i &lo_p, __m256i &hi_k, __m256i &hi_p) {
+    __m256i rk = _mm256_permute4x64_epi64(hi_k, 0x1B);
+    __m256i rp = _mm256_permute4x64_epi64(hi_p, 0x1B);
+    __m256i gt = _mm256_cmpgt_epi64(lo_k, rk);
+
+    hi_k = _mm256_blendv_epi8(rk, lo_k, gt);
+    hi_p = _mm256_blendv_epi8(rp, lo_p, gt);
+    lo_k = _mm256_blendv_epi8(lo_k, rk, gt);
+    lo_p = _mm256_blendv_epi8(lo_p, rp, gt);
+
+    bitonic_clean_avx2(lo_k, lo_p);
+    bitonic_clean_avx2(hi_k, hi_p);
+}
+
+/*
+ * Merge the inputs 4 keys at a time. The largest 4 keys of each step are
+ * held over and merged with the next 4 of whichever input's next key is
+ * smaller, so that the smallest 4 can always be written out. Once either
+ * input has fewer than 4 keys left, the rest are merged one at a time.
+ */
+__attribute__((target("avx2")))
+inline void merge_keys_avx2(const key_t *a, size_t na, size_t a_stride, const key_t *b, size_t nb, size_t b_stride, uint64_t *out) {
+    if (na < 4 || nb < 4) {
+        merge_keys_scalar(a, na, a_stride, 0, b, nb, b_stride, 0, out);
+        return;
+    }
+
+    // AVX2 only has a signed 64-bit comparison, so flip the sign bits.
+    const __m256i bias = _mm256_set1_epi64x(0x8000000000000000ll);
+    const __m256i lanes = _mm256_set_epi64x(3, 2, 1, 0);
+    const __m256i a_offsets = _mm256_mul_epu32(lanes, _mm256_set1_epi64x(a_stride));
+    const __m256i b_offsets = _mm256_mul_epu32(lanes, _mm256_set1_epi64x(b_stride));
+
+    __m256i lo_k = load_keys_avx2(a, a_stride, a_offsets);
+    __m256i lo_p = lanes;
+    __m256i hi_k = load_keys_avx2(b, b_stride, b_offsets);
+    __m256i hi_p = _mm256_or_si256(lanes, _mm256_set1_epi64x(MERGE_FROM_B));
+    size_t i = 4, j = 4;
+
+    while (true) {
+        bitonic_merge_avx2(lo_k, lo_p, hi_k, hi_p);
+        _mm256_storeu_si256((__m256i *) out, lo_p);
+        out += 4;
+
+        if (i + 4 > na || j + 4 > nb) break;
+
+        if (a[i * a_stride] <= b[j * b_stride]) {
+            lo_k = load_keys_avx2(a + i * a_stride, a_stride, a_offsets);
+            lo_p = _mm256_add_epi64(lanes, _mm256_set1_epi64x(i));
+            i += 4;
+        } else {
+            lo_k = load_keys_avx2(b + j * b_stride, b_stride, b_offsets);
+            lo_p = _mm256_add_epi64(lanes, _mm256_set1_epi64x(MERGE_FROM_B | j));
+            j += 4;
+        }
+    }
+
+    alignas(32) key_t hk[4];
+    alignas(32) uint64_t hp[4];
+    _mm256_store_si256((__m256i *) hk, _mm256_xor_si256(hi_k, bias));
+    _mm256_store_si256((__m256i *) hp, hi_p);
+
+    merge_keys_scalar(a, na, a_stride, i, b, nb, b_stride, j, out, hk, hp, 4);
+}
+#endif
+
+/*
+ * Merge the na sorted keys of a and the nb of b, writing the position of
+ * each key of the result to out, which must have room for na + nb.
+ */
+inline void merge_keys(const key_t *a, size_t na, size_t a_stride, const key_t *b, size_t nb, size_t b_stride, uint64_t *out) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    if (simd_level() != SIMDLevel::SCALAR) {
+        merge_keys_avx2(a, na, a_stride, b, nb, b_stride, out);
+        return;
+    }
+#endif
+    merge_keys_scalar(a, na, a_stride, 0, b, nb, b_stride, 0, out);
+}
+
+}
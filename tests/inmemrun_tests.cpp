@@ -1,4 +1,7 @@
 #include <check.h>
+#include <algorithm>
+#include <random>
+#include <vector>
 
 #include "lsm/InMemRun.h"
 #include "lsm/MemoryLevel.h"
@@ -129,6 +132,143 @@ START_TEST(t_inmemrun_init)
     delete run4;
 }
 
+START_TEST(t_kway_merge)
+{
+    // Seven inputs, so that the merge tree is not full, with many equal
+    // keys between them, and tombstones for some of their records in the
+    // last one.
+    size_t n = 3000;
+    size_t k = 7;
+    std::vector<MemTable*> mtables;
+    std::vector<record_t> expected;
+    auto ts_mtable = new MemTable(n, true, n, g_rng);
+
+    for (size_t i=0; i<k - 1; i++) {
+        auto mtable = new MemTable(n, true, 0, g_rng);
+        for (size_t j=0; j<n; j++) {
+            lsm::key_t key = rand() % 1000;
+            lsm::value_t val = i * n + j;
+            mtable->append(key, val);
+
+            if (rand() % 4 == 0 && ts_mtable->get_record_count() < n) {
+                ts_mtable->append(key, val, true);
+            } else {
+                expected.push_back({key, val, 0});
+            }
+        }
+        mtables.push_back(mtable);
+    }
+    mtables.push_back(ts_mtable);
+    std::sort(expected.begin(), expected.end());
+
+    BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+    std::vector<InMemRun*> runs;
+    for (auto mtable : mtables) {
+        runs.push_back(new InMemRun(mtable, bf, false));
+    }
+
+    auto merged = new InMemRun(runs.data(), k, bf, false);
+    ck_assert_int_eq(merged->get_record_count(), expected.size());
+    ck_assert_int_eq(merged->get_tombstone_count(), 0);
+    for (size_t i=0; i<expected.size(); i++) {
+        auto rec = merged->get_record_at(i);
+        ck_assert_int_eq(rec->key, expected[i].key);
+        ck_assert_int_eq(rec->value, expected[i].value);
+        ck_assert(!rec->is_tombstone());
+    }
+
+    delete merged;
+    for (auto run : runs) delete run;
+    for (auto mtable : mtables) delete mtable;
+    delete bf;
+}
+END_TEST
+
+
+START_TEST(t_two_way_merge)
+{
+    // Two inputs, as in a leveling merge, with many equal keys between
+    // them, tombstones for some of the records of the first in the second,
+    // and one tombstone in the first that has nothing to cancel. The
+    // second has a count that is not a multiple of the vector width.
+    size_t n = 5001;
+    for (auto layout : {RecordLayout::ROW, RecordLayout::COLUMNAR, RecordLayout::COMPRESSED}) {
+        auto mtable = new MemTable(n, true, 1, g_rng);
+        auto ts_mtable = new MemTable(n, true, n, g_rng);
+        std::vector<record_t> expected;
+
+        for (size_t j=0; j<n - 1; j++) {
+            lsm::key_t key = rand() % 500;
+            lsm::value_t val = j;
+            mtable->append(key, val);
+
+            if (rand() % 3 == 0) {
+                ts_mtable->append(key, val, true);
+            } else {
+                expected.push_back({key, val, 0});
+            }
+        }
+
+        while (ts_mtable->get_record_count() < n - 1) {
+            lsm::key_t key = rand() % 500;
+            lsm::value_t val = n + ts_mtable->get_record_count();
+            ts_mtable->append(key, val);
+            expected.push_back({key, val, 0});
+        }
+
+        // Its record comes from the later input, and so is not canceled.
+        mtable->append(7, 2 * n, true);
+        ts_mtable->append(7, 2 * n);
+        expected.push_back({7, 2 * n, 1});
+        expected.push_back({7, 2 * n, 0});
+        std::stable_sort(expected.begin(), expected.end());
+
+        BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+        InMemRun* runs[] = {new InMemRun(mtable, bf, false, false, layout),
+                            new InMemRun(ts_mtable, bf, false, false, layout)};
+
+        auto merged = new InMemRun(runs, 2, bf, false, false, layout);
+        ck_assert_int_eq(merged->get_record_count(), expected.size());
+        ck_assert_int_eq(merged->get_tombstone_count(), 1);
+        for (size_t i=0; i<expected.size(); i++) {
+            auto rec = merged->get_record(i);
+            ck_assert_int_eq(rec.key, expected[i].key);
+            ck_assert_int_eq(rec.value, expected[i].value);
+            ck_assert_int_eq(rec.is_tombstone(), expected[i].is_tombstone());
+        }
+
+        ck_assert(merged->check_tombstone(7, 2 * n));
+
+        delete merged;
+        for (auto run : runs) delete run;
+        delete mtable;
+        delete ts_mtable;
+        delete bf;
+    }
+
+    // Each of the equal records is canceled by one of the equal tombstones
+    // of the other input, and not by the next record of its own.
+    auto mtable = new MemTable(8, true, 0, g_rng);
+    auto ts_mtable = new MemTable(8, true, 8, g_rng);
+    for (size_t i=0; i<8; i++) {
+        mtable->append(5, 5);
+        ts_mtable->append(5, 5, true);
+    }
+
+    BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+    InMemRun* runs[] = {new InMemRun(mtable, bf, false), new InMemRun(ts_mtable, bf, false)};
+    auto merged = new InMemRun(runs, 2, bf, false);
+    ck_assert_int_eq(merged->get_record_count(), 0);
+
+    delete merged;
+    for (auto run : runs) delete run;
+    delete mtable;
+    delete ts_mtable;
+    delete bf;
+}
+END_TEST
+
+
 START_TEST(t_get_lower_bound_index)
 {
     size_t n = 10000;
@@ -143,7 +283,7 @@ START_TEST(t_get_lower_bound_index)
 
     auto tbl_records = memtable->sorted_output();
     for (size_t i=0; i<n; i++) {
-        const record_t *tbl_rec = memtable->get_record_at(i);
+        const record_t *tbl_rec = tbl_records + i;
         auto pos = run->get_lower_bound(tbl_rec->key);
         ck_assert_int_eq(run->get_record_at(pos)->key, tbl_rec->key);
         ck_assert_int_le(pos, i);
@@ -168,7 +308,7 @@ START_TEST(t_get_upper_bound_index)
 
     auto tbl_records = memtable->sorted_output();
     for (size_t i=0; i<n; i++) {
-        const record_t *tbl_rec = memtable->get_record_at(i);
+        const record_t *tbl_rec = tbl_records + i;
         auto pos = run->get_upper_bound(tbl_rec->key);
         ck_assert(pos == run->get_record_count() ||
                   run->get_record_at(pos)->key > tbl_rec->key);
@@ -181,6 +321,230 @@ START_TEST(t_get_upper_bound_index)
 }
 
 
+START_TEST(t_galloping_bounds)
+{
+    size_t n = 10000;
+    auto memtable = create_test_memtable(n);
+
+    ck_assert_ptr_nonnull(memtable);
+    BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+    InMemRun* run = new InMemRun(memtable, bf, false);
+
+    // Search for a sorted sequence of keys, each galloping from the
+    // previous lower bound, and compare against the tree searches.
+    std::vector<lsm::key_t> keys(1000);
+    for (auto &key : keys) key = rand();
+    std::sort(keys.begin(), keys.end());
+
+    size_t hint = 0;
+    for (auto key : keys) {
+        auto lower = run->get_lower_bound_from(key, hint);
+        ck_assert_int_eq(lower, run->get_lower_bound(key));
+        ck_assert_int_eq(run->get_upper_bound_from(key, lower), run->get_upper_bound(key));
+        ck_assert_int_eq(run->get_upper_bound_from(key + 1000, lower), run->get_upper_bound(key + 1000));
+        hint = lower;
+    }
+
+    delete memtable;
+    delete bf;
+    delete run;
+}
+END_TEST
+
+
+START_TEST(t_node_search)
+{
+    // Each SIMD kernel supported by this CPU must agree with the scalar one,
+    // including around the sentinel and for duplicate keys.
+    lsm::key_t keys[inmem_isam_fanout];
+    for (size_t trial=0; trial<1000; trial++) {
+        size_t real = 1 + rand() % inmem_isam_fanout;
+        for (size_t i=0; i<inmem_isam_fanout; i++) {
+            keys[i] = (i < real) ? rand() % 64 : INMEM_ISAM_KEY_SENTINEL;
+        }
+        std::sort(keys, keys + inmem_isam_fanout);
+
+        for (lsm::key_t key : {(lsm::key_t) (rand() % 70), (lsm::key_t) 0, INMEM_ISAM_KEY_SENTINEL}) {
+            size_t lower = inmem_isam_count_scalar<false>(keys, key);
+            size_t upper = inmem_isam_count_scalar<true>(keys, key);
+            ck_assert_int_eq(lower, std::lower_bound(keys, keys + inmem_isam_fanout, key) - keys);
+            ck_assert_int_eq(upper, std::upper_bound(keys, keys + inmem_isam_fanout, key) - keys);
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+            if (__builtin_cpu_supports("avx2")) {
+                ck_assert_int_eq(inmem_isam_count_avx2<false>(keys, key), lower);
+                ck_assert_int_eq(inmem_isam_count_avx2<true>(keys, key), upper);
+            }
+            if (__builtin_cpu_supports("avx512f")) {
+                ck_assert_int_eq(inmem_isam_count_avx512<false>(keys, key), lower);
+                ck_assert_int_eq(inmem_isam_count_avx512<true>(keys, key), upper);
+            }
+#endif
+        }
+    }
+}
+END_TEST
+
+
+START_TEST(t_get_bounds)
+{
+    size_t n = 10000;
+    auto memtable = create_double_seq_memtable(n);
+
+    BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+    InMemRun* run = new InMemRun(memtable, bf, false);
+
+    auto data = run->sorted_output();
+    auto end = data + run->get_record_count();
+    auto lt = [](const record_t &rec, lsm::key_t key) { return rec.key < key; };
+    auto gt = [](lsm::key_t key, const record_t &rec) { return key < rec.key; };
+
+    std::vector<lsm::key_t> keys = {0, n / 2 - 1, n / 2, n, INMEM_ISAM_KEY_SENTINEL};
+    for (size_t i=0; i<1000; i++) keys.push_back(rand() % (n / 2));
+
+    for (auto low : keys) {
+        lsm::key_t high = (low > INMEM_ISAM_KEY_SENTINEL - 100) ? low : low + rand() % 100;
+
+        size_t lower = std::lower_bound(data, end, low, lt) - data;
+        size_t upper = std::upper_bound(data, end, high, gt) - data;
+        ck_assert_int_eq(run->get_lower_bound(low), lower);
+        ck_assert_int_eq(run->get_upper_bound(high), upper);
+
+        auto bounds = run->get_bounds(low, high);
+        ck_assert_int_eq(bounds.first, lower);
+        ck_assert_int_eq(bounds.second, upper);
+    }
+
+    delete memtable;
+    delete bf;
+    delete run;
+}
+END_TEST
+
+
+START_TEST(t_learned_index)
+{
+    size_t n = 10000;
+
+    // Random keys, keys with duplicates, and a heavily skewed distribution
+    // where most keys are packed into a small part of the key space.
+    std::vector<MemTable*> memtables = {create_test_memtable(n), create_double_seq_memtable(n),
+                                        new MemTable(n, true, 0, g_rng)};
+    for (size_t i=0; i<n; i++) {
+        lsm::key_t key = (i % 10 == 0) ? (lsm::key_t) rand() << 20 : rand() % 1000;
+        memtables[2]->append(key, i);
+    }
+
+    auto lt = [](const record_t &rec, lsm::key_t key) { return rec.key < key; };
+    auto gt = [](lsm::key_t key, const record_t &rec) { return key < rec.key; };
+
+    for (auto memtable : memtables) {
+        BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+        InMemRun* tree_run = new InMemRun(memtable, bf, false, false);
+        InMemRun* run = new InMemRun(memtable, bf, false, true);
+        ck_assert(run->has_learned_index());
+        ck_assert_int_eq(run->get_record_count(), tree_run->get_record_count());
+
+        // A merged run should be built with a learned index as well.
+        InMemRun* runs[2] = {run, tree_run};
+        InMemRun* merged = new InMemRun(runs, 2, bf, false, true);
+        ck_assert(merged->has_learned_index());
+
+        for (auto r : {run, merged}) {
+            auto data = r->sorted_output();
+            auto end = data + r->get_record_count();
+
+            std::vector<lsm::key_t> keys = {0, data[0].key, (end - 1)->key, (end - 1)->key + 1, INMEM_ISAM_KEY_SENTINEL};
+            for (size_t i=0; i<1000; i++) {
+                keys.push_back(data[rand() % r->get_record_count()].key);
+                keys.push_back(rand());
+            }
+
+            for (auto key : keys) {
+                size_t lower = std::lower_bound(data, end, key, lt) - data;
+                size_t upper = std::upper_bound(data, end, key, gt) - data;
+                ck_assert_int_eq(r->get_lower_bound(key), lower);
+                ck_assert_int_eq(r->get_upper_bound(key), upper);
+
+                auto bounds = r->get_bounds(key, key);
+                ck_assert_int_eq(bounds.first, lower);
+                ck_assert_int_eq(bounds.second, upper);
+            }
+        }
+
+        delete merged;
+        delete run;
+        delete tree_run;
+        delete bf;
+        delete memtable;
+    }
+
+    // A run with only one distinct key falls back to the tree.
+    auto memtable = new MemTable(100, true, 0, g_rng);
+    for (size_t i=0; i<100; i++) memtable->append(5, i);
+    auto run = new InMemRun(memtable, nullptr, false, true);
+    ck_assert(!run->has_learned_index());
+    ck_assert_int_eq(run->get_lower_bound(5), 0);
+    ck_assert_int_eq(run->get_upper_bound(5), 100);
+
+    delete run;
+    delete memtable;
+}
+END_TEST
+
+
+START_TEST(t_learned_index_duplicates)
+{
+    size_t n = 4299;
+
+    auto lt = [](const record_t &rec, lsm::key_t key) { return rec.key < key; };
+    auto gt = [](lsm::key_t key, const record_t &rec) { return key < rec.key; };
+
+    // Keys drawn from ranges so small that the spline's trie runs out of
+    // bits to split its bins well before they are down to its error bound.
+    for (size_t seed : {1, 4, 7}) {
+        for (size_t range : {50, 200}) {
+            std::mt19937_64 rng(seed);
+            auto memtable = new MemTable(n, true, 0, g_rng);
+            for (size_t i=0; i<n; i++) {
+                memtable->append(rng() % range, i);
+            }
+
+            auto run = new InMemRun(memtable, nullptr, false, true);
+            ck_assert_int_eq(run->get_record_count(), n);
+            ck_assert(run->has_learned_index() == (range >= INMEM_RUN_TS_MIN_DISTINCT_KEYS));
+
+            auto data = run->sorted_output();
+            auto end = data + n;
+            for (lsm::key_t key=0; key<range+2; key++) {
+                size_t lower = std::lower_bound(data, end, key, lt) - data;
+                size_t upper = std::upper_bound(data, end, key, gt) - data;
+                ck_assert_int_eq(run->get_lower_bound(key), lower);
+                ck_assert_int_eq(run->get_upper_bound(key), upper);
+            }
+
+            // The spline itself must still be buildable over such keys, even
+            // where the run falls back to the tree, and give search bounds
+            // within the run.
+            auto bldr = ts::Builder<lsm::key_t>(data[0].key, (end - 1)->key, INMEM_RUN_TS_MAX_ERROR);
+            for (size_t i=0; i<n; i++) {
+                bldr.AddKey(data[i].key);
+            }
+            auto ts = bldr.Finalize();
+
+            for (lsm::key_t key=data[0].key; key<=(end - 1)->key; key++) {
+                auto bound = ts.GetSearchBound(key);
+                ck_assert(bound.begin <= bound.end && bound.end <= n);
+            }
+
+            delete run;
+            delete memtable;
+        }
+    }
+}
+END_TEST
+
+
 START_TEST(t_full_cancelation)
 {
     size_t n = 100;
@@ -229,7 +593,7 @@ START_TEST(t_persistence)
 
     run->persist_to_file(fname1);
 
-    auto run2 = new InMemRun(fname1, reccnt, 0, bf2, false);
+    auto run2 = new InMemRun(fname1, bf2, false);
 
     // verify that the records are the same, and that boundary lookups
     // also still work.
@@ -259,6 +623,374 @@ START_TEST(t_persistence)
 END_TEST
 
 
+static void check_same_run(InMemRun *run, InMemRun *expected)
+{
+    ck_assert_int_eq(run->get_record_count(), expected->get_record_count());
+    ck_assert_int_eq(run->get_tombstone_count(), expected->get_tombstone_count());
+
+    for (size_t i=0; i<run->get_record_count(); i++) {
+        auto rec = run->get_record(i);
+        auto exp = expected->get_record(i);
+        ck_assert_int_eq(rec.key, exp.key);
+        ck_assert_int_eq(rec.value, exp.value);
+        ck_assert_int_eq(rec.header, exp.header);
+        ck_assert_int_eq(run->get_key_at(i), exp.key);
+    }
+
+    std::vector<lsm::key_t> keys = {0, INMEM_ISAM_KEY_SENTINEL};
+    for (size_t i=0; i<1000; i++) {
+        keys.push_back(expected->get_key_at(rand() % expected->get_record_count()));
+        keys.push_back(rand());
+    }
+
+    for (auto key : keys) {
+        ck_assert_int_eq(run->get_lower_bound(key), expected->get_lower_bound(key));
+        ck_assert_int_eq(run->get_upper_bound(key), expected->get_upper_bound(key));
+        ck_assert_int_eq(run->get_lower_bound_from(key, 0), expected->get_lower_bound(key));
+
+        auto bounds = run->get_bounds(key, key + 1000);
+        ck_assert_int_eq(bounds.first, expected->get_lower_bound(key));
+        ck_assert_int_eq(bounds.second, expected->get_upper_bound(key + 1000));
+    }
+}
+
+
+/*
+ * Create a memtable of cnt records with the keys from start onward, every
+ * ts_step'th of them a tombstone, if ts_step is not 0.
+ */
+static MemTable *create_range_memtable(size_t start, size_t cnt, size_t ts_step=0)
+{
+    auto mtable = new MemTable(cnt, true, cnt, g_rng);
+
+    for (size_t i = 0; i < cnt; i++) {
+        mtable->append(start + i, rand(), ts_step && i % ts_step == 0);
+    }
+
+    return mtable;
+}
+
+
+START_TEST(t_disjoint_merge)
+{
+    size_t n = 5000;
+    std::vector<MemTable*> mtables = {create_range_memtable(2 * n, n), create_range_memtable(0, n),
+                                      create_range_memtable(n, n, 10)};
+
+    // The expected result, from a single memtable holding every record.
+    auto all = new MemTable(3 * n, true, 3 * n, g_rng);
+    for (auto mtable : mtables) {
+        auto recs = mtable->sorted_output();
+        for (size_t i=0; i<mtable->get_record_count(); i++) {
+            all->append(recs[i].key, recs[i].value, recs[i].is_tombstone());
+        }
+    }
+
+    for (auto layout : {RecordLayout::ROW, RecordLayout::COLUMNAR, RecordLayout::COMPRESSED}) {
+        BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+        auto expected = new InMemRun(all, bf, false, false, layout);
+
+        std::vector<InMemRun*> runs;
+        for (auto mtable : mtables) {
+            runs.push_back(new InMemRun(mtable, bf, false, false, layout));
+        }
+
+        BloomFilter* merged_bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+        auto merged = new InMemRun(runs.data(), runs.size(), merged_bf, false, false, layout);
+        check_same_run(merged, expected);
+        ck_assert_int_eq(merged->get_tombstone_count(), n / 10);
+        for (size_t i=0; i<n; i+=10) {
+            ck_assert(merged_bf->lookup(n + i));
+        }
+
+        // Inputs that overlap by a single key are merged normally.
+        auto overlap_mtable = create_range_memtable(3 * n - 1, 1);
+        auto overlap = new InMemRun(overlap_mtable, bf, false, false, layout);
+        InMemRun* overlapping[] = {runs[0], overlap};
+        auto overlap_merged = new InMemRun(overlapping, 2, merged_bf, false, false, layout);
+        ck_assert_int_eq(overlap_merged->get_record_count(), n + 1);
+        for (size_t i=1; i<overlap_merged->get_record_count(); i++) {
+            ck_assert_int_le(overlap_merged->get_key_at(i - 1), overlap_merged->get_key_at(i));
+        }
+
+        delete overlap_merged;
+        delete overlap;
+        delete overlap_mtable;
+        delete merged;
+        delete merged_bf;
+        for (auto run : runs) delete run;
+        delete expected;
+        delete bf;
+    }
+
+    for (auto mtable : mtables) delete mtable;
+    delete all;
+}
+END_TEST
+
+
+START_TEST(t_disjoint_merge_tagging)
+{
+    size_t n = 1000;
+    auto mtable1 = create_range_memtable(0, n);
+    auto mtable2 = create_range_memtable(n, n);
+    BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+
+    auto run1 = new InMemRun(mtable1, bf, true);
+    auto run2 = new InMemRun(mtable2, bf, true);
+
+    // Records deleted from the inputs are dropped from the merge.
+    auto rec = run2->get_record(10);
+    ck_assert(run2->delete_record(rec.key, rec.value));
+
+    InMemRun* runs[] = {run2, run1};
+    auto merged = new InMemRun(runs, 2, bf, true);
+    ck_assert_int_eq(merged->get_record_count(), 2 * n - 1);
+    for (size_t i=0; i<merged->get_record_count(); i++) {
+        ck_assert_int_eq(merged->get_key_at(i), (i < n + 10) ? i : i + 1);
+        ck_assert(!merged->get_record(i).get_delete_status());
+    }
+
+    delete merged;
+    delete run1;
+    delete run2;
+    delete bf;
+    delete mtable1;
+    delete mtable2;
+}
+END_TEST
+
+
+START_TEST(t_columnar)
+{
+    size_t n = 10000;
+    auto memtable = new MemTable(n + n / 10, true, n / 10, g_rng);
+    for (size_t i=0; i<n; i++) {
+        memtable->append(rand(), rand());
+    }
+
+    for (size_t i=0; i<n / 10; i++) {
+        auto rec = memtable->get_record_at(rand() % n);
+        memtable->append(rec->key, rec->value + 1, true);
+    }
+
+    auto memtable_ts = create_double_seq_memtable(n, true);
+
+    BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+    auto row = new InMemRun(memtable, bf, false, false, RecordLayout::ROW);
+    auto col = new InMemRun(memtable, bf, false, false, RecordLayout::COLUMNAR);
+    ck_assert(col->is_columnar() && !row->is_columnar());
+    ck_assert_ptr_null(col->sorted_output());
+    check_same_run(col, row);
+
+    // With more keys per leaf, the tree over the keys is smaller.
+    ck_assert_int_lt(col->get_memory_utilization(), row->get_memory_utilization());
+
+    // The flags of a columnar run are kept in bitmaps.
+    auto row_ts = new InMemRun(memtable_ts, bf, false, false, RecordLayout::ROW);
+    auto col_ts = new InMemRun(memtable_ts, bf, false, false, RecordLayout::COLUMNAR);
+    check_same_run(col_ts, row_ts);
+    for (size_t i=0; i<col_ts->get_record_count(); i++) {
+        auto rec = col_ts->get_record(i);
+        ck_assert(rec.is_tombstone());
+        ck_assert(col_ts->check_tombstone(rec.key, rec.value));
+        ck_assert(!col->check_tombstone(rec.key, rec.value));
+    }
+
+    // The keys can also be searched with a learned index.
+    auto learned = new InMemRun(memtable, bf, false, true, RecordLayout::COLUMNAR);
+    ck_assert(learned->has_learned_index());
+    check_same_run(learned, col);
+
+    size_t del = 10;
+    while (row->get_record(del).is_tombstone()) del++;
+    ck_assert(col->delete_record(col->get_key_at(del), col->get_record(del).value));
+    ck_assert(row->delete_record(row->get_key_at(del), row->get_record(del).value));
+    ck_assert(col->get_record(del).get_delete_status());
+    check_same_run(col, row);
+
+    // Columnar runs can be merged with either layout, into either layout.
+    InMemRun* runs[] = {col, row_ts};
+    InMemRun* row_runs[] = {row, row_ts};
+    auto merged = new InMemRun(runs, 2, bf, false, false, RecordLayout::COLUMNAR);
+    auto row_merged = new InMemRun(row_runs, 2, bf, false, false, RecordLayout::ROW);
+    InMemRun* mixed_runs[] = {row, col_ts};
+    auto mixed_merged = new InMemRun(mixed_runs, 2, bf, false, false, RecordLayout::ROW);
+    check_same_run(merged, row_merged);
+    check_same_run(mixed_merged, row_merged);
+
+    // And they are persisted, and reloaded, in their own layout.
+    std::string fname = "tests/data/memrun_tests/columnar.dat";
+    std::string row_fname = "tests/data/memrun_tests/row.dat";
+    merged->persist_to_file(fname);
+    row_merged->persist_to_file(row_fname);
+    auto reloaded_col = new InMemRun(fname, nullptr, false);
+    auto reloaded = new InMemRun(row_fname, nullptr, false);
+    ck_assert(reloaded_col->get_layout() == RecordLayout::COLUMNAR);
+    ck_assert(reloaded->get_layout() == RecordLayout::ROW);
+    check_same_run(reloaded, row_merged);
+    check_same_run(reloaded_col, row_merged);
+
+    delete reloaded_col;
+    delete reloaded;
+    delete learned;
+    delete mixed_merged;
+    delete row_merged;
+    delete merged;
+    delete col_ts;
+    delete row_ts;
+    delete col;
+    delete row;
+    delete bf;
+    delete memtable_ts;
+    delete memtable;
+}
+END_TEST
+
+
+START_TEST(t_compressed)
+{
+    // Dense keys, with runs of duplicates, so that most blocks pack into a
+    // few bits per key, alongside random keys spanning the whole key space.
+    size_t n = 10000;
+    auto dense = new MemTable(n, true, 0, g_rng);
+    for (size_t i=0; i<n; i++) {
+        dense->append(i / 3 + (i % 97 == 0) * 1000, i);
+    }
+
+    auto sparse = new MemTable(n, true, 0, g_rng);
+    for (size_t i=0; i<n - 2; i++) {
+        sparse->append(((lsm::key_t) rand() << 32) | rand(), i);
+    }
+    sparse->append(0, 0);
+    sparse->append(INMEM_ISAM_KEY_SENTINEL - 1, 0);
+
+    auto memtable_ts = create_double_seq_memtable(n, true);
+
+    BloomFilter* bf = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+    for (auto mtable : {dense, sparse, memtable_ts}) {
+        auto row = new InMemRun(mtable, bf, false, false, RecordLayout::ROW);
+        auto cmp = new InMemRun(mtable, bf, false, false, RecordLayout::COMPRESSED);
+        ck_assert(cmp->get_layout() == RecordLayout::COMPRESSED && cmp->is_columnar());
+        check_same_run(cmp, row);
+
+        auto learned = new InMemRun(mtable, bf, false, true, RecordLayout::COMPRESSED);
+        ck_assert(learned->has_learned_index());
+        check_same_run(learned, row);
+
+        if (mtable != memtable_ts) {
+            ck_assert(cmp->delete_record(cmp->get_key_at(10), cmp->get_record(10).value));
+            ck_assert(row->delete_record(row->get_key_at(10), row->get_record(10).value));
+            check_same_run(cmp, row);
+        }
+
+        // Compressed runs merge and persist like columnar ones.
+        InMemRun* runs[] = {cmp, learned};
+        InMemRun* row_runs[] = {row, learned};
+        auto merged = new InMemRun(runs, 2, bf, false, false, RecordLayout::COMPRESSED);
+        auto row_merged = new InMemRun(row_runs, 2, bf, false, false, RecordLayout::ROW);
+        check_same_run(merged, row_merged);
+
+        std::string fname = "tests/data/memrun_tests/compressed.dat";
+        merged->persist_to_file(fname);
+        auto reloaded = new InMemRun(fname, nullptr, false);
+        ck_assert(reloaded->get_layout() == RecordLayout::COMPRESSED);
+        check_same_run(reloaded, row_merged);
+
+        delete reloaded;
+        delete row_merged;
+        delete merged;
+        delete learned;
+        delete cmp;
+        delete row;
+    }
+
+    // Dense keys take up a fraction of the space of the row layout, and of
+    // the uncompressed columns.
+    auto row = new InMemRun(dense, bf, false, false, RecordLayout::ROW);
+    auto col = new InMemRun(dense, bf, false, false, RecordLayout::COLUMNAR);
+    auto cmp = new InMemRun(dense, bf, false, false, RecordLayout::COMPRESSED);
+    ck_assert_int_lt(cmp->get_data_size(), col->get_data_size());
+    ck_assert_int_lt(col->get_data_size(), row->get_data_size());
+    ck_assert_int_lt(cmp->get_data_size(), row->get_data_size() * 3 / 5);
+
+    delete cmp;
+    delete col;
+    delete row;
+    delete bf;
+    delete memtable_ts;
+    delete sparse;
+    delete dense;
+}
+END_TEST
+
+
+START_TEST(t_persistence_mapped)
+{
+    size_t n = 100000;
+    auto mtable = create_double_seq_memtable(n, true);
+    auto mtable_data = create_test_memtable(n);
+
+    BloomFilter* bf1 = new BloomFilter(BF_FPR, n, BF_HASH_FUNCS, g_rng);
+    auto run_ts = new InMemRun(mtable, bf1, false);
+    std::string fname = "tests/data/memrun_tests/mapped.dat";
+    run_ts->persist_to_file(fname, bf1);
+
+    // The tombstone filter is restored from the file, rather than rebuilt,
+    // along with the tree.
+    BloomFilter* bf2 = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+    auto mapped_ts = new InMemRun(fname, bf2, false, false);
+    ck_assert_int_eq(bf2->get_bit_count(), bf1->get_bit_count());
+    ck_assert_int_eq(bf2->get_hash_count(), bf1->get_hash_count());
+    ck_assert_int_eq(mapped_ts->get_memory_utilization(), run_ts->get_memory_utilization());
+    for (size_t i=0; i<mapped_ts->get_record_count(); i++) {
+        ck_assert(bf2->lookup(mapped_ts->get_key_at(i)));
+    }
+    for (size_t i=0; i<1000; i++) {
+        lsm::key_t key = rand();
+        ck_assert_int_eq(bf2->lookup(key), bf1->lookup(key));
+    }
+
+    // A run saved with its tree can be loaded with a learned index, and the
+    // other way around.
+    auto learned = new InMemRun(fname, nullptr, false, true);
+    ck_assert(learned->has_learned_index());
+    check_same_run(learned, run_ts);
+
+    BloomFilter* bf3 = new BloomFilter(100, BF_HASH_FUNCS, g_rng);
+    auto run = new InMemRun(mtable_data, bf3, false, true);
+    std::string fname2 = "tests/data/memrun_tests/mapped_learned.dat";
+    run->persist_to_file(fname2);
+
+    auto mapped = new InMemRun(fname2, nullptr, false, false);
+    ck_assert(!mapped->has_learned_index());
+    check_same_run(mapped, run);
+
+    // Deleting a record from a loaded run leaves the file as it was.
+    size_t del = 10;
+    auto rec = mapped->get_record(del);
+    ck_assert(mapped->delete_record(rec.key, rec.value));
+    ck_assert(mapped->get_record(del).get_delete_status());
+
+    auto mapped2 = new InMemRun(fname2, nullptr, false, false);
+    ck_assert(!mapped2->get_record(del).get_delete_status());
+    check_same_run(mapped2, run);
+
+    delete mapped2;
+    delete mapped;
+    delete run;
+    delete learned;
+    delete mapped_ts;
+    delete run_ts;
+    delete bf3;
+    delete bf2;
+    delete bf1;
+    delete mtable_data;
+    delete mtable;
+}
+END_TEST
+
+
 Suite *unit_testing()
 {
     Suite *unit = suite_create("InMemRun Unit Testing");
@@ -266,21 +998,37 @@ Suite *unit_testing()
     TCase *create = tcase_create("lsm::InMemRun constructor Testing");
     tcase_add_test(create, t_memtable_init);
     tcase_add_test(create, t_inmemrun_init);
+    tcase_add_test(create, t_kway_merge);
+    tcase_add_test(create, t_two_way_merge);
     tcase_set_timeout(create, 100);
     suite_add_tcase(unit, create);
 
     TCase *bounds = tcase_create("lsm::InMemRun::get_{lower,upper}_bound Testing");
     tcase_add_test(bounds, t_get_lower_bound_index);
     tcase_add_test(bounds, t_get_upper_bound_index);
+    tcase_add_test(bounds, t_galloping_bounds);
+    tcase_add_test(bounds, t_node_search);
+    tcase_add_test(bounds, t_get_bounds);
+    tcase_add_test(bounds, t_learned_index);
+    tcase_add_test(bounds, t_learned_index_duplicates);
     tcase_set_timeout(bounds, 100);   
     suite_add_tcase(unit, bounds);
 
     TCase *tombstone = tcase_create("lsm::InMemRun::tombstone cancellation Testing");
     tcase_add_test(tombstone, t_full_cancelation);
+    tcase_add_test(tombstone, t_disjoint_merge);
+    tcase_add_test(tombstone, t_disjoint_merge_tagging);
     suite_add_tcase(unit, tombstone);
 
+    TCase *layout = tcase_create("lsm::InMemRun::record layout Testing");
+    tcase_add_test(layout, t_columnar);
+    tcase_add_test(layout, t_compressed);
+    tcase_set_timeout(layout, 100);
+    suite_add_tcase(unit, layout);
+
     TCase *persistence = tcase_create("lsm::InMemRun::persistence Testing");
     tcase_add_test(persistence, t_persistence);
+    tcase_add_test(persistence, t_persistence_mapped);
     suite_add_tcase(unit, persistence);
 
     return unit;
@@ -175,7 +175,7 @@ START_TEST(t_create_test_isam)
     auto tree = create_test_isam(n, "tests/data/mrun_isam0.dat", &tbl, &filter);
     check_test_isam(tree, n);
 
-    tbl->sorted_output();
+    auto tbl_records = tbl->sorted_output();
     auto iter = tree->start_scan();
     ck_assert_ptr_nonnull(iter);
 
@@ -186,7 +186,7 @@ START_TEST(t_create_test_isam)
                 break;
             }
 
-            const record_t *tbl_rec = tbl->get_record_at(total_cnt - 1);
+            const record_t *tbl_rec = tbl_records + total_cnt - 1;
             const record_t *tree_rec = (record_t*)(iter->get_item() + (i * sizeof(record_t)));
             ck_assert(tree_rec->match(tbl_rec));
         }
@@ -210,9 +210,9 @@ START_TEST(t_get_lower_bound_index)
     auto tree = create_test_isam(n, "tests/data/mrun_isam0.dat", &tbl, &filter);
     check_test_isam(tree, n);
 
-    tbl->sorted_output();
+    auto tbl_records = tbl->sorted_output();
     for (size_t i=0; i<n; i++) {
-        const record_t *tbl_rec = tbl->get_record_at(i);
+        const record_t *tbl_rec = tbl_records + i;
         auto tree_loc = tree->get_lower_bound_index(tbl_rec->key, buf);
         ck_assert_int_ne(tree_loc.first, INVALID_PNUM);
         size_t idx = tree_loc.second;
@@ -237,9 +237,9 @@ START_TEST(t_get_upper_bound_index)
     auto tree = create_test_isam(n, "tests/data/mrun_isam0.dat", &tbl, &filter);
     check_test_isam(tree, n);
 
-    tbl->sorted_output();
+    auto tbl_records = tbl->sorted_output();
     for (size_t i=0; i<n; i++) {
-        const record_t *tbl_rec = tbl->get_record_at(i);
+        const record_t *tbl_rec = tbl_records + i;
         auto tree_loc = tree->get_upper_bound_index(tbl_rec->key, buf);
         ck_assert_int_ne(tree_loc.first, INVALID_PNUM);
         size_t idx = tree_loc.second;
@@ -275,9 +275,9 @@ START_TEST(t_create_from_isams)
     auto tree4 = new ISAMTree(pfile, g_rng, filter4, nullptr, 0, trees, 3);
     check_test_isam(tree4, sizeof(trees)/8*n);
 
-    tbl1->sorted_output();
-    tbl2->sorted_output();
-    tbl3->sorted_output();
+    auto tbl1_records = tbl1->sorted_output();
+    auto tbl2_records = tbl2->sorted_output();
+    auto tbl3_records = tbl3->sorted_output();
 
     auto iter = tree4->start_scan();
     ck_assert_ptr_nonnull(iter);
@@ -293,9 +293,9 @@ START_TEST(t_create_from_isams)
                 break;
             }
 
-            const record_t *tbl1_rec = tbl1->get_record_at(tbl1_idx);
-            const record_t *tbl2_rec = tbl2->get_record_at(tbl2_idx);
-            const record_t *tbl3_rec = tbl3->get_record_at(tbl3_idx);
+            const record_t *tbl1_rec = tbl1_records + tbl1_idx;
+            const record_t *tbl2_rec = tbl2_records + tbl2_idx;
+            const record_t *tbl3_rec = tbl3_records + tbl3_idx;
 
             const record_t *tree_rec = (const record_t*)(iter->get_item() + (i * sizeof(record_t)));
 
@@ -322,6 +322,175 @@ START_TEST(t_create_from_isams)
 END_TEST
 
 
+START_TEST(t_create_from_columnar_run)
+{
+    size_t n = 200000;
+    auto mtable = create_test_memtable(n);
+    BloomFilter *filter = new BloomFilter(100, 9, g_rng);
+
+    // The merge is split across several partitions, each of which reads its
+    // range of the columnar run a chunk at a time.
+    auto row = new InMemRun(mtable, filter, false, false, RecordLayout::ROW);
+    auto row_tree = new ISAMTree(PagedFile::create("tests/data/mrun_isam0.dat"), g_rng, filter, &row, 1, nullptr, 0);
+
+    for (auto layout : {RecordLayout::COLUMNAR, RecordLayout::COMPRESSED}) {
+        auto col = new InMemRun(mtable, filter, false, false, layout);
+        auto col_tree = new ISAMTree(PagedFile::create("tests/data/mrun_isam1.dat"), g_rng, filter, &col, 1, nullptr, 0);
+        check_test_isam(col_tree, n);
+
+        auto row_iter = row_tree->start_scan();
+        auto col_iter = col_tree->start_scan();
+        size_t cnt = 0;
+        while (row_iter->next()) {
+            ck_assert(col_iter->next());
+            auto row_pg = (record_t *) row_iter->get_item();
+            auto col_pg = (record_t *) col_iter->get_item();
+            for (size_t i=0; i<ISAM_RECORDS_PER_LEAF && cnt < n; i++, cnt++) {
+                ck_assert_int_eq(row_pg[i].key, col_pg[i].key);
+                ck_assert_int_eq(row_pg[i].value, col_pg[i].value);
+                ck_assert_int_eq(row_pg[i].header, col_pg[i].header);
+            }
+        }
+        ck_assert(!col_iter->next());
+        ck_assert_int_eq(cnt, n);
+
+        delete row_iter;
+        delete col_iter;
+        delete col;
+        free_isam(col_tree, nullptr, nullptr);
+    }
+
+    delete row;
+    free_isam(row_tree, filter, mtable);
+}
+END_TEST
+
+
+START_TEST(t_create_with_cancelation)
+{
+    size_t n = 500000;
+    size_t ts_cnt = n / 10;
+
+    // Sequential keys, so that the deleted records are spread across all
+    // of the merge partitions.
+    auto tbl1 = create_sequential_memtable(n);
+    BloomFilter *filter1;
+    auto tree1 = create_isam_from_memtable(PagedFile::create("tests/data/mrun_isam1.dat"), tbl1, &filter1);
+    check_test_isam(tree1, n);
+
+    // Delete every tenth record, with the tombstones split between a
+    // second tree and a run merged alongside it.
+    auto tbl2 = new MemTable(ts_cnt / 2, true, ts_cnt / 2, g_rng);
+    auto tbl3 = new MemTable(ts_cnt / 2, true, ts_cnt / 2, g_rng);
+    for (size_t i=0; i<ts_cnt; i++) {
+        lsm::key_t key = i * 10;
+        auto tbl = (i % 2) ? tbl3 : tbl2;
+        ck_assert_int_eq(tbl->append(key, key, true), 1);
+    }
+
+    auto filter2 = new BloomFilter(BF_FPR, ts_cnt, BF_HASH_FUNCS, g_rng);
+    auto run2 = new InMemRun(tbl2, filter2, false);
+    filter2->clear();
+    auto tree2 = new ISAMTree(PagedFile::create("tests/data/mrun_isam2.dat"), g_rng, filter2, &run2, 1, nullptr, 0);
+    check_test_isam(tree2, ts_cnt / 2, ts_cnt / 2);
+
+    auto filter3 = new BloomFilter(BF_FPR, ts_cnt, BF_HASH_FUNCS, g_rng);
+    auto run3 = new InMemRun(tbl3, filter3, false);
+
+    ISAMTree *trees[2] = {tree1, tree2};
+    auto filter4 = new BloomFilter(BF_FPR, ts_cnt, BF_HASH_FUNCS, g_rng);
+    auto tree4 = new ISAMTree(PagedFile::create("tests/data/mrun_isam4.dat"), g_rng, filter4, &run3, 1, trees, 2);
+    check_test_isam(tree4, n - ts_cnt, 0);
+
+    auto iter = tree4->start_scan();
+    size_t total_cnt = 0;
+    lsm::key_t expected = 1;
+    while (iter->next()) {
+        for (size_t i=0; i<PAGE_SIZE / sizeof(record_t); i++) {
+            if (total_cnt >= n - ts_cnt) break;
+            total_cnt++;
+
+            auto rec = (record_t*)(iter->get_item() + (i * sizeof(record_t)));
+            ck_assert_int_eq(rec->key, expected);
+            ck_assert_int_eq(rec->value, expected);
+            ck_assert(!rec->is_tombstone());
+
+            expected += (expected % 10 == 9) ? 2 : 1;
+        }
+    }
+    ck_assert_int_eq(total_cnt, n - ts_cnt);
+
+    delete iter;
+    delete run2;
+    delete run3;
+    free_isam(tree1, filter1, tbl1);
+    free_isam(tree2, filter2, tbl2);
+    free_isam(tree4, filter4, tbl3);
+    delete filter3;
+}
+END_TEST
+
+
+START_TEST(t_create_from_disjoint_inputs)
+{
+    size_t n = 400000;
+    size_t ts_cnt = n / 10;
+
+    // Sequential keys, in three disjoint ranges, given out of order. The
+    // middle range deletes every tenth of its own records, which a run built
+    // with delete tagging keeps alongside their tombstones.
+    auto tbl1 = new MemTable(n, true, 0, g_rng);
+    auto tbl2 = new MemTable(n + ts_cnt, true, ts_cnt, g_rng);
+    auto tbl3 = new MemTable(n, true, 0, g_rng);
+    for (size_t i=0; i<n; i++) {
+        tbl1->append(i, i);
+        tbl2->append(n + i, n + i);
+        tbl3->append(2 * n + i, 2 * n + i);
+        if (i % 10 == 0) {
+            tbl2->append(n + i, n + i, true);
+        }
+    }
+
+    BloomFilter *filter1, *filter3;
+    auto tree1 = create_isam_from_memtable(PagedFile::create("tests/data/mrun_isam1.dat"), tbl1, &filter1);
+    auto tree3 = create_isam_from_memtable(PagedFile::create("tests/data/mrun_isam3.dat"), tbl3, &filter3);
+
+    auto filter2 = new BloomFilter(BF_FPR, ts_cnt, BF_HASH_FUNCS, g_rng);
+    auto run2 = new InMemRun(tbl2, filter2, true);
+    ck_assert_int_eq(run2->get_record_count(), n + ts_cnt);
+
+    ISAMTree *trees[2] = {tree3, tree1};
+    auto filter4 = new BloomFilter(BF_FPR, ts_cnt, BF_HASH_FUNCS, g_rng);
+    auto tree4 = new ISAMTree(PagedFile::create("tests/data/mrun_isam4.dat"), g_rng, filter4, &run2, 1, trees, 2);
+    check_test_isam(tree4, 3 * n - ts_cnt, 0);
+
+    auto iter = tree4->start_scan();
+    size_t total_cnt = 0;
+    lsm::key_t expected = 0;
+    while (iter->next()) {
+        for (size_t i=0; i<ISAM_RECORDS_PER_LEAF && total_cnt < 3 * n - ts_cnt; i++, total_cnt++) {
+            if (expected >= n && expected < 2 * n && expected % 10 == 0) expected++;
+
+            auto rec = (record_t*)(iter->get_item() + (i * sizeof(record_t)));
+            ck_assert_int_eq(rec->key, expected);
+            ck_assert_int_eq(rec->value, expected);
+            ck_assert(!rec->is_tombstone());
+            expected++;
+        }
+    }
+    ck_assert_int_eq(total_cnt, 3 * n - ts_cnt);
+    ck_assert_int_eq(expected, 3 * n);
+
+    delete iter;
+    delete run2;
+    free_isam(tree1, filter1, tbl1);
+    free_isam(tree3, filter3, tbl3);
+    free_isam(tree4, filter4, tbl2);
+    delete filter2;
+}
+END_TEST
+
+
 START_TEST(t_verify_page_structure)
 {
     size_t cnt = 1000000;
@@ -353,6 +522,12 @@ START_TEST(t_verify_page_structure)
 
     delete pg_iter;
 
+    if (!ISAM_DISK_INTERNAL_LEVELS) {
+        ck_assert_int_eq(isam->get_root_pnum(), INVALID_PNUM);
+        free_isam(isam, filter, mtable);
+        return;
+    }
+
     // check on the first internal level
     auto l1_iter = pfile->start_scan(isam->get_leaf_page_count() + 2);
     PageNum current_pnum = BTREE_FIRST_LEAF_PNUM;
@@ -384,7 +559,9 @@ START_TEST(t_verify_page_structure)
     // check the root page
     auto root_pg = l1_iter->get_item();
     current_pnum = isam->get_leaf_page_count() + 2;
-    for (size_t i=0; i<16; i++) {
+    size_t l1_page_cnt = page_cnt / internal_records_per_page + (page_cnt % internal_records_per_page != 0);
+    ck_assert_int_eq(((ISAMTreeInternalNodeHeader *) root_pg)->internal_rec_cnt, l1_page_cnt);
+    for (size_t i=0; i<l1_page_cnt; i++) {
         auto rec = get_internal_record(root_pg, i);
         auto key = *(int64_t*) get_internal_key(rec);
         val = get_internal_value(rec);
@@ -413,7 +590,7 @@ START_TEST(t_get_lower_bound_index_dupes)
 
     auto tbl_records = tbl->sorted_output();
     for (size_t i=0; i<n; i++) {
-        auto tbl_key_ptr = tbl->get_record_at(i);
+        auto tbl_key_ptr = tbl_records + i;
         auto tbl_key = tbl_key_ptr->key;
 
         auto pos = tree->get_lower_bound_index(tbl_key, buf);
@@ -423,7 +600,7 @@ START_TEST(t_get_lower_bound_index_dupes)
         auto tree_val = ((record_t*)(buf + (pos.second * sizeof(record_t))))->value;
         ck_assert_int_eq(tree_key, tbl_key);
         ck_assert(tbl_key == tree_val || tbl_key - 1 == tree_val);
-        size_t overall_offset = (pos.first - BTREE_FIRST_LEAF_PNUM) * PAGE_SIZE / sizeof(record_t) + pos.second;
+        size_t overall_offset = (pos.first - BTREE_FIRST_LEAF_PNUM) * (PAGE_SIZE / sizeof(record_t)) + pos.second;
         ck_assert_int_le(overall_offset, i);
     }
 
@@ -444,7 +621,7 @@ START_TEST(t_get_upper_bound_index_dupes)
 
     auto tbl_records = tbl->sorted_output();
     for (size_t i=0; i<n; i++) {
-        auto tbl_key_ptr = tbl->get_record_at(i);
+        auto tbl_key_ptr = tbl_records + i;
         auto tbl_key = tbl_key_ptr->key;
 
         auto pos = tree->get_upper_bound_index(tbl_key, buf);
@@ -454,7 +631,7 @@ START_TEST(t_get_upper_bound_index_dupes)
         auto tree_val = ((record_t*)(buf + (pos.second * sizeof(record_t))))->value;
         ck_assert_int_eq(tree_key, tbl_key);
         ck_assert(tbl_key == tree_val || tbl_key + 1 == tree_val);
-        size_t overall_offset = (pos.first - BTREE_FIRST_LEAF_PNUM) * PAGE_SIZE / sizeof(record_t) + pos.second;
+        size_t overall_offset = (pos.first - BTREE_FIRST_LEAF_PNUM) * (PAGE_SIZE / sizeof(record_t)) + pos.second;
         ck_assert_int_ge(overall_offset, i);
     }
 
@@ -463,6 +640,97 @@ START_TEST(t_get_upper_bound_index_dupes)
 }
 
 
+/*
+ * Check the page bounds of an assortment of keys against those found by
+ * scanning every record of the tree.
+ */
+static void check_page_bounds(ISAMTree *tree, char *buf)
+{
+    std::vector<lsm::key_t> keys;
+    auto iter = tree->start_scan();
+    while (keys.size() < tree->get_record_count() && iter->next()) {
+        auto pg = (record_t *) iter->get_item();
+        for (size_t i=0; i<ISAM_RECORDS_PER_LEAF && keys.size() < tree->get_record_count(); i++) {
+            keys.push_back(pg[i].key);
+        }
+    }
+    delete iter;
+
+    std::vector<lsm::key_t> queries = {0, keys.front(), keys.back(), keys.back() + 1};
+    for (size_t i=0; i<2000; i++) {
+        queries.push_back(keys[rand() % keys.size()]);
+        queries.push_back(keys[rand() % keys.size()] + 1);
+    }
+
+    for (auto key : queries) {
+        size_t lb = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        size_t ub = std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+
+        PageNum expected_low = (lb == keys.size()) ? INVALID_PNUM : BTREE_FIRST_LEAF_PNUM + lb / ISAM_RECORDS_PER_LEAF;
+        PageNum expected_high = (ub == 0) ? INVALID_PNUM : BTREE_FIRST_LEAF_PNUM + (ub - 1) / ISAM_RECORDS_PER_LEAF;
+
+        ck_assert_int_eq(tree->get_lower_bound(key, buf), expected_low);
+        ck_assert_int_eq(tree->get_upper_bound(key, buf), expected_high);
+    }
+}
+
+
+START_TEST(t_page_bounds)
+{
+    BloomFilter *filter = nullptr;
+    char *buf = (char *) aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+
+    // Too small for a learned index over its fences.
+    size_t n = 10000;
+    auto tree = create_test_isam(n, "tests/data/mrun_isam0.dat", nullptr, &filter);
+    check_test_isam(tree, n);
+    ck_assert(!tree->has_learned_index());
+    check_page_bounds(tree, buf);
+    free_isam(tree, filter, nullptr);
+
+    n = 200000;
+    tree = create_test_isam(n, "tests/data/mrun_isam0.dat", nullptr, &filter);
+    check_test_isam(tree, n);
+    ck_assert(tree->has_learned_index() == ISAM_LEARNED_INDEX);
+    check_page_bounds(tree, buf);
+    free_isam(tree, filter, nullptr);
+
+    tree = create_test_isam_dupes(n, "tests/data/mrun_isam0.dat", nullptr, &filter);
+    check_test_isam(tree, n);
+    check_page_bounds(tree, buf);
+    free_isam(tree, filter, nullptr);
+
+    free(buf);
+}
+END_TEST
+
+
+START_TEST(t_page_bounds_recovery)
+{
+    BloomFilter *filter = nullptr;
+    char *buf = (char *) aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+
+    size_t n = 200000;
+    auto tree = create_test_isam(n, "tests/data/mrun_isam0.dat", nullptr, &filter);
+
+    // The fences of a tree recovered from its file are rebuilt from its
+    // leaves, and so should match those collected by the merge.
+    auto recovered_filter = new BloomFilter(100, 9, g_rng);
+    auto recovered = new ISAMTree(tree->get_pfile(), tree->get_record_count(), tree->get_tombstone_count(),
+                                  tree->get_last_leaf_pnum(), tree->get_root_pnum(), recovered_filter, g_rng);
+    recovered->retain();
+
+    ck_assert_int_eq(recovered->get_memory_utilization(), tree->get_memory_utilization());
+    check_page_bounds(recovered, buf);
+
+    delete recovered;
+    delete recovered_filter;
+    free_isam(tree, filter, nullptr);
+    free(buf);
+}
+END_TEST
+
+
 Suite *unit_testing()
 {
     Suite *unit = suite_create("IsamTree Unit Testing");
@@ -470,6 +738,9 @@ Suite *unit_testing()
     tcase_add_test(create, t_create_test_isam);
     tcase_add_test(create, t_verify_page_structure);
     tcase_add_test(create, t_create_from_isams);
+    tcase_add_test(create, t_create_with_cancelation);
+    tcase_add_test(create, t_create_from_disjoint_inputs);
+    tcase_add_test(create, t_create_from_columnar_run);
 
     tcase_set_timeout(create, 100);
     suite_add_tcase(unit, create);
@@ -479,6 +750,8 @@ Suite *unit_testing()
     tcase_add_test(bounds, t_get_upper_bound_index);
     tcase_add_test(bounds, t_get_lower_bound_index_dupes);
     tcase_add_test(bounds, t_get_upper_bound_index_dupes);
+    tcase_add_test(bounds, t_page_bounds);
+    tcase_add_test(bounds, t_page_bounds_recovery);
 
     tcase_set_timeout(bounds, 1000);
     suite_add_tcase(unit, bounds);
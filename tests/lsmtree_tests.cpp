@@ -1,6 +1,9 @@
 #include <check.h>
 #include <set>
 #include <random>
+#include <thread>
+#include <atomic>
+#include <vector>
 
 #include "lsm/LsmTree.h"
 
@@ -83,6 +86,270 @@ START_TEST(t_append_with_disk_merges)
 END_TEST
 
 
+START_TEST(t_append_with_cascading_merges)
+{
+    // With a small scale factor, most memtable flushes cascade through
+    // several levels, crossing from memory onto disk, and so have their
+    // steps merged concurrently.
+    auto lsm = new LSMTree(dir, 100, 100, 2, 4, 1, g_rng);
+
+    size_t reccnt = 20000;
+    for (size_t i=0; i<reccnt; i++) {
+        ck_assert_int_eq(lsm->append(i, i, 0, g_rng), 1);
+    }
+
+    ck_assert_int_eq(lsm->get_record_cnt(), reccnt);
+
+    size_t len;
+    record_t* flat = lsm->get_sorted_array(&len, g_rng);
+    ck_assert_int_eq(len, reccnt);
+
+    for (size_t i=0; i<len; i++) {
+        ck_assert_int_eq(flat[i].key, i);
+        ck_assert_int_eq(flat[i].value, i);
+    }
+
+    free(flat);
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_append_with_background_merges)
+{
+    auto lsm = new LSMTree(dir, 100, 100, 2, 10, 1, g_rng);
+
+    char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    record_t sample_set[50];
+
+    lsm::key_t key = 0;
+    lsm::value_t val = 0;
+    for (size_t i=0; i<3000; i++) {
+        ck_assert_int_eq(lsm->append(key, val, 0, g_rng), 1);
+        key++;
+        val++;
+
+        // sample while merges are in flight
+        if (i % 250 == 249) {
+            lsm->range_sample(sample_set, 0, key, 50, buf, util_buf, g_rng);
+            for (size_t j=0; j<50; j++) {
+                ck_assert_int_lt(sample_set[j].key, key);
+            }
+        }
+    }
+
+    ck_assert_int_eq(lsm->get_record_cnt(), 3000);
+
+    free(buf);
+    free(util_buf);
+
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_append_multithreaded)
+{
+    auto lsm = new LSMTree(dir, 100, 100, 2, 10, 1, g_rng);
+
+    // Several writers filling memtables at once, so that more than one of
+    // them finds the memtable full at the same time.
+    size_t thread_cnt = 4;
+    size_t per_thread = 2500;
+    std::atomic<size_t> failed(0);
+    std::vector<std::thread> writers;
+    for (size_t t=0; t<thread_cnt; t++) {
+        writers.emplace_back([&, t] {
+            auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+            for (size_t i=0; i<per_thread; i++) {
+                lsm::key_t key = t * per_thread + i;
+                if (lsm->append(key, key, 0, rng) != 1) {
+                    failed++;
+                }
+            }
+            gsl_rng_free(rng);
+        });
+    }
+
+    for (auto &writer : writers) {
+        writer.join();
+    }
+
+    ck_assert_int_eq(failed.load(), 0);
+    ck_assert_int_eq(lsm->get_record_cnt(), thread_cnt * per_thread);
+
+    char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    record_t sample_set[100];
+    lsm->range_sample(sample_set, 0, thread_cnt * per_thread, 100, buf, util_buf, g_rng);
+    for (size_t j=0; j<100; j++) {
+        ck_assert_int_eq(sample_set[j].key, sample_set[j].value);
+        ck_assert_int_lt(sample_set[j].key, thread_cnt * per_thread);
+    }
+
+    free(buf);
+    free(util_buf);
+
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_range_sample_concurrent_with_merges)
+{
+    auto lsm = new LSMTree(dir, 100, 100, 2, 10, 1, g_rng);
+
+    std::atomic<bool> done(false);
+    std::atomic<size_t> bad_samples(0);
+    std::atomic<lsm::key_t> max_key(0);
+
+    // Sample continuously from a second thread while the main thread
+    // appends, so that sampling overlaps with the background merges.
+    std::thread sampler([&] {
+        auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+        char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+        char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+        record_t sample_set[50];
+
+        while (!done.load()) {
+            lsm::key_t upper = max_key.load();
+            if (upper < 50) continue;
+
+            lsm->range_sample(sample_set, 0, upper, 50, buf, util_buf, rng);
+            for (size_t j=0; j<50; j++) {
+                if (sample_set[j].key > upper || sample_set[j].key != sample_set[j].value) {
+                    bad_samples++;
+                }
+            }
+        }
+
+        free(buf);
+        free(util_buf);
+        gsl_rng_free(rng);
+    });
+
+    lsm::key_t key = 0;
+    lsm::value_t val = 0;
+    for (size_t i=0; i<5000; i++) {
+        ck_assert_int_eq(lsm->append(key, val, 0, g_rng), 1);
+        max_key.store(key);
+        key++;
+        val++;
+    }
+
+    done.store(true);
+    sampler.join();
+
+    ck_assert_int_eq(bad_samples.load(), 0);
+    ck_assert_int_eq(lsm->get_record_cnt(), 5000);
+
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_delete_concurrent_with_sampling)
+{
+    size_t n = 800;
+    auto lsm = new LSMTree(dir, 1000, 1000, 2, 10, 1, g_rng);
+    for (size_t i=0; i<n; i++) {
+        ck_assert_int_eq(lsm->append(i, i, 0, g_rng), 1);
+    }
+
+    std::atomic<bool> done(false);
+    std::atomic<size_t> bad_samples(0);
+
+    // Sample from the memtable while its records are being deleted, which
+    // reads records as they are tagged.
+    std::thread sampler([&] {
+        auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+        char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+        char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+        record_t sample_set[50];
+
+        while (!done.load()) {
+            lsm->range_sample(sample_set, 0, n - 1, 50, buf, util_buf, rng);
+            for (size_t j=0; j<50; j++) {
+                if (sample_set[j].key >= n || sample_set[j].key != sample_set[j].value) {
+                    bad_samples++;
+                }
+            }
+        }
+
+        free(buf);
+        free(util_buf);
+        gsl_rng_free(rng);
+    });
+
+    for (size_t i=1; i<n; i+=2) {
+        ck_assert_int_eq(lsm->delete_record(i, i, g_rng), 1);
+    }
+
+    done.store(true);
+    sampler.join();
+    ck_assert_int_eq(bad_samples.load(), 0);
+
+    // Once the deletes are done, none of the deleted records are sampled.
+    char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    record_t sample_set[100];
+    lsm->range_sample(sample_set, 0, n - 1, 100, buf, util_buf, g_rng);
+    for (size_t j=0; j<100; j++) {
+        ck_assert_int_eq(sample_set[j].key % 2, 0);
+    }
+
+    free(buf);
+    free(util_buf);
+
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_delete_concurrent_with_appends)
+{
+    size_t n = 2000;
+    auto lsm = new LSMTree(dir, 100, 100, 2, 10, 1, g_rng);
+    for (size_t i=0; i<n; i++) {
+        ck_assert_int_eq(lsm->append(i, i, 0, g_rng), 1);
+    }
+
+    // Keep filling memtables and merging them down while records are
+    // deleted, so that deletes race with the memtable being handed off to
+    // a merge and with the levels being rebuilt.
+    std::thread writer([&] {
+        auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+        for (size_t i=n; i<2*n; i++) {
+            lsm->append(i, i, 0, rng);
+        }
+        gsl_rng_free(rng);
+    });
+
+    for (size_t i=1; i<n; i+=2) {
+        ck_assert_int_eq(lsm->delete_record(i, i, g_rng), 1);
+    }
+
+    writer.join();
+    lsm->await_merge();
+
+    char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    record_t sample_set[1000];
+    lsm->range_sample(sample_set, 0, n - 1, 1000, buf, util_buf, g_rng);
+    for (size_t j=0; j<1000; j++) {
+        ck_assert_int_lt(sample_set[j].key, n);
+        ck_assert_int_eq(sample_set[j].key % 2, 0);
+    }
+
+    free(buf);
+    free(util_buf);
+
+    delete lsm;
+}
+END_TEST
+
+
 START_TEST(t_range_sample_memtable)
 {
     auto lsm = new LSMTree(dir, 100, 100, 2, 1, 1, g_rng);
@@ -109,6 +376,22 @@ START_TEST(t_range_sample_memtable)
         ck_assert_int_ge(sample_set[i].key, lower_bound);
     }
 
+    // Only the records within the range are weighted, so none should be
+    // rejected for falling outside of it.
+    if (!LSM_REJ_SAMPLE) {
+        ck_assert_int_eq(bounds_rejections, 0);
+    }
+
+    // The last record in the memtable must be reachable as well.
+    lsm->range_sample(sample_set, 98, 99, 100, buf, util_buf, g_rng);
+    size_t last_cnt = 0;
+    for(size_t i=0; i<100; i++) {
+        ck_assert_int_ge(sample_set[i].key, 98);
+        last_cnt += (sample_set[i].key == 99);
+    }
+    ck_assert_int_gt(last_cnt, 0);
+    ck_assert_int_lt(last_cnt, 100);
+
     free(buf);
     free(util_buf);
 
@@ -151,6 +434,50 @@ START_TEST(t_range_sample_memlevels)
 END_TEST
 
 
+START_TEST(t_range_sample_batch)
+{
+    auto lsm = new LSMTree(dir, 100, 100, 2, 10, 1, g_rng);
+
+    lsm::key_t key = 0;
+    lsm::value_t val = 0;
+    for (size_t i=0; i<2000; i++) {
+        ck_assert_int_eq(lsm->append(key, val, 0, g_rng), 1);
+        key++;
+        val++;
+    }
+
+    // Queries of varying widths, deliberately not in key order.
+    size_t query_cnt = 200;
+    size_t sample_sz = 20;
+    std::vector<SampleQuery> queries(query_cnt);
+    std::vector<record_t> samples(query_cnt * sample_sz);
+    std::vector<record_t *> results(query_cnt);
+    for (size_t i=0; i<query_cnt; i++) {
+        lsm::key_t lower = gsl_rng_uniform_int(g_rng, 1900);
+        queries[i] = {lower, lower + 1 + gsl_rng_uniform_int(g_rng, 99), sample_sz};
+        results[i] = samples.data() + i * sample_sz;
+    }
+
+    char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+
+    lsm->range_sample_batch(queries.data(), results.data(), query_cnt, buf, util_buf, g_rng);
+
+    for (size_t i=0; i<query_cnt; i++) {
+        for (size_t j=0; j<sample_sz; j++) {
+            ck_assert_int_le(results[i][j].key, queries[i].upper_key);
+            ck_assert_int_ge(results[i][j].key, queries[i].lower_key);
+        }
+    }
+
+    free(buf);
+    free(util_buf);
+
+    delete lsm;
+}
+END_TEST
+
+
 START_TEST(t_range_sample_disklevels)
 {
     auto lsm = new LSMTree(dir, 100, 100, 2, 1, 1, g_rng);
@@ -505,6 +832,9 @@ Suite *unit_testing()
     tcase_add_test(append, t_append);
     tcase_add_test(append, t_append_with_mem_merges);
     tcase_add_test(append, t_append_with_disk_merges);
+    tcase_add_test(append, t_append_with_background_merges);
+    tcase_add_test(append, t_append_multithreaded);
+    tcase_add_test(append, t_append_with_cascading_merges);
     suite_add_tcase(unit, append);
 
     TCase *sampling = tcase_create("lsm::LSMTree::range_sample Testing");
@@ -512,6 +842,10 @@ Suite *unit_testing()
     tcase_add_test(sampling, t_range_sample_memtable);
     tcase_add_test(sampling, t_range_sample_memlevels);
     tcase_add_test(sampling, t_range_sample_disklevels);
+    tcase_add_test(sampling, t_range_sample_batch);
+    tcase_add_test(sampling, t_range_sample_concurrent_with_merges);
+    tcase_add_test(sampling, t_delete_concurrent_with_sampling);
+    tcase_add_test(sampling, t_delete_concurrent_with_appends);
     suite_add_tcase(unit, sampling);
 
     TCase *flat = tcase_create("lsm::LSMTree::get_flat_isam_tree Testing");
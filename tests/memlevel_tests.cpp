@@ -73,6 +73,52 @@ START_TEST(t_memlevel_merge)
 }
 
 
+START_TEST(t_memlevel_merge_pooled)
+{
+    auto pool = std::make_shared<BufferPool>();
+    auto tbl1 = create_test_memtable(500000);
+    auto tbl2 = create_test_memtable(500000);
+    auto tbl3 = create_test_memtable(500000);
+
+    auto base_level = new MemoryLevel(1, 1, root_dir, false, pool);
+    base_level->append_mem_table(tbl1, g_rng);
+    auto merging_level = new MemoryLevel(0, 1, root_dir, false, pool);
+    merging_level->append_mem_table(tbl2, g_rng);
+    ck_assert_int_gt(pool->get_alloc_count(), 0);
+    size_t pooled_size = pool->get_pooled_size();
+
+    // The buffers of the runs merged away are kept by the pool...
+    auto old_level = base_level;
+    base_level = MemoryLevel::merge_levels(old_level, merging_level, false, g_rng);
+    delete old_level;
+    delete merging_level;
+    ck_assert_int_gt(pool->get_pooled_size(), pooled_size);
+
+    // ...and reused for the next run of a similar size, whose records must
+    // not be affected by what the buffers held before.
+    merging_level = new MemoryLevel(0, 1, root_dir, false, pool);
+    merging_level->append_mem_table(tbl3, g_rng);
+    ck_assert_int_gt(pool->get_reuse_count(), 0);
+
+    auto run = merging_level->get_run(0);
+    ck_assert_int_eq(run->get_record_count(), 500000);
+    for (size_t i=1; i<run->get_record_count(); i++) {
+        auto rec = run->get_record(i);
+        ck_assert(!(rec < run->get_record(i - 1)));
+        ck_assert(!rec.get_delete_status());
+    }
+
+    ck_assert_int_eq(base_level->get_record_cnt(), 1000000);
+
+    delete base_level;
+    delete merging_level;
+    delete tbl1;
+    delete tbl2;
+    delete tbl3;
+}
+END_TEST
+
+
 MemoryLevel *create_test_memlevel(size_t reccnt) {
     auto tbl1 = create_test_memtable(reccnt/2);
     auto tbl2 = create_test_memtable(reccnt/2);
@@ -102,7 +148,11 @@ START_TEST(t_persist)
 
     for (size_t i=0; i<level->get_run_count(); i++) {
         for (size_t j=0; j<level->get_run(i)->get_record_count(); j++) {
-            ck_assert_mem_eq((const char*)level->get_record_at(i, j), (const char*)level2->get_record_at(i, j), sizeof(record_t));
+            auto rec1 = level->get_record_at(i, j);
+            auto rec2 = level2->get_record_at(i, j);
+            ck_assert_int_eq(rec1.key, rec2.key);
+            ck_assert_int_eq(rec1.value, rec2.value);
+            ck_assert_int_eq(rec1.header, rec2.header);
         }
     }
 
@@ -118,6 +168,7 @@ Suite *unit_testing()
 
     TCase *merge = tcase_create("lsm::MemoryLevel::merge_level Testing");
     tcase_add_test(merge, t_memlevel_merge);
+    tcase_add_test(merge, t_memlevel_merge_pooled);
     suite_add_tcase(unit, merge);
 
     TCase *persistence = tcase_create("lsm::MemoryLevel::persistence Testing");
@@ -1,6 +1,7 @@
 #include <check.h>
 #include <string>
 #include <thread>
+#include <atomic>
 #include <gsl/gsl_rng.h>
 #include <vector>
 #include <algorithm>
@@ -23,6 +24,10 @@ START_TEST(t_create)
     ck_assert_int_eq(mtable->get_tombstone_count(), 0);
     ck_assert_int_eq(mtable->get_tombstone_capacity(), 50);
 
+    // The buffers that sorted_output copies into count towards the total.
+    ck_assert_int_eq(mtable->get_memory_utilization(), 100 * sizeof(record_t));
+    ck_assert_int_ge(mtable->get_aux_memory_utilization(), 2 * 100 * sizeof(record_t));
+
     delete mtable;
     gsl_rng_free(rng);
 }
@@ -109,6 +114,334 @@ START_TEST(t_insert_tombstones)
 END_TEST
 
 
+START_TEST(t_check_tombstone)
+{
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    size_t cnt = 10000;
+    auto mtable = new MemTable(2 * cnt, true, cnt, rng, 4);
+
+    // Tombstones for every other value of a small set of keys, so that
+    // many share a key, along with a regular record for every value.
+    size_t thread_cnt = 4;
+    std::vector<std::thread> workers(thread_cnt);
+    for (size_t t=0; t<thread_cnt; t++) {
+        workers[t] = std::thread([&, t] {
+            for (size_t i=t; i<cnt; i+=thread_cnt) {
+                mtable->append(i % 16, i, false);
+                if (i % 2 == 0) mtable->append(i % 16, i, true);
+            }
+        });
+    }
+
+    for (auto &w : workers) {
+        w.join();
+    }
+
+    ck_assert_int_eq(mtable->get_tombstone_count(), cnt / 2);
+    for (size_t i=0; i<cnt; i++) {
+        ck_assert_int_eq(mtable->check_tombstone(i % 16, i), i % 2 == 0);
+    }
+    ck_assert_int_eq(mtable->check_tombstone(0, cnt), 0);
+
+    mtable->truncate();
+    for (size_t i=0; i<cnt; i+=2) {
+        ck_assert_int_eq(mtable->check_tombstone(i % 16, i), 0);
+    }
+
+    delete mtable;
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
+START_TEST(t_delete_record)
+{
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    size_t cnt = 1000;
+
+    // Check both the indexed and scanning implementations.
+    for (bool tagging : {true, false}) {
+        auto mtable = new MemTable(cnt, true, cnt, rng, 2, tagging);
+
+        for (size_t i=0; i<cnt / 2; i++) {
+            ck_assert_int_eq(mtable->append(i % 16, i, false), 1);
+            ck_assert_int_eq(mtable->append(i % 16, i + cnt, true), 1);
+        }
+
+        // Tombstones cannot be deleted, and neither can missing records.
+        ck_assert_int_eq(mtable->delete_record(0, cnt), 0);
+        ck_assert_int_eq(mtable->delete_record(1, 0), 0);
+
+        for (size_t i=0; i<cnt / 2; i+=3) {
+            ck_assert_int_eq(mtable->delete_record(i % 16, i), 1);
+        }
+
+        size_t deleted = 0;
+        for (size_t i=0; i<cnt; i++) {
+            auto rec = mtable->get_record_at(i);
+            ck_assert(!rec->get_delete_status());
+            if (mtable->is_deleted(rec)) {
+                ck_assert(!rec->is_tombstone());
+                ck_assert_int_eq(rec->value % 3, 0);
+                deleted++;
+            }
+        }
+        ck_assert_int_eq(deleted, (cnt / 2 + 2) / 3);
+
+        // The delete status is applied to the sorted copy.
+        auto sorted = mtable->sorted_output();
+        size_t sorted_deleted = 0;
+        for (size_t i=0; i<cnt; i++) {
+            if (sorted[i].get_delete_status()) {
+                ck_assert(!sorted[i].is_tombstone());
+                ck_assert_int_eq(sorted[i].value % 3, 0);
+                sorted_deleted++;
+            }
+        }
+        ck_assert_int_eq(sorted_deleted, deleted);
+
+        mtable->truncate();
+        ck_assert_int_eq(mtable->delete_record(0, 0), 0);
+
+        delete mtable;
+    }
+
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
+START_TEST(t_get_range)
+{
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    size_t cnt = 10000;
+    auto mtable = new MemTable(cnt, true, cnt, rng, 4);
+
+    // Enough records that each shard has some sorted blocks, as well as an
+    // unsorted tail.
+    std::vector<std::pair<lsm::key_t, bool>> appended;
+    for (size_t i=0; i<cnt - 500; i++) {
+        lsm::key_t key = gsl_rng_uniform_int(rng, 5000);
+        bool ts = (i % 7 == 0);
+        ck_assert_int_eq(mtable->append(key, i, ts), 1);
+        appended.push_back({key, ts});
+    }
+
+    MemTableRange range;
+    for (size_t q=0; q<50; q++) {
+        lsm::key_t lo = gsl_rng_uniform_int(rng, 5000);
+        lsm::key_t hi = lo + gsl_rng_uniform_int(rng, 1000);
+
+        size_t expected = 0;
+        for (auto &a : appended) {
+            if (!a.second && a.first >= lo && a.first <= hi) expected++;
+        }
+
+        mtable->get_range(lo, hi, range);
+        ck_assert_int_eq(range.get_record_count(), expected);
+
+        for (size_t i=0; i<range.get_record_count(); i++) {
+            auto rec = mtable->get_range_record(range, i);
+            ck_assert(!rec->is_tombstone());
+            ck_assert_int_ge(rec->key, lo);
+            ck_assert_int_le(rec->key, hi);
+        }
+    }
+
+    // An empty range, and one following a truncate.
+    mtable->get_range(6000, 7000, range);
+    ck_assert_int_eq(range.get_record_count(), 0);
+
+    mtable->truncate();
+    mtable->get_range(0, 5000, range);
+    ck_assert_int_eq(range.get_record_count(), 0);
+
+    delete mtable;
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
+START_TEST(t_get_range_multithreaded)
+{
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    size_t cnt = 16 * MEMTABLE_SORTED_BLOCK_SIZE;
+    auto mtable = new MemTable(cnt, true, 0, rng);
+
+    // The writers completing neighbouring blocks may finish sorting them in
+    // either order, but once the memtable is sealed, every full block has
+    // been sorted and published.
+    size_t thread_cnt = 4;
+    std::vector<std::thread> writers;
+    for (size_t t=0; t<thread_cnt; t++) {
+        writers.emplace_back([&, t] {
+            for (size_t i=t; i<cnt; i+=thread_cnt) {
+                mtable->append(i, i);
+            }
+        });
+    }
+
+    for (auto &writer : writers) {
+        writer.join();
+    }
+
+    ck_assert_int_eq(mtable->seal(), cnt);
+
+    MemTableRange range;
+    mtable->get_range(0, cnt, range);
+    ck_assert_int_eq(range.get_record_count(), cnt);
+    ck_assert_int_eq(range.block_record_cnt, cnt);
+    ck_assert(range.unsorted.empty());
+
+    delete mtable;
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
+START_TEST(t_snapshot)
+{
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    size_t cnt = 4000;
+    auto mtable = new MemTable(cnt, true, cnt, rng, 2, true);
+
+    for (size_t i=0; i<cnt / 4; i++) {
+        ck_assert_int_eq(mtable->append(i, i, false), 1);
+    }
+    ck_assert_int_eq(mtable->delete_record(0, 0), 1);
+
+    MemTableSnapshot snapshot;
+    mtable->get_snapshot(snapshot);
+    ck_assert_int_eq(snapshot.get_record_count(), cnt / 4);
+
+    // Tombstones for, and deletes of, records that existed when the snapshot
+    // was taken, along with some new records.
+    for (size_t i=0; i<cnt / 4; i+=2) {
+        ck_assert_int_eq(mtable->append(i, i, true), 1);
+    }
+    for (size_t i=1; i<cnt / 4; i+=2) {
+        ck_assert_int_eq(mtable->delete_record(i, i), 1);
+    }
+    for (size_t i=cnt / 4; i<cnt / 2; i++) {
+        ck_assert_int_eq(mtable->append(i, i, false), 1);
+    }
+
+    for (size_t i=0; i<snapshot.get_record_count(); i++) {
+        auto rec = mtable->get_record_at(i, &snapshot);
+        ck_assert(!rec->is_tombstone());
+        ck_assert_int_lt(rec->key, cnt / 4);
+
+        ck_assert_int_eq(mtable->is_deleted(rec, &snapshot), rec->key == 0);
+        ck_assert_int_eq(mtable->is_deleted(rec), rec->key == 0 || rec->key % 2 == 1);
+
+        ck_assert_int_eq(mtable->check_tombstone(rec->key, rec->value, &snapshot), 0);
+        ck_assert_int_eq(mtable->check_tombstone(rec->key, rec->value), rec->key % 2 == 0);
+    }
+
+    MemTableRange range;
+    mtable->get_range(0, cnt, range, &snapshot);
+    ck_assert_int_eq(range.get_record_count(), cnt / 4);
+    mtable->get_range(0, cnt, range);
+    ck_assert_int_eq(range.get_record_count(), cnt / 2);
+
+    delete mtable;
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
+START_TEST(t_multithreaded_overfill)
+{
+    size_t cnt = 10000;
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    auto mtable = new MemTable(cnt, true, cnt, rng);
+
+    // Attempt twice as many appends as will fit, with half of them as
+    // tombstones, which will also exceed the tombstone capacity.
+    size_t thread_cnt = 8;
+    std::atomic<size_t> successes(0);
+    std::atomic<size_t> tombstones(0);
+    std::vector<std::thread> workers(thread_cnt);
+    for (size_t i=0; i<thread_cnt; i++) {
+        workers[i] = std::thread([&, i] {
+            for (size_t j=0; j<2*cnt/thread_cnt; j++) {
+                bool ts = j % 2;
+                if (mtable->append(i, j, ts)) {
+                    successes++;
+                    if (ts) tombstones++;
+                }
+            }
+        });
+    }
+
+    for (size_t i=0; i<thread_cnt; i++) {
+        workers[i].join();
+    }
+
+    ck_assert_int_eq(successes.load(), cnt);
+    ck_assert_int_eq(mtable->get_record_count(), cnt);
+    ck_assert_int_eq(mtable->get_tombstone_count(), tombstones.load());
+    ck_assert_int_eq(mtable->is_full(), 1);
+
+    delete mtable;
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
+START_TEST(t_seal)
+{
+    size_t cnt = 100000;
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    auto mtable = new MemTable(cnt, true, 100, rng);
+
+    size_t thread_cnt = 4;
+    std::atomic<size_t> successes(0);
+    std::vector<std::thread> workers(thread_cnt);
+    for (size_t i=0; i<thread_cnt; i++) {
+        workers[i] = std::thread([&, i] {
+            for (size_t j=0; j<cnt/thread_cnt; j++) {
+                if (mtable->append(i*cnt + j, i*cnt + j)) successes++;
+            }
+        });
+    }
+
+    // wait for some records to land, and then seal the table while
+    // the writers are still running.
+    while (mtable->get_record_count() < 1000)
+        ;
+
+    size_t sealed_cnt = mtable->seal();
+
+    // every record under the sealed count must be fully written
+    ck_assert_int_eq(mtable->get_record_count(), sealed_cnt);
+    for (size_t i=0; i<sealed_cnt; i++) {
+        auto rec = mtable->get_record_at(i);
+        ck_assert_int_eq(rec->key, rec->value);
+        ck_assert_int_eq(rec->header >> 2, i);
+    }
+
+    for (size_t i=0; i<thread_cnt; i++) {
+        workers[i].join();
+    }
+
+    ck_assert_int_eq(successes.load(), sealed_cnt);
+    ck_assert_int_eq(mtable->get_record_count(), sealed_cnt);
+    ck_assert_int_eq(mtable->is_full(), 1);
+    ck_assert_int_eq(mtable->append(0, 0), 0);
+
+    // truncating reopens the table
+    mtable->truncate();
+    ck_assert_int_eq(mtable->is_full(), 0);
+    ck_assert_int_eq(mtable->append(0, 0), 1);
+    ck_assert_int_eq(mtable->get_record_count(), 1);
+
+    delete mtable;
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
 START_TEST(t_truncate)
 {
     auto rng = gsl_rng_alloc(gsl_rng_mt19937);
@@ -193,6 +526,41 @@ START_TEST(t_sorted_output)
 END_TEST
 
 
+START_TEST(t_sorted_output_large)
+{
+    // Large enough to use the multithreaded radix sort
+    size_t cnt = 300000;
+
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    auto mtable = new MemTable(cnt, true, cnt, rng);
+
+    // Use a small key and value domain, so there are many duplicates,
+    // some of which are tombstones, whose order must be preserved.
+    for (size_t i=0; i<cnt; i++) {
+        lsm::key_t key = (i % 3 == 0) ? rand() % 1000 : ((lsm::key_t) rand() << 32) | rand();
+        lsm::value_t val = rand() % 4;
+        ck_assert_int_eq(mtable->append(key, val, i % 7 == 0), 1);
+    }
+
+    std::vector<record_t> expected(cnt);
+    for (size_t i=0; i<cnt; i++) {
+        expected[i] = *mtable->get_record_at(i);
+    }
+    std::sort(expected.begin(), expected.end(), memtable_record_cmp);
+
+    record_t *sorted_records = mtable->sorted_output();
+    for (size_t i=0; i<cnt; i++) {
+        ck_assert_int_eq(sorted_records[i].key, expected[i].key);
+        ck_assert_int_eq(sorted_records[i].value, expected[i].value);
+        ck_assert_int_eq(sorted_records[i].header, expected[i].header);
+    }
+
+    delete mtable;
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
 void insert_records(std::vector<std::pair<lsm::key_t, lsm::value_t>> *values, size_t start, size_t stop, MemTable *mtable)
 {
     for (size_t i=start; i<stop; i++) {
@@ -246,6 +614,57 @@ START_TEST(t_multithreaded_insert)
 END_TEST
 
 
+START_TEST(t_sharded_insert)
+{
+    size_t cnt = 10000;
+    auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+    auto mtable = new MemTable(cnt, true, cnt/2, rng, 8);
+    ck_assert_int_eq(mtable->get_shard_count(), 8);
+
+    std::vector<std::pair<lsm::key_t, lsm::value_t>> records(cnt);
+    for (size_t i=0; i<cnt; i++) {
+        records[i] = {rand(), rand()};
+    }
+
+    // Use fewer threads than shards, so that the table can only fill
+    // up if appends overflow into other threads' shards.
+    size_t thread_cnt = 4;
+    size_t per_thread = cnt / thread_cnt;
+    std::vector<std::thread> workers(thread_cnt);
+    for (size_t i=0; i<thread_cnt; i++) {
+        workers[i] = std::thread(insert_records, &records, i*per_thread, (i+1)*per_thread, mtable);
+    }
+
+    for (size_t i=0; i<thread_cnt; i++) {
+        workers[i].join();
+    }
+
+    ck_assert_int_eq(mtable->is_full(), 1);
+    ck_assert_int_eq(mtable->get_record_count(), cnt);
+    ck_assert_int_eq(mtable->append(0, 0), 0);
+
+    std::sort(records.begin(), records.end());
+
+    // the shards should be addressable as a single range of records
+    std::vector<std::pair<lsm::key_t, lsm::value_t>> table_records(cnt);
+    for (size_t i=0; i<cnt; i++) {
+        auto rec = mtable->get_record_at(i);
+        table_records[i] = {rec->key, rec->value};
+    }
+    std::sort(table_records.begin(), table_records.end());
+    ck_assert(table_records == records);
+
+    record_t *sorted_records = mtable->sorted_output();
+    for (size_t i=0; i<cnt; i++) {
+        ck_assert_int_eq(sorted_records[i].key, records[i].first);
+    }
+
+    delete mtable;
+    gsl_rng_free(rng);
+}
+END_TEST
+
+
 Suite *unit_testing()
 {
     Suite *unit = suite_create("MemTable Unit Testing");
@@ -259,6 +678,14 @@ Suite *unit_testing()
     tcase_add_test(append, t_insert);
     tcase_add_test(append, t_insert_tombstones);
     tcase_add_test(append, t_multithreaded_insert);
+    tcase_add_test(append, t_multithreaded_overfill);
+    tcase_add_test(append, t_seal);
+    tcase_add_test(append, t_sharded_insert);
+    tcase_add_test(append, t_check_tombstone);
+    tcase_add_test(append, t_delete_record);
+    tcase_add_test(append, t_get_range);
+    tcase_add_test(append, t_get_range_multithreaded);
+    tcase_add_test(append, t_snapshot);
 
     suite_add_tcase(unit, append);
 
@@ -271,6 +698,7 @@ Suite *unit_testing()
 
     TCase *sorted_out = tcase_create("lsm::MemTable::sorted_output");
     tcase_add_test(sorted_out, t_sorted_output);
+    tcase_add_test(sorted_out, t_sorted_output_large);
 
     suite_add_tcase(unit, sorted_out);
 
@@ -0,0 +1,200 @@
+#include <check.h>
+#include <thread>
+#include <vector>
+
+#include "lsm/ShardedLsmTree.h"
+
+using namespace lsm;
+
+gsl_rng *g_rng = gsl_rng_alloc(gsl_rng_mt19937);
+
+std::string dir = "./tests/data/shardedlsm";
+
+START_TEST(t_create)
+{
+    auto lsm = new ShardedLSMTree(dir, {1000, 2000, 3000}, 100, 100, 2, 10, 1, g_rng);
+
+    ck_assert_ptr_nonnull(lsm);
+    ck_assert_int_eq(lsm->get_shard_count(), 4);
+    ck_assert_int_eq(lsm->get_record_cnt(), 0);
+
+    ck_assert_int_eq(lsm->get_shard_idx(0), 0);
+    ck_assert_int_eq(lsm->get_shard_idx(999), 0);
+    ck_assert_int_eq(lsm->get_shard_idx(1000), 1);
+    ck_assert_int_eq(lsm->get_shard_idx(2999), 2);
+    ck_assert_int_eq(lsm->get_shard_idx(3000), 3);
+
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_append)
+{
+    auto lsm = new ShardedLSMTree(dir, {1000, 2000, 3000}, 100, 100, 2, 10, 1, g_rng);
+
+    for (lsm::key_t key=0; key<4000; key++) {
+        ck_assert_int_eq(lsm->append(key, key, 0, g_rng), 1);
+    }
+
+    ck_assert_int_eq(lsm->get_record_cnt(), 4000);
+    for (size_t i=0; i<lsm->get_shard_count(); i++) {
+        ck_assert_int_eq(lsm->get_shard(i)->get_record_cnt(), 1000);
+    }
+
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_concurrent_append)
+{
+    auto lsm = new ShardedLSMTree(dir, {1000, 2000, 3000}, 100, 100, 2, 10, 1, g_rng);
+
+    // Each thread's keys are spread over all of the shards, so that the
+    // writers contend for them.
+    size_t thread_cnt = 4;
+    std::vector<std::thread> writers(thread_cnt);
+    for (size_t t=0; t<thread_cnt; t++) {
+        writers[t] = std::thread([&, t] {
+            auto rng = gsl_rng_alloc(gsl_rng_mt19937);
+            for (lsm::key_t key=t; key<4000; key+=thread_cnt) {
+                lsm->append(key, key, 0, rng);
+            }
+            gsl_rng_free(rng);
+        });
+    }
+
+    for (auto &w : writers) {
+        w.join();
+    }
+
+    ck_assert_int_eq(lsm->get_record_cnt(), 4000);
+    for (size_t i=0; i<lsm->get_shard_count(); i++) {
+        ck_assert_int_eq(lsm->get_shard(i)->get_record_cnt(), 1000);
+    }
+
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_range_sample)
+{
+    auto lsm = new ShardedLSMTree(dir, {1000, 2000, 3000}, 100, 100, 2, 10, 1, g_rng);
+
+    for (lsm::key_t key=0; key<4000; key++) {
+        ck_assert_int_eq(lsm->append(key, key, 0, g_rng), 1);
+    }
+
+    lsm::key_t lower_bound = 500;
+    lsm::key_t upper_bound = 2500;
+
+    char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    record_t sample_set[100];
+
+    lsm->range_sample(sample_set, lower_bound, upper_bound, 100, buf, util_buf, g_rng);
+
+    for (size_t i=0; i<100; i++) {
+        ck_assert_int_le(sample_set[i].key, upper_bound);
+        ck_assert_int_ge(sample_set[i].key, lower_bound);
+        ck_assert_int_eq(sample_set[i].key, sample_set[i].value);
+    }
+
+    free(buf);
+    free(util_buf);
+
+    delete lsm;
+}
+END_TEST
+
+
+START_TEST(t_range_sample_uniform)
+{
+    // The shards are of very different sizes, and the sample range covers
+    // different proportions of each, so a sampler that did not weight the
+    // shards by their in-range record counts would be skewed.
+    auto lsm = new ShardedLSMTree(dir, {100, 3000}, 100, 100, 2, 10, 1, g_rng);
+
+    for (lsm::key_t key=0; key<4000; key++) {
+        ck_assert_int_eq(lsm->append(key, key, 0, g_rng), 1);
+    }
+
+    lsm::key_t lower_bound = 50;
+    lsm::key_t upper_bound = 3049;
+
+    char *buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+    char *util_buf = (char *) std::aligned_alloc(SECTOR_SIZE, PAGE_SIZE);
+
+    size_t sample_sz = 30000;
+    record_t *sample_set = new record_t[sample_sz];
+
+    lsm->range_sample(sample_set, lower_bound, upper_bound, sample_sz, buf, util_buf, g_rng);
+
+    size_t shard_samples[3] = {0, 0, 0};
+    for (size_t i=0; i<sample_sz; i++) {
+        ck_assert_int_le(sample_set[i].key, upper_bound);
+        ck_assert_int_ge(sample_set[i].key, lower_bound);
+        shard_samples[lsm->get_shard_idx(sample_set[i].key)]++;
+    }
+
+    // 50, 2900 and 50 of the 3000 records in range fall within each shard.
+    // The expected counts are 500, 29000 and 500, with a standard deviation
+    // of about 22.
+    ck_assert_int_ge(shard_samples[0], 400);
+    ck_assert_int_le(shard_samples[0], 600);
+    ck_assert_int_ge(shard_samples[2], 400);
+    ck_assert_int_le(shard_samples[2], 600);
+
+    delete[] sample_set;
+    free(buf);
+    free(util_buf);
+
+    delete lsm;
+}
+END_TEST
+
+
+Suite *unit_testing()
+{
+    Suite *unit = suite_create("lsm::ShardedLSMTree Unit Testing");
+
+    TCase *create = tcase_create("lsm::ShardedLSMTree::constructor Testing");
+    tcase_add_test(create, t_create);
+    suite_add_tcase(unit, create);
+
+    TCase *append = tcase_create("lsm::ShardedLSMTree::append Testing");
+    tcase_add_test(append, t_append);
+    tcase_add_test(append, t_concurrent_append);
+    suite_add_tcase(unit, append);
+
+    TCase *sampling = tcase_create("lsm::ShardedLSMTree::range_sample Testing");
+    tcase_add_test(sampling, t_range_sample);
+    tcase_add_test(sampling, t_range_sample_uniform);
+    suite_add_tcase(unit, sampling);
+
+    return unit;
+}
+
+int run_unit_tests()
+{
+    int failed = 0;
+    Suite *unit = unit_testing();
+    SRunner *unit_runner = srunner_create(unit);
+
+    srunner_run_all(unit_runner, CK_NORMAL);
+    failed = srunner_ntests_failed(unit_runner);
+    srunner_free(unit_runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    srand(0);
+    int unit_failed = run_unit_tests();
+
+    return (unit_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}